@@ -23,10 +23,49 @@
 #include "gpio.h"
 
 #include "Bootloader_cfg.h"
+#include "Bootloader_mailbox.h"
 /******************************************************************************/
 
 /*********************************** Defines **********************************/
 #define BOOTLOADER_BUFFER_SIZE  (256)
+#define BOOTLOADER_CHUNK_SIZE   (252)
+
+#define BL_INFO_VERSION         (1)
+/* Reported in the HELLO reply, nothing is gated on it. Commands are told
+ * apart by their code and an older host never sends the new ones, what a
+ * session changes (the ready mark) is asked for with a feature bit. */
+#define BL_PROTOCOL_VERSION     (2)
+#define BL_MAX_WINDOW           (1)
+
+#define BL_FEATURE_GET_INFO         (1U << 0)
+#define BL_FEATURE_BUILD_ID         (1U << 1)
+#define BL_FEATURE_BOOT_MAILBOX     (1U << 2)
+#define BL_FEATURE_METADATA_LOG     (1U << 3)
+#define BL_FEATURE_HELLO            (1U << 4)
+#define BL_FEATURE_BATCH            (1U << 5)
+#define BL_FEATURE_VERIFY           (1U << 6)
+#define BL_FEATURE_READY_MARK       (1U << 7)
+#define BOOTLOADER_FEATURES     (BL_FEATURE_GET_INFO     |\
+                                 BL_FEATURE_BUILD_ID     |\
+                                 BL_FEATURE_BOOT_MAILBOX |\
+                                 BL_FEATURE_METADATA_LOG |\
+                                 BL_FEATURE_HELLO        |\
+                                 BL_FEATURE_BATCH        |\
+                                 BL_FEATURE_VERIFY       |\
+                                 BL_FEATURE_READY_MARK   )
+
+/* First byte clocked out while waiting for a frame, the bridge takes it as
+ * the end of a long operation. Only sent once the host asked for it. */
+#define BL_READY_SIGNAL         (0xA5)
+
+#define BL_BATCH_MAX_COMMANDS       (16)
+#define BL_BATCH_CONTINUE_ON_ERROR  (1U << 0)
+
+#define BL_CRC_MODE_PADDED_BYTES    (1U << 0)
+#define BOOTLOADER_CRC_MODES    (BL_CRC_MODE_PADDED_BYTES)
+
+#define BL_COMPRESSION_NONE     (0)
+#define BL_DELTA_NONE           (0)
 /******************************************************************************/
 
 /*********************************** Macro functions **************************/
@@ -79,7 +118,20 @@ typedef enum
     BL_JUMP_TO_ADDRESS,
     WAIT_FOR_ACK_SIGNAL,
     REPEATED_SIGNAL,
+    BL_GET_INFO,
+    BL_HELLO,
+    BL_BATCH,
+    BL_VERIFY_IMAGE,
 }BL_Command_t;
+
+typedef enum
+{
+    BATCH_OK = 0,
+    BATCH_FAILED,
+    BATCH_SKIPPED,
+    BATCH_UNSUPPORTED,
+    BATCH_DEFERRED,
+}BL_batch_result_t;
 /******************************************************************************/
 
 /*********************************** Function declaration *********************/
@@ -17,6 +17,15 @@
 #define BOOTLOADER_I2C      (4)
 
 #define BOOTLOADER_DEBUG_PROTOCOL   (BOOTLOADER_USB)
+
+#define BOOTLOADER_SPI_MASTER       (0)
+#define BOOTLOADER_SPI_SLAVE        (1)
+
+/* MASTER: the bootloader polls the bridge every few milliseconds.
+ * SLAVE : the bridge (CONFIG_BRIDGE_SPI_MASTER) clocks the frames, the
+ *         bootloader answers through DMA and raises PA4 whenever a frame
+ *         can be taken. */
+#define BOOTLOADER_SPI_ROLE         (BOOTLOADER_SPI_MASTER)
 /******************************************************************************/
 
 #endif /* INC_BOOTLOADER_CFG_H_ */
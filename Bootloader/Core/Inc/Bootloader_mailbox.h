@@ -0,0 +1,55 @@
+/*
+ * Bootloader_mailbox.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Boot request mailbox shared between the bootloader and the application.
+ *  The application writes BL_MAILBOX_UPDATE_REQUEST and performs a soft reset,
+ *  the bootloader reads and clears it at startup. The mailbox lives in an RTC
+ *  backup register, so it survives a system reset but not a power cycle, and
+ *  it costs no flash erase or program cycles.
+ */
+
+#ifndef INC_BOOTLOADER_MAILBOX_H_
+#define INC_BOOTLOADER_MAILBOX_H_
+
+/*********************************** Includes *********************************/
+#include <stdint.h>
+
+#include "stm32f4xx_hal.h"
+/******************************************************************************/
+
+/*********************************** Defines **********************************/
+#define BL_MAILBOX_REGISTER             (RTC->BKP0R)
+
+#define BL_MAILBOX_EMPTY                (0x00000000U)
+#define BL_MAILBOX_UPDATE_REQUEST       (0xB007B007U)
+/******************************************************************************/
+
+/*********************************** Function definition **********************/
+static inline uint32_t bl_mailbox_read(void)
+{
+    /* Backup registers are readable as soon as the PWR clock is running */
+    __HAL_RCC_PWR_CLK_ENABLE();
+    return BL_MAILBOX_REGISTER;
+}
+
+static inline void bl_mailbox_write(uint32_t value)
+{
+    /* Unlock the backup domain, update the mailbox, then lock it again */
+    __HAL_RCC_PWR_CLK_ENABLE();
+    HAL_PWR_EnableBkUpAccess();
+    BL_MAILBOX_REGISTER = value;
+    HAL_PWR_DisableBkUpAccess();
+}
+
+/* Called by the application to enter the bootloader on the next boot */
+static inline void bl_mailbox_request_update(void)
+{
+    bl_mailbox_write(BL_MAILBOX_UPDATE_REQUEST);
+    NVIC_SystemReset();
+}
+/******************************************************************************/
+
+#endif /* INC_BOOTLOADER_MAILBOX_H_ */
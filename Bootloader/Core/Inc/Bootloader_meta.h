@@ -0,0 +1,66 @@
+/*
+ * Bootloader_meta.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Append-only metadata log kept in its own flash sector. Every record is
+ *  a header word, a word-aligned payload and a CRC word. Updating a value
+ *  appends a new record, the newest valid record of each type wins, and
+ *  the sector is only erased when the log is full. An empty record retires
+ *  the value of its type, bl_meta_find() returns NULL for it.
+ */
+
+#ifndef INC_BOOTLOADER_META_H_
+#define INC_BOOTLOADER_META_H_
+
+/*********************************** Includes *********************************/
+#include "Bootloader.h"
+/******************************************************************************/
+
+/*********************************** Defines **********************************/
+#define BL_META_START_ADD               (0x0800C000U)
+#define BL_META_END_ADD                 (0x08010000U)
+#define BL_META_SECTOR                  (FLASH_SECTOR_3)
+
+#define BL_META_MAGIC                   (0x4D42U)
+#define BL_META_MAX_PAYLOAD             (64)
+/******************************************************************************/
+
+/*********************************** Data Types *******************************/
+typedef enum
+{
+    BL_META_BOOT_FLAG = 0,
+    BL_META_IMAGE,
+    BL_META_TYPE_COUNT,
+}BL_meta_type_t;
+
+typedef struct
+{
+    uint16_t magic;
+    uint8_t  type;
+    uint8_t  length;        /* Payload length in bytes, multiple of 4 */
+}BL_meta_record_t;
+
+typedef struct
+{
+    uint8_t  major;
+    uint8_t  minor;
+    uint8_t  patch;
+    uint8_t  slot;
+    uint32_t address;       /* Vector table of the image */
+    uint32_t size;          /* Image size in bytes */
+    uint32_t digest;        /* Frame CRC algorithm run over the image */
+    uint32_t build_id;      /* Supplied by the host, 0 when unknown */
+}BL_image_header_t;
+/******************************************************************************/
+
+/*********************************** Function declaration *********************/
+BL_status_t bl_meta_init(void);
+BL_status_t bl_meta_append(BL_meta_type_t type,
+                           const void *payload,
+                           uint8_t length);
+const void *bl_meta_find(BL_meta_type_t type, uint8_t length);
+/******************************************************************************/
+
+#endif /* INC_BOOTLOADER_META_H_ */
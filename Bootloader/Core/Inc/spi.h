@@ -29,12 +29,17 @@ extern "C" {
 #include "main.h"
 
 /* USER CODE BEGIN Includes */
+#include "Bootloader_cfg.h"
 
 /* USER CODE END Includes */
 
 extern SPI_HandleTypeDef hspi1;
 
 /* USER CODE BEGIN Private defines */
+#if (BOOTLOADER_SPI_ROLE == BOOTLOADER_SPI_SLAVE)
+extern DMA_HandleTypeDef hdma_spi1_rx;
+extern DMA_HandleTypeDef hdma_spi1_tx;
+#endif
 
 /* USER CODE END Private defines */
 
@@ -61,6 +61,8 @@ void RCC_IRQHandler(void);
 void OTG_FS_IRQHandler(void);
 void FPU_IRQHandler(void);
 /* USER CODE BEGIN EFP */
+void DMA2_Stream0_IRQHandler(void);
+void DMA2_Stream3_IRQHandler(void);
 
 /* USER CODE END EFP */
 
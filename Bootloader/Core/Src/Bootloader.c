@@ -7,17 +7,14 @@
 
 /*********************************** Includes *********************************/
 #include "Bootloader.h"
+#include "Bootloader_meta.h"
 /******************************************************************************/
 
 /*********************************** Defines **********************************/
 #define bootloader_spi                  (&hspi1)
 #define bootloader_crc                  (&hcrc)
-
-#define BOOT_FLAG_ADD                   (0x0803FFFFU)
-#define VERSION_BASE_ADD                (0x0803FFFCU)
-#define MAJOR_ADD                       (VERSION_BASE_ADD)
-#define MINOR_ADD                       (VERSION_BASE_ADD + 1)
-#define PATCH_ADD                       (VERSION_BASE_ADD + 2)
+#define bootloader_ready_port           (ESP32slave_GPIO_Port)
+#define bootloader_ready_pin            (ESP32slave_Pin)
 
 #define COMMAND_LENGTH_INDEX            (0)
 #define COMMAND_TYPE_INDEX              (1)
@@ -25,20 +22,49 @@
 #define ERASE_SUCCESS                   (0xFFFFFFFFU)
 #define NUMBER_FLASH_SECTORS            (6)
 
-#define ALLOWED_PROGRAM_START_ADD       (0x0800C000U)
-#define ALLOWED_PROGRAM_END_ADD         (0x0803FFFFU - 8)
+#define ALLOWED_PROGRAM_START_ADD       (0x08010000U)
+#define ALLOWED_PROGRAM_END_ADD         (0x08040000U)
+#define PROGRAM_FIRST_SECTOR            (SECTOR_4)
+#define PROGRAM_NUMBER_SECTORS          (2)
+#define SECTOR_5_START_ADD              (0x08020000U)
 
-#define LAST_FLASHED_PROGRAM_ADD        (0x0803FFF8U)
+#define WRITE_HEADER_BUILD_ID_LENGTH    (20)
+#define REPLY_SEND_ATTEMPTS             (500)
+#define SPI_REPLY_TIMEOUT               (30U)   /* ms per exchange of an ACK, NACK or reply */
+#define HELLO_REQUEST_LENGTH            (10)
+#define BATCH_COUNT_INDEX               (3)
+#define BATCH_ENTRIES_INDEX             (4)
+#define FRAME_OVERHEAD                  (4)
 #define JUMP_MAIN_APP_COMMAND           (0xFFFFFFFFU)
 
 #define PROGRAM_NOT_FOUND_FLAG          (0xFFFFFFFFU)
 /******************************************************************************/
 
 /*********************************** Macro functions **************************/
+#if (BOOTLOADER_SPI_ROLE == BOOTLOADER_SPI_SLAVE)
+/* The bridge only clocks when it has a frame, there is nothing to wait for */
+#define BL_POLL_DELAY(ms)
+#else
+/* Give the bridge time to queue the next frame before clocking again */
+#define BL_POLL_DELAY(ms)               HAL_Delay(ms)
+#endif
+
 #define GET_4BYTES(buffer, Start)      ((buffer[Start + 3])            |\
                                         (buffer[Start + 2] << (1*8))   |\
                                         (buffer[Start + 1] << (2*8))   |\
                                         (buffer[Start    ] << (3*8))   )     
+
+#define PUT_2BYTES(buffer, Start, val) do {                                 \
+                                        buffer[Start    ] = (uint8_t)((val) >> 8);   \
+                                        buffer[Start + 1] = (uint8_t)(val);          \
+                                       } while (0)
+
+#define PUT_4BYTES(buffer, Start, val) do {                                 \
+                                        buffer[Start    ] = (uint8_t)((val) >> 24);  \
+                                        buffer[Start + 1] = (uint8_t)((val) >> 16);  \
+                                        buffer[Start + 2] = (uint8_t)((val) >> 8);   \
+                                        buffer[Start + 3] = (uint8_t)(val);          \
+                                       } while (0)
 /******************************************************************************/
 
 /*********************************** Static Function declaration **************/
@@ -47,26 +73,44 @@ static BL_status_t bootloader_command_execute(uint8_t *buffer,
                                               uint8_t length,
                                               uint8_t command);
 static CRC_check_t bl_crc_check(uint8_t *buffer, uint8_t length);
+static uint32_t bl_crc_calculate(uint8_t *buffer, uint32_t size);
+static BL_status_t bl_send_reply(const char *name);
+static void bl_finish_reply(uint8_t index);
 static BL_status_t Send_ACK(void);
 static BL_status_t Send_NACK(void);
 static BL_status_t bl_get_version(uint8_t *buffer, uint8_t length);
+static BL_status_t bl_get_info(uint8_t *buffer, uint8_t length);
+static BL_status_t bl_hello(uint8_t *buffer, uint8_t length);
+static BL_status_t bl_batch(uint8_t *buffer, uint8_t length);
+static BL_status_t bl_verify_image(uint8_t *buffer, uint8_t length);
+static BL_status_t verify_image(uint32_t expected, uint32_t *digest);
 static BL_status_t bl_jump_to_address(uint8_t *buffer, uint8_t length);
 static BL_status_t jump_main_app(BOOT_status_t next_boot);
 static BL_status_t jump_add(uint32_t add);
 static BL_status_t bl_deinit(void);
 static BL_status_t bl_erase_sectors(uint8_t *buffer, uint8_t length);
 static BL_status_t bl_write_program(uint8_t *buffer, uint8_t length);
-static BL_status_t mass_erase_execute();
 static BL_status_t sector_erase_execute(erase_sectors_t start, uint8_t num);
+static void bl_retire_image(erase_sectors_t start, uint8_t num);
+static erase_sectors_t bl_sector_of(uint32_t add);
 static BL_status_t write_program(uint32_t add, uint32_t size);
-static BL_status_t write_version(uint8_t major, uint8_t minor, uint8_t patch);
+static uint32_t image_digest(uint32_t add, uint32_t size);
+static const BL_image_header_t *bl_get_image(void);
+static uint8_t bl_image_bootable(const BL_image_header_t *image);
 static void jump_main_app_without_boot_edit(void);
+static void bl_mark_ready(void);
+static HAL_StatusTypeDef bl_spi_exchange(uint8_t *send, uint8_t *receive, uint32_t timeout);
 /******************************************************************************/
 
 /*********************************** Global Objects ***************************/
 static uint8_t BL_buffer[BOOTLOADER_BUFFER_SIZE];
 static uint8_t BL_Buffer_send[BOOTLOADER_BUFFER_SIZE];
 static uint8_t BL_Buffer_temp[BOOTLOADER_BUFFER_SIZE];
+static uint8_t BL_update_requested = 0;
+static uint32_t BL_session_features = 0;
+#if (BOOTLOADER_SPI_ROLE == BOOTLOADER_SPI_SLAVE)
+static volatile uint8_t BL_spi_done = 0;
+#endif
 /******************************************************************************/
 
 /*********************************** Function definition **********************/
@@ -94,15 +138,12 @@ void bootloader_app(void)
             memset(BL_buffer,      0x00, BOOTLOADER_BUFFER_SIZE);
             memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
             memset(BL_Buffer_temp, 0x00, BOOTLOADER_BUFFER_SIZE);
-            HAL_Delay(10);
-            hal_status = HAL_SPI_TransmitReceive(bootloader_spi,
-                                                 BL_Buffer_send,
-                                                 BL_buffer,
-                                                 BOOTLOADER_BUFFER_SIZE,
-                                                 HAL_MAX_DELAY);
+            bl_mark_ready();
+            BL_POLL_DELAY(10);
+            hal_status = bl_spi_exchange(BL_Buffer_send, BL_buffer, HAL_MAX_DELAY);
             if (0 == memcmp(BL_buffer, BL_Buffer_temp, BOOTLOADER_BUFFER_SIZE))
             {
-                HAL_Delay(15);
+                BL_POLL_DELAY(15);
                 continue;
             }
             if (HAL_OK != hal_status)
@@ -134,6 +175,9 @@ void bootloader_app(void)
                     {
                         /* Send NOT ACK in case of CRC OK*/
                         bl_status = Send_ACK();
+                        /* A host is talking to us, stay until it asks for the jump even once
+                           the image it writes makes the application bootable again */
+                        BL_update_requested = 1;
                         /* check for command execution status */
                         if (BL_OK != bl_status)
                         {
@@ -167,6 +211,7 @@ void bootloader_init(void)
     MX_CRC_Init();
     MX_USB_DEVICE_Init();
     MX_SPI1_Init();
+    bl_meta_init();
 }
 /******************************************************************************/
 
@@ -175,9 +220,29 @@ void bootloader_init(void)
 static BOOT_status_t bl_check_boot_need(void)
 {
     BOOT_status_t boot_status = 0;
-    /* Read the boot flag from flash memory */
-    volatile uint8_t *boot_flag = (volatile uint8_t *)(BOOT_FLAG_ADD);
-    boot_status = (BOOT_status_t)*boot_flag;
+    /* A pending request from the application wins over the flash flag */
+    if (BL_MAILBOX_UPDATE_REQUEST == bl_mailbox_read())
+    {
+        /* Consume the request so the next reset boots normally */
+        bl_mailbox_write(BL_MAILBOX_EMPTY);
+        BL_update_requested = 1;
+    }
+    /* The request or a served command holds for the whole session, not just the first command */
+    if (1 == BL_update_requested)
+    {
+        boot_status = BOOT_NEEDED;
+    }
+    /* Nothing to jump to, stay in the bootloader */
+    else if (0 == bl_image_bootable(bl_get_image()))
+    {
+        boot_status = BOOT_NEEDED;
+    }
+    else
+    {
+        /* Read the latest boot flag record, erased flash means needed */
+        const uint32_t *boot_flag = bl_meta_find(BL_META_BOOT_FLAG, sizeof(uint32_t));
+        boot_status = (NULL != boot_flag) ? (BOOT_status_t)*boot_flag : BOOT_NEEDED;
+    }
     /* return the flag */
     return boot_status;
 }
@@ -225,6 +290,42 @@ static BL_status_t bootloader_command_execute(uint8_t *buffer,
         BL_status = bl_jump_to_address(buffer, length);
         break;
 
+    /* If the host wants a description of the device and its image */
+    case BL_GET_INFO:
+#if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
+        printf("Command received : BL_GET_INFO !!\n");
+#endif
+        /* Call the execute function of this command */
+        BL_status = bl_get_info(buffer, length);
+        break;
+
+    /* If the host starts a session and wants to agree on the features */
+    case BL_HELLO:
+#if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
+        printf("Command received : BL_HELLO !!\n");
+#endif
+        /* Call the execute function of this command */
+        BL_status = bl_hello(buffer, length);
+        break;
+
+    /* If the host wants several commands executed in one round trip */
+    case BL_BATCH:
+#if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
+        printf("Command received : BL_BATCH !!\n");
+#endif
+        /* Call the execute function of this command */
+        BL_status = bl_batch(buffer, length);
+        break;
+
+    /* If the host wants the flashed image checked against its digest */
+    case BL_VERIFY_IMAGE:
+#if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
+        printf("Command received : BL_VERIFY_IMAGE !!\n");
+#endif
+        /* Call the execute function of this command */
+        BL_status = bl_verify_image(buffer, length);
+        break;
+
     default:
         BL_status = BL_ERROR;
         break;
@@ -242,14 +343,10 @@ static BL_status_t Send_ACK(void)
         /* Reset the buffer to get ready for ACK signal */
         memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
         memset(BL_Buffer_temp, 0x00, BOOTLOADER_BUFFER_SIZE);
-        HAL_Delay(10);
+        BL_POLL_DELAY(10);
         BL_Buffer_send[0] = (uint8_t)ACK_SIGNAL;
-        status = HAL_SPI_TransmitReceive(bootloader_spi,
-                                         BL_Buffer_send,
-                                         BL_Buffer_temp,
-                                         BOOTLOADER_BUFFER_SIZE,
-                                         HAL_MAX_DELAY);
-        HAL_Delay(10);
+        status = bl_spi_exchange(BL_Buffer_send, BL_Buffer_temp, SPI_REPLY_TIMEOUT);
+        BL_POLL_DELAY(10);
         waited_cycles++;
         if(waited_cycles >= 2000)
         {
@@ -270,14 +367,11 @@ static BL_status_t Send_NACK(void)
         /* Reset the buffer to get ready for ACK signal */
         memset(BL_Buffer_temp, 0x00, BOOTLOADER_BUFFER_SIZE);
         memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
-        HAL_Delay(10);
+        BL_POLL_DELAY(10);
         BL_Buffer_send[0] = (uint8_t)NACK_SIGNAL;
-        status = HAL_SPI_TransmitReceive(bootloader_spi,
-                                         BL_Buffer_send,
-                                         BL_Buffer_temp,
-                                         BOOTLOADER_BUFFER_SIZE,
-                                         HAL_MAX_DELAY);
-        HAL_Delay(10);
+        status = bl_spi_exchange(BL_Buffer_send, BL_Buffer_temp, SPI_REPLY_TIMEOUT);
+        BL_POLL_DELAY(10);
+        waited_cycles++;
         if(waited_cycles >= 2000)
         {
             bl_status = BL_ERROR;
@@ -291,23 +385,12 @@ static CRC_check_t bl_crc_check(uint8_t *buffer, uint8_t length)
 {
     CRC_check_t status = CRC_NOT_OK;
     uint32_t crc_val = 0;
-    uint32_t counter = 0;
-    uint32_t data_buffer = 0;
     /* Get the host CRC from the buffer */
     uint32_t host_crc_val = 0;
     host_crc_val |= GET_4BYTES(buffer, length - 3);
 
-    /* Reset CRC Unit */
-    __HAL_CRC_DR_RESET(bootloader_crc);
-
     /* Calculate local CRC */
-    for (counter = 0; counter <= length - 4; counter++)
-    {
-        data_buffer = 0;
-        data_buffer |= (uint32_t)(buffer[counter]);
-        //printf("data_buffer: %lx\n", data_buffer);
-        crc_val = HAL_CRC_Accumulate(bootloader_crc, &data_buffer, 1);
-    }
+    crc_val = bl_crc_calculate(buffer, length - 3);
 
     /* Check if they are typical or not */
     if (host_crc_val == crc_val)
@@ -321,56 +404,295 @@ static CRC_check_t bl_crc_check(uint8_t *buffer, uint8_t length)
     return status;
 }
 
-static BL_status_t bl_get_version(uint8_t *buffer, uint8_t length)
+static uint32_t bl_crc_calculate(uint8_t *buffer, uint32_t size)
+{
+    uint32_t crc_val = 0;
+    uint32_t data_buffer = 0;
+    /* Reset CRC Unit */
+    __HAL_CRC_DR_RESET(bootloader_crc);
+    /* Every byte is fed to the CRC unit as its own word */
+    for (uint32_t counter = 0; counter < size; counter++)
+    {
+        data_buffer = (uint32_t)(buffer[counter]);
+        crc_val = HAL_CRC_Accumulate(bootloader_crc, &data_buffer, 1);
+    }
+    return crc_val;
+}
+
+static BL_status_t bl_send_reply(const char *name)
 {
-    UNUSED(buffer);
-    UNUSED(length);
     BL_status_t status = BL_ERROR;
     HAL_StatusTypeDef hal_status = HAL_ERROR;
-    uint8_t spi_send_fail = 0;
-    /* Read the addresses which store the version in flash memory */
-    uint8_t major = *(uint8_t *)MAJOR_ADD;
-    HAL_Delay(2);
-    uint8_t minor = *(uint8_t *)MINOR_ADD;
-    HAL_Delay(2);
-    uint8_t patch = *(uint8_t *)PATCH_ADD;
-    HAL_Delay(2);
-    /* Update the buffer to get ready for sending it */
-    memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
-    BL_Buffer_send[0] = major;
-    BL_Buffer_send[1] = minor;
-    BL_Buffer_send[2] = patch;
-    /* Send the buffer including the version to the host */
+    uint32_t spi_send_fail = 0;
+    /* Keep BL_Buffer_send on the bus until the host asks for the reply */
     do
     {
-        hal_status = HAL_SPI_TransmitReceive(bootloader_spi, BL_Buffer_send,
-                                             BL_Buffer_temp,
-                                             BOOTLOADER_BUFFER_SIZE,
-                                             HAL_MAX_DELAY);
+        hal_status = bl_spi_exchange(BL_Buffer_send, BL_Buffer_temp, SPI_REPLY_TIMEOUT);
         spi_send_fail++;
-        if (spi_send_fail >= 100)
+        if (spi_send_fail >= REPLY_SEND_ATTEMPTS)
             break;
-        HAL_Delay(50);
+        BL_POLL_DELAY(10);
     } while ((HAL_OK != hal_status) || (BL_Buffer_temp[0] != REPEATED_SIGNAL));
     /* check if the spi sends the data */
-    if ((HAL_OK == hal_status) && (spi_send_fail < 100))
+    if ((HAL_OK == hal_status) && (spi_send_fail < REPLY_SEND_ATTEMPTS))
     {
 #if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
-        printf("Version Sent Successfully!!\n");
+        printf("%s Sent Successfully!!\n", name);
 #endif
         status = BL_OK;
     }
     else
     {
 #if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
-        printf("Error in Sending Version!!\n");
+        printf("Error in Sending %s!!\n", name);
 #endif
         status = BL_ERROR;
     }
+    return status;
+}
+
+static void bl_finish_reply(uint8_t index)
+{
+    /* Same trailer as the host frames, length is the index of the last byte */
+    BL_Buffer_send[COMMAND_LENGTH_INDEX] = index + 3;
+    PUT_4BYTES(BL_Buffer_send, index, bl_crc_calculate(BL_Buffer_send, index));
+}
+
+static BL_status_t bl_get_version(uint8_t *buffer, uint8_t length)
+{
+    UNUSED(buffer);
+    UNUSED(length);
+    BL_status_t status = BL_ERROR;
+    /* Read the version of the latest image record */
+    const BL_image_header_t *image = bl_get_image();
+    /* Update the buffer to get ready for sending it */
+    memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
+    if (NULL != image)
+    {
+        BL_Buffer_send[0] = image->major;
+        BL_Buffer_send[1] = image->minor;
+        BL_Buffer_send[2] = image->patch;
+    }
+    else
+    {
+        /* Same answer as the erased version bytes used to give */
+        memset(BL_Buffer_send, 0xFF, 3);
+    }
+    /* Send the buffer including the version to the host */
+    status = bl_send_reply("Version");
     /* Return the status of the get version execution function */
     return status;
 }
 
+static BL_status_t bl_get_info(uint8_t *buffer, uint8_t length)
+{
+    UNUSED(buffer);
+    UNUSED(length);
+    BL_status_t status = BL_ERROR;
+    uint8_t index = 2;
+    const BL_image_header_t *image = bl_get_image();
+    BL_image_header_t empty_image;
+    /* Describe an empty device with erased values */
+    if (NULL == image)
+    {
+        memset(&empty_image, 0xFF, sizeof(empty_image));
+        image = &empty_image;
+    }
+    /* Build the reply as a frame: length, command, fields, CRC */
+    memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
+    BL_Buffer_send[COMMAND_TYPE_INDEX] = BL_GET_INFO;
+    BL_Buffer_send[index++] = BL_INFO_VERSION;
+    /* Running image */
+    BL_Buffer_send[index++] = image->major;
+    BL_Buffer_send[index++] = image->minor;
+    BL_Buffer_send[index++] = image->patch;
+    BL_Buffer_send[index++] = image->slot;
+    PUT_4BYTES(BL_Buffer_send, index, image->address);   index += 4;
+    PUT_4BYTES(BL_Buffer_send, index, image->size);      index += 4;
+    PUT_4BYTES(BL_Buffer_send, index, image->digest);    index += 4;
+    PUT_4BYTES(BL_Buffer_send, index, image->build_id);  index += 4;
+    /* Protocol */
+    PUT_4BYTES(BL_Buffer_send, index, BOOTLOADER_FEATURES);     index += 4;
+    PUT_2BYTES(BL_Buffer_send, index, BOOTLOADER_BUFFER_SIZE);  index += 2;
+    PUT_2BYTES(BL_Buffer_send, index, BOOTLOADER_CHUNK_SIZE);   index += 2;
+    /* Flash geometry */
+    PUT_4BYTES(BL_Buffer_send, index, ALLOWED_PROGRAM_START_ADD);   index += 4;
+    PUT_4BYTES(BL_Buffer_send, index, ALLOWED_PROGRAM_END_ADD);     index += 4;
+    PUT_4BYTES(BL_Buffer_send, index, BL_META_START_ADD);           index += 4;
+    BL_Buffer_send[index++] = PROGRAM_FIRST_SECTOR;
+    BL_Buffer_send[index++] = NUMBER_FLASH_SECTORS;
+    bl_finish_reply(index);
+    /* Send the info frame to the host */
+    status = bl_send_reply("Info");
+    return status;
+}
+
+static BL_status_t bl_hello(uint8_t *buffer, uint8_t length)
+{
+    BL_status_t status = BL_ERROR;
+    uint8_t index = 2;
+    /* Hosts without features in their hello get the legacy protocol */
+    uint8_t host_protocol = 1;
+    uint32_t host_features = 0;
+    if (HELLO_REQUEST_LENGTH <= length)
+    {
+        host_protocol = buffer[2];
+        host_features = (uint32_t)GET_4BYTES(buffer, 3);
+    }
+    /* Only the common features change behaviour, the protocol is reported back */
+    BL_session_features = host_features & BOOTLOADER_FEATURES;
+    /* Build the reply as a frame: length, command, fields, CRC */
+    memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
+    BL_Buffer_send[COMMAND_TYPE_INDEX] = BL_HELLO;
+    BL_Buffer_send[index++] = BL_PROTOCOL_VERSION;
+    BL_Buffer_send[index++] = (host_protocol < BL_PROTOCOL_VERSION) ?
+                              host_protocol : BL_PROTOCOL_VERSION;
+    PUT_4BYTES(BL_Buffer_send, index, BOOTLOADER_FEATURES);     index += 4;
+    PUT_4BYTES(BL_Buffer_send, index, BL_session_features);     index += 4;
+    BL_Buffer_send[index++] = BOOTLOADER_CRC_MODES;
+    PUT_2BYTES(BL_Buffer_send, index, BOOTLOADER_BUFFER_SIZE);  index += 2;
+    PUT_2BYTES(BL_Buffer_send, index, BOOTLOADER_CHUNK_SIZE);   index += 2;
+    BL_Buffer_send[index++] = BL_MAX_WINDOW;
+    BL_Buffer_send[index++] = BL_COMPRESSION_NONE;
+    BL_Buffer_send[index++] = BL_DELTA_NONE;
+    bl_finish_reply(index);
+    /* Send the capabilities frame to the host */
+    status = bl_send_reply("Hello");
+    return status;
+}
+
+static BL_status_t bl_batch(uint8_t *buffer, uint8_t length)
+{
+    BL_status_t status = BL_ERROR;
+    uint8_t flags = buffer[2];
+    uint8_t count = buffer[BATCH_COUNT_INDEX];
+    uint8_t requested = count;
+    uint8_t index = BATCH_ENTRIES_INDEX;
+    uint8_t end = length - 3;          // First byte of the CRC
+    uint8_t executed = 0;
+    uint8_t failed = 0;
+    uint8_t *entry = NULL;
+    uint8_t *deferred = NULL;
+    BL_batch_result_t results[BL_BATCH_MAX_COMMANDS];
+    if (count > BL_BATCH_MAX_COMMANDS)
+    {
+        /* Too long to report on, none of it runs and the host sees 0 of them executed */
+        count = BL_BATCH_MAX_COMMANDS;
+        for (uint8_t command = 0; command < count; command++)
+            results[command] = BATCH_UNSUPPORTED;
+        failed = 1;
+    }
+    /* Every entry is laid out as a frame without CRC: length, command, arguments,
+       where the length counts the bytes after it */
+    for (uint8_t command = 0; (requested == count) && (command < count); command++)
+    {
+        entry = &buffer[index];
+        if ((0 == failed) || (flags & BL_BATCH_CONTINUE_ON_ERROR))
+        {
+            if ((index >= end) || (0 == entry[0]) || ((index + 1 + entry[0]) > end))
+            {
+                /* A broken entry hides where the next one starts */
+                for (; command < count; command++)
+                    results[command] = BATCH_UNSUPPORTED;
+                failed = 1;
+                break;
+            }
+            executed++;
+            switch (entry[COMMAND_TYPE_INDEX])
+            {
+            case BL_ERASE_SECTORS:
+                results[command] = (BL_OK == bl_erase_sectors(entry, entry[0] + FRAME_OVERHEAD)) ?
+                                   BATCH_OK : BATCH_FAILED;
+                break;
+            case BL_VERIFY_IMAGE:
+                results[command] = (BL_OK == verify_image((uint32_t)GET_4BYTES(entry, 2), NULL)) ?
+                                   BATCH_OK : BATCH_FAILED;
+                break;
+            /* These never return to the loop, they run after the reply */
+            case BL_WRITE_PROGRAM:
+            case BL_JUMP_TO_ADDRESS:
+                if ((command + 1) == count)
+                {
+                    deferred = entry;
+                    results[command] = BATCH_DEFERRED;
+                }
+                else
+                    results[command] = BATCH_UNSUPPORTED;
+                break;
+            default:
+                results[command] = BATCH_UNSUPPORTED;
+                break;
+            }
+            if ((BATCH_OK != results[command]) && (BATCH_DEFERRED != results[command]))
+                failed = 1;
+        }
+        else
+        {
+            results[command] = BATCH_SKIPPED;
+        }
+        index += 1 + entry[0];
+    }
+    /* One combined status for the whole batch */
+    memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
+    BL_Buffer_send[COMMAND_TYPE_INDEX] = BL_BATCH;
+    BL_Buffer_send[2] = executed;
+    BL_Buffer_send[3] = requested;
+    for (uint8_t command = 0; command < count; command++)
+        BL_Buffer_send[BATCH_ENTRIES_INDEX + command] = (uint8_t)results[command];
+    bl_finish_reply(BATCH_ENTRIES_INDEX + count);
+    status = bl_send_reply("Batch");
+    /* The last command continues the session only if nothing failed before it */
+    if ((BL_OK == status) && (NULL != deferred) && (0 == failed))
+    {
+        if (BL_WRITE_PROGRAM == deferred[COMMAND_TYPE_INDEX])
+            status = bl_write_program(deferred, deferred[0] + FRAME_OVERHEAD);
+        else
+            status = bl_jump_to_address(deferred, deferred[0] + FRAME_OVERHEAD);
+    }
+    else if (0 != failed)
+    {
+        status = BL_ERROR;
+    }
+    return status;
+}
+
+static BL_status_t bl_verify_image(uint8_t *buffer, uint8_t length)
+{
+    UNUSED(length);
+    BL_status_t status = BL_ERROR;
+    uint32_t digest = 0;
+    uint8_t index = 2;
+    /* Check the image and report the digest found in flash */
+    status = verify_image((uint32_t)GET_4BYTES(buffer, 2), &digest);
+    memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
+    BL_Buffer_send[COMMAND_TYPE_INDEX] = BL_VERIFY_IMAGE;
+    BL_Buffer_send[index++] = (BL_OK == status) ? BATCH_OK : BATCH_FAILED;
+    PUT_4BYTES(BL_Buffer_send, index, digest);  index += 4;
+    bl_finish_reply(index);
+    status = bl_send_reply("Verify");
+    return status;
+}
+
+static BL_status_t verify_image(uint32_t expected, uint32_t *digest)
+{
+    BL_status_t status = BL_ERROR;
+    uint32_t flash_digest = 0;
+    const BL_image_header_t *image = bl_get_image();
+    if (NULL != image)
+    {
+        /* Recompute over flash, the record alone would not catch a bad write */
+        flash_digest = image_digest(image->address, image->size);
+        if ((flash_digest == image->digest) && (flash_digest == expected))
+            status = BL_OK;
+    }
+    if (NULL != digest)
+        *digest = flash_digest;
+#if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
+    printf("Verify Image: %s\n", (BL_OK == status) ? "OK" : "FAILED");
+#endif
+    return status;
+}
+
 static BL_status_t bl_jump_to_address(uint8_t *buffer, uint8_t length)
 {
     UNUSED(length);
@@ -387,12 +709,31 @@ static BL_status_t bl_jump_to_address(uint8_t *buffer, uint8_t length)
     return status;
 }
 
+static const BL_image_header_t *bl_get_image(void)
+{
+    /* Latest image record, or NULL when nothing was flashed yet */
+    return bl_meta_find(BL_META_IMAGE, sizeof(BL_image_header_t));
+}
+
+static uint8_t bl_image_bootable(const BL_image_header_t *image)
+{
+    /* Both the initial MSP and the reset vector have to be programmed */
+    return (NULL != image) &&
+           (PROGRAM_NOT_FOUND_FLAG != ((const uint32_t *)image->address)[0]) &&
+           (PROGRAM_NOT_FOUND_FLAG != ((const uint32_t *)image->address)[1]);
+}
+
 static void jump_main_app_without_boot_edit(void)
 {
+    const BL_image_header_t *image = bl_get_image();
+    uint32_t *program_ptr_check = NULL;
+    appPtr main_app = NULL;
+    /* Never jump into erased flash, the next call stays in the bootloader */
+    if (0 == bl_image_bootable(image))
+        return;
     /* Get the address of main application */
-    uint32_t *addPtr = (uint32_t *)(LAST_FLASHED_PROGRAM_ADD);
-    uint32_t *program_ptr_check = (uint32_t *)(*addPtr);
-    appPtr main_app = (appPtr)(*(program_ptr_check + 1));
+    program_ptr_check = (uint32_t *)(image->address);
+    main_app = (appPtr)(*(program_ptr_check + 1));
     bl_deinit();
     /* Set the MSP */
     __set_MSP(program_ptr_check[0]);
@@ -403,43 +744,22 @@ static void jump_main_app_without_boot_edit(void)
 static BL_status_t jump_main_app(BOOT_status_t next_boot)
 {
     BL_status_t status = BL_ERROR;
-    HAL_StatusTypeDef hal_status = HAL_ERROR;
-    /* Get the address of main application */
-    uint32_t *addPtr = (uint32_t *)(LAST_FLASHED_PROGRAM_ADD);
-    uint32_t *program_ptr_check = (uint32_t *)(*addPtr);
-    appPtr main_app = (appPtr)(*(program_ptr_check + 1));
+    const BL_image_header_t *image = bl_get_image();
     /* Check for Program found */
-    if (addPtr[0] != PROGRAM_NOT_FOUND_FLAG)
+    if (0 != bl_image_bootable(image))
     {
-        if ((next_boot == BOOT_NEEDED) || (next_boot == BOOT_NOT_NEEDED))
+        uint32_t *program_ptr_check = (uint32_t *)(image->address);
+        appPtr main_app = (appPtr)(*(program_ptr_check + 1));
+        const uint32_t *boot_flag = bl_meta_find(BL_META_BOOT_FLAG, sizeof(uint32_t));
+        uint32_t boot_record = (uint32_t)next_boot;
+        if (((next_boot == BOOT_NEEDED) || (next_boot == BOOT_NOT_NEEDED)) &&
+            ((NULL == boot_flag) || (boot_record != *boot_flag)))
         {
-            /* Unlock the Flash memory */
-            hal_status = HAL_FLASH_Unlock();
-            if (HAL_OK != hal_status)
-            {
-                status = BL_ERROR;
-            }
-            else
-            {
-                /* Boot Update status for next boot */
-                status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE,
-                                           BOOT_FLAG_ADD,
-                                           next_boot);
-                /* Check for Erasing success */
-                if (HAL_OK == hal_status)
-                    status = BL_OK;
-                else
-                    status = BL_ERROR;
+            /* Boot Update status for next boot, a few words appended to the log */
+            status = bl_meta_append(BL_META_BOOT_FLAG, &boot_record, sizeof(boot_record));
 #if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
-                printf("next boot DONE ...\n");
+            printf("next boot DONE ...\n");
 #endif
-
-                /* Lock the Flash memory */
-                do
-                {
-                    hal_status = HAL_FLASH_Lock();
-                } while (HAL_OK != hal_status);
-            }   
         }
 #if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
         printf("Jumping to Main Application ...\n");
@@ -490,7 +810,7 @@ static BL_status_t jump_add(uint32_t add)
 {
     BL_status_t status = BL_ERROR;
     /*  Validate the address wanted to jump to */
-    if ((LAST_FLASHED_PROGRAM_ADD <= add) && (ALLOWED_PROGRAM_END_ADD >= add))
+    if ((ALLOWED_PROGRAM_START_ADD <= add) && (ALLOWED_PROGRAM_END_ADD > add))
     {
         /* Getting ready the address */
         uint32_t *addPtr = (uint32_t *)(add);
@@ -518,10 +838,11 @@ static BL_status_t bl_erase_sectors(uint8_t *buffer, uint8_t length)
     uint8_t num_sectors = buffer[3];
     if (MASS_ERASE == start)
     {
+        /* The bootloader and its metadata sector stay, only the application area goes */
 #if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
-        printf("WARNING: Mass Erase Wanted!!\n");
+        printf("WARNING: Mass Erase Wanted, erasing the application area!!\n");
 #endif
-        status = mass_erase_execute();
+        status = sector_erase_execute(PROGRAM_FIRST_SECTOR, PROGRAM_NUMBER_SECTORS);
     }
     else
     {
@@ -542,46 +863,6 @@ static BL_status_t bl_erase_sectors(uint8_t *buffer, uint8_t length)
     return status;
 }
 
-static BL_status_t mass_erase_execute()
-{
-    BL_status_t status = BL_ERROR;
-    HAL_StatusTypeDef hal_status = HAL_ERROR;
-    /* Determine the Configuration of the Erase */
-    FLASH_EraseInitTypeDef mass_erase_configurations =
-        {
-            .TypeErase = FLASH_TYPEERASE_MASSERASE, // Mass Erase Operation
-            .NbSectors = 7,                         // Number of Flash memory Sectors
-            .Banks = FLASH_BANK_1,                  // Bank 1
-            .Sector = FLASH_SECTOR_0,               // Start Sector
-            .VoltageRange = FLASH_VOLTAGE_RANGE_3,  // Device operating range: 2.7V to 3.6V
-        };
-    uint32_t erase_status = 0; // Store the status of Erasing operation
-    /* Unlock the Flash memory */
-    hal_status = HAL_FLASH_Unlock();
-    if (HAL_OK != hal_status)
-    {
-        status = BL_ERROR;
-    }
-    else
-    {
-        /* Perfome Erasing */
-        hal_status = HAL_FLASHEx_Erase(&mass_erase_configurations, &erase_status);
-
-        /* Check for Erasing success */
-        if ((HAL_OK == hal_status) && (ERASE_SUCCESS == erase_status))
-            status = BL_OK;
-        else
-            status = BL_ERROR;
-
-        /* Lock the Flash memory */
-        do
-        {
-            hal_status = HAL_FLASH_Lock();
-        } while (HAL_OK != hal_status);
-    }
-    return status;
-}
-
 static BL_status_t sector_erase_execute(erase_sectors_t start, uint8_t num)
 {
     BL_status_t status = BL_ERROR;
@@ -594,8 +875,9 @@ static BL_status_t sector_erase_execute(erase_sectors_t start, uint8_t num)
             .VoltageRange = FLASH_VOLTAGE_RANGE_3, // Device operating range: 2.7V to 3.6V
         };
     uint32_t erase_status = 0; // Store the status of Erasing operation
-    /* Check The Validity of start Sector and number of sectors wanted to be erased */
-    if ((start <= SECTOR_5) && ((start + num) <= NUMBER_FLASH_SECTORS))
+    /* Only the application sectors, the bootloader and BL_META_SECTOR are never erased */
+    if ((PROGRAM_FIRST_SECTOR <= start) && (start <= SECTOR_5) &&
+        (0 != num) && ((start + num) <= NUMBER_FLASH_SECTORS))
     {
         erase_configurations.NbSectors = num;
         erase_configurations.Sector = start;
@@ -621,14 +903,34 @@ static BL_status_t sector_erase_execute(erase_sectors_t start, uint8_t num)
             {
                 hal_status = HAL_FLASH_Lock();
             } while (HAL_OK != hal_status);
+
+            /* Even a failed erase may have wiped part of the image */
+            bl_retire_image(start, num);
         }
     }
     return status;
 }
 
+static void bl_retire_image(erase_sectors_t start, uint8_t num)
+{
+    const BL_image_header_t *image = bl_get_image();
+    /* An empty image record hides the one whose sectors were just erased */
+    if ((NULL != image) &&
+        (bl_sector_of(image->address) < (start + num)) &&
+        (bl_sector_of(image->address + image->size - 1) >= start))
+    {
+        bl_meta_append(BL_META_IMAGE, NULL, 0);
+    }
+}
+
+static erase_sectors_t bl_sector_of(uint32_t add)
+{
+    /* Application area only: 64 KB sector 4, then 128 KB sector 5 */
+    return (SECTOR_5_START_ADD > add) ? SECTOR_4 : SECTOR_5;
+}
+
 static BL_status_t bl_write_program(uint8_t *buffer, uint8_t length)
 {
-    UNUSED(length);
     BL_status_t status = BL_ERROR;
     HAL_StatusTypeDef hal_status = HAL_ERROR;
     /* Get the Version of Program, Start Address of Program, and size of program */
@@ -637,6 +939,9 @@ static BL_status_t bl_write_program(uint8_t *buffer, uint8_t length)
     uint8_t Patch = buffer[4];      // Patch Version
     uint32_t program_add  = (uint32_t)GET_4BYTES(buffer, 5); // Get program address
     uint32_t program_size = (uint32_t)GET_4BYTES(buffer, 9); // Get program size
+    uint32_t build_id = 0;                                   // Optional Build ID
+    if (WRITE_HEADER_BUILD_ID_LENGTH <= length)
+        build_id = (uint32_t)GET_4BYTES(buffer, 13);
 
 #if (BOOTLOADER_DEBUG_PROTOCOL != BOOTLOADER_STOP)
     printf("program_add: %li\n",program_add);
@@ -649,7 +954,7 @@ static BL_status_t bl_write_program(uint8_t *buffer, uint8_t length)
     /* Check Validity of Start of the Program and its size */
     if (((uint32_t)ALLOWED_PROGRAM_START_ADD <= program_add) && 
         ((uint32_t)ALLOWED_PROGRAM_END_ADD   > program_add) &&
-        ((uint32_t)ALLOWED_PROGRAM_END_ADD   > (program_add + program_size)))
+        ((uint32_t)ALLOWED_PROGRAM_END_ADD   >= (program_add + program_size)))
     {
         /* Unlock the Flash memory */
         hal_status = HAL_FLASH_Unlock();
@@ -661,23 +966,32 @@ static BL_status_t bl_write_program(uint8_t *buffer, uint8_t length)
         {
             /* Performe Writing Program */
             status = write_program(program_add, program_size);
-            /* Check for Error */
-            if (BL_OK == status)
-            {   
-                /* Performe Writing Version */
-                do
-                {
-                    status = write_version(Major, Minor, Patch);
-                } while(BL_OK != status);
-            }
-            else
-                status = sector_erase_execute(SECTOR_3, 3);
 
             /* Lock the Flash memory */
             do
             {
                 hal_status = HAL_FLASH_Lock();
             } while (HAL_OK != hal_status);
+
+            /* Check for Error */
+            if (BL_OK == status)
+            {
+                /* Record the new image, the old record stays valid until this one lands */
+                BL_image_header_t image =
+                    {
+                        .major = Major,
+                        .minor = Minor,
+                        .patch = Patch,
+                        .slot = 0,
+                        .address = program_add,
+                        .size = program_size,
+                        .digest = image_digest(program_add, program_size),
+                        .build_id = build_id,
+                    };
+                status = bl_meta_append(BL_META_IMAGE, &image, sizeof(image));
+            }
+            else
+                sector_erase_execute(PROGRAM_FIRST_SECTOR, PROGRAM_NUMBER_SECTORS);
         }
     }
 
@@ -696,7 +1010,6 @@ static BL_status_t write_program(uint32_t add, uint32_t size)
     HAL_StatusTypeDef hal_status = HAL_ERROR;
     uint32_t counter = size;
     uint8_t buf_counter = 0;
-    uint32_t l_add = add;
     /* Start Receiving Packets which contains the program */
     do 
     {
@@ -706,17 +1019,16 @@ static BL_status_t write_program(uint32_t add, uint32_t size)
 #endif
         do 
         {
-            HAL_Delay(50);
+            BL_POLL_DELAY(50);
             /* Reset the buffers */
             memset(BL_Buffer_send, 0x00, BOOTLOADER_BUFFER_SIZE);
+            memset(BL_Buffer_temp, 0x00, BOOTLOADER_BUFFER_SIZE);
             memset(BL_buffer, 0x00, BOOTLOADER_BUFFER_SIZE);
+            bl_mark_ready();
             /* Receive a packet contains bytes of the program */
-            hal_status = HAL_SPI_TransmitReceive (bootloader_spi,
-                                              BL_Buffer_send,
-                                              BL_buffer,
-                                              BOOTLOADER_BUFFER_SIZE,
-                                              HAL_MAX_DELAY);
-        }while((memcmp(BL_buffer, BL_Buffer_send, BOOTLOADER_BUFFER_SIZE) == 0) 
+            hal_status = bl_spi_exchange(BL_Buffer_send, BL_buffer, HAL_MAX_DELAY);
+            /* An empty frame is the bridge polling, the ready mark is not part of it */
+        }while((memcmp(BL_buffer, BL_Buffer_temp, BOOTLOADER_BUFFER_SIZE) == 0) 
                && ((HAL_OK == hal_status)));
         /* Check the receiving */
         if (HAL_OK != hal_status)
@@ -779,9 +1091,6 @@ static BL_status_t write_program(uint32_t add, uint32_t size)
             }
         }
     } while((counter > 0) && (BL_OK == status) && (HAL_OK == hal_status));
-    /* Edit The Last Flash Programed Address */
-    hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, 
-                                   LAST_FLASHED_PROGRAM_ADD, l_add);
     /* Determine the Return of the function depending on the last writing */
     if ((HAL_OK != hal_status) || (BL_OK != status))
     {
@@ -794,25 +1103,75 @@ static BL_status_t write_program(uint32_t add, uint32_t size)
     return status;
 }
 
-static BL_status_t write_version(uint8_t major, uint8_t minor, uint8_t patch)
+static void bl_mark_ready(void)
 {
-    BL_status_t status = BL_ERROR;
+    /* Tell the bridge a new frame can be taken, the long operation is over */
+    if (BL_session_features & BL_FEATURE_READY_MARK)
+        BL_Buffer_send[0] = BL_READY_SIGNAL;
+}
+
+/* One whole frame each way, whoever masters the link, HAL_TIMEOUT when not done in time */
+static HAL_StatusTypeDef bl_spi_exchange(uint8_t *send, uint8_t *receive, uint32_t timeout)
+{
+#if (BOOTLOADER_SPI_ROLE == BOOTLOADER_SPI_SLAVE)
     HAL_StatusTypeDef hal_status = HAL_ERROR;
-    /* perform Writing Version to Flash */
-    hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, MAJOR_ADD, major);
+    uint32_t start = HAL_GetTick();
+    BL_spi_done = 0;
+    hal_status = HAL_SPI_TransmitReceive_DMA(bootloader_spi, send, receive,
+                                             BOOTLOADER_BUFFER_SIZE);
     if (HAL_OK == hal_status)
     {
-        hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, MINOR_ADD, minor);
-        if (HAL_OK == hal_status)
+        /* Armed, the bridge may clock the frame now */
+        HAL_GPIO_WritePin(bootloader_ready_port, bootloader_ready_pin, GPIO_PIN_SET);
+        /* Sleep until the DMA is done, the line is dropped by the callback.
+           SysTick wakes the core every millisecond to look at the time */
+        while ((0 == BL_spi_done) &&
+               ((HAL_MAX_DELAY == timeout) || ((HAL_GetTick() - start) < timeout)))
+            __WFI();
+        if (0 == BL_spi_done)
         {
-            hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_BYTE, PATCH_ADD, patch);
-            if (HAL_OK == hal_status)
-            {
-                status = BL_OK;
-            }
+            /* Not clocked, drop the line first so the bridge does not start on it */
+            HAL_GPIO_WritePin(bootloader_ready_port, bootloader_ready_pin, GPIO_PIN_RESET);
+            HAL_SPI_Abort(bootloader_spi);
+            hal_status = HAL_TIMEOUT;
         }
+        else if (HAL_SPI_ERROR_NONE != bootloader_spi->ErrorCode)
+            hal_status = HAL_ERROR;
     }
-    return status;
+    return hal_status;
+#else
+    return HAL_SPI_TransmitReceive(bootloader_spi, send, receive,
+                                   BOOTLOADER_BUFFER_SIZE, timeout);
+#endif
+}
+
+#if (BOOTLOADER_SPI_ROLE == BOOTLOADER_SPI_SLAVE)
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+    /* Low before the bridge can look again, so the next rising edge is the next frame */
+    HAL_GPIO_WritePin(bootloader_ready_port, bootloader_ready_pin, GPIO_PIN_RESET);
+    BL_spi_done = 1;
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+    HAL_GPIO_WritePin(bootloader_ready_port, bootloader_ready_pin, GPIO_PIN_RESET);
+    BL_spi_done = 1;
+}
+#endif
+
+static uint32_t image_digest(uint32_t add, uint32_t size)
+{
+    uint32_t crc_val = 0;
+    uint32_t data_buffer = 0;
+    /* Same algorithm as the frame CRC so the host can compare it */
+    __HAL_CRC_DR_RESET(bootloader_crc);
+    for (uint32_t counter = 0; counter < size; counter++)
+    {
+        data_buffer = (uint32_t)(*(uint8_t *)(add + counter));
+        crc_val = HAL_CRC_Accumulate(bootloader_crc, &data_buffer, 1);
+    }
+    return crc_val;
 }
 
 /******************************************************************************/
@@ -0,0 +1,240 @@
+/*
+ * Bootloader_meta.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+
+/*********************************** Includes *********************************/
+#include "Bootloader_meta.h"
+/******************************************************************************/
+
+/*********************************** Defines **********************************/
+#define meta_crc                        (&hcrc)
+
+#define META_ERASED_WORD                (0xFFFFFFFFU)
+#define META_RECORD_OVERHEAD            (sizeof(BL_meta_record_t) + sizeof(uint32_t))
+#define ERASE_SUCCESS                   (0xFFFFFFFFU)
+/******************************************************************************/
+
+/*********************************** Data Types *******************************/
+typedef struct
+{
+    uint32_t latest[BL_META_TYPE_COUNT];    /* Address of newest valid record */
+    uint32_t write_add;                     /* First erased word of the log */
+}BL_meta_index_t;
+/******************************************************************************/
+
+/*********************************** Static Function declaration **************/
+static uint32_t meta_record_crc(uint32_t add, uint8_t length);
+static BL_status_t meta_write_record(BL_meta_type_t type,
+                                     const void *payload,
+                                     uint8_t length);
+static BL_status_t meta_compact(void);
+static BL_status_t meta_erase(void);
+/******************************************************************************/
+
+/*********************************** Global Objects ***************************/
+static BL_meta_index_t meta_index;
+static uint32_t meta_keep[BL_META_TYPE_COUNT][BL_META_MAX_PAYLOAD / 4];
+/******************************************************************************/
+
+/*********************************** Function definition **********************/
+BL_status_t bl_meta_init(void)
+{
+    uint32_t add = BL_META_START_ADD;
+    uint32_t total = 0;
+    const BL_meta_record_t *record = NULL;
+    memset(meta_index.latest, 0x00, sizeof(meta_index.latest));
+    /* Single linear scan, the newest valid record of each type wins */
+    while ((add + META_RECORD_OVERHEAD) <= BL_META_END_ADD)
+    {
+        record = (const BL_meta_record_t *)add;
+        /* Erased header means the end of the log */
+        if (META_ERASED_WORD == *(const uint32_t *)add)
+            break;
+        total = META_RECORD_OVERHEAD + record->length;
+        /* A broken header can not be skipped, force a compaction on the next write */
+        if ((BL_META_MAGIC != record->magic) ||
+            (BL_META_MAX_PAYLOAD < record->length) ||
+            (0 != (record->length % 4)) ||
+            (BL_META_END_ADD < (add + total)))
+        {
+            add = BL_META_END_ADD;
+            break;
+        }
+        /* Records interrupted by a reset fail the CRC and are skipped */
+        if ((record->type < BL_META_TYPE_COUNT) &&
+            (meta_record_crc(add, record->length) ==
+             *(const uint32_t *)(add + total - sizeof(uint32_t))))
+        {
+            meta_index.latest[record->type] = add;
+        }
+        add += total;
+    }
+    meta_index.write_add = add;
+    return BL_OK;
+}
+
+BL_status_t bl_meta_append(BL_meta_type_t type,
+                           const void *payload,
+                           uint8_t length)
+{
+    BL_status_t status = BL_ERROR;
+    /* Validate the record */
+    if ((type < BL_META_TYPE_COUNT) &&
+        (BL_META_MAX_PAYLOAD >= length) &&
+        (0 == (length % 4)))
+    {
+        /* Make room by rewriting only the live records */
+        if (BL_META_END_ADD < (meta_index.write_add + META_RECORD_OVERHEAD + length))
+            status = meta_compact();
+        else
+            status = BL_OK;
+        if (BL_OK == status)
+            status = meta_write_record(type, payload, length);
+    }
+    return status;
+}
+
+const void *bl_meta_find(BL_meta_type_t type, uint8_t length)
+{
+    const BL_meta_record_t *record = NULL;
+    const void *payload = NULL;
+    if ((type < BL_META_TYPE_COUNT) && (0 != meta_index.latest[type]))
+    {
+        record = (const BL_meta_record_t *)meta_index.latest[type];
+        /* Older layouts of a record are ignored rather than misread */
+        if (length == record->length)
+            payload = (const void *)(meta_index.latest[type] + sizeof(BL_meta_record_t));
+    }
+    return payload;
+}
+/******************************************************************************/
+
+/*********************************** Static Function definition ***************/
+static uint32_t meta_record_crc(uint32_t add, uint8_t length)
+{
+    /* Header and payload are word aligned, feed them to the CRC unit as words */
+    return HAL_CRC_Calculate(meta_crc, (uint32_t *)add,
+                             (sizeof(BL_meta_record_t) + length) / 4);
+}
+
+static BL_status_t meta_write_record(BL_meta_type_t type,
+                                     const void *payload,
+                                     uint8_t length)
+{
+    BL_status_t status = BL_ERROR;
+    HAL_StatusTypeDef hal_status = HAL_ERROR;
+    HAL_StatusTypeDef lock_status = HAL_ERROR;
+    uint32_t add = meta_index.write_add;
+    uint32_t word = 0;
+    BL_meta_record_t record =
+        {
+            .magic = BL_META_MAGIC,
+            .type = (uint8_t)type,
+            .length = length,
+        };
+    /* Unlock the Flash memory */
+    hal_status = HAL_FLASH_Unlock();
+    if (HAL_OK == hal_status)
+    {
+        /* Header first, so an interrupted write leaves a skippable record */
+        memcpy(&word, &record, sizeof(word));
+        hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, add, word);
+        for (uint8_t index = 0; (index < length) && (HAL_OK == hal_status); index += 4)
+        {
+            memcpy(&word, (const uint8_t *)payload + index, sizeof(word));
+            hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,
+                                           add + sizeof(record) + index, word);
+        }
+        /* CRC last, it is what makes the record valid */
+        if (HAL_OK == hal_status)
+        {
+            hal_status = HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD,
+                                           add + sizeof(record) + length,
+                                           meta_record_crc(add, length));
+        }
+        /* Lock the Flash memory */
+        do
+        {
+            lock_status = HAL_FLASH_Lock();
+        } while (HAL_OK != lock_status);
+    }
+    /* Whatever happened the words are used, move past them */
+    meta_index.write_add = add + META_RECORD_OVERHEAD + length;
+    if (HAL_OK == hal_status)
+    {
+        meta_index.latest[type] = add;
+        status = BL_OK;
+    }
+    return status;
+}
+
+static BL_status_t meta_compact(void)
+{
+    BL_status_t status = BL_ERROR;
+    uint8_t lengths[BL_META_TYPE_COUNT] = {0};
+    const BL_meta_record_t *record = NULL;
+    /* Keep a RAM copy of the live records */
+    for (uint8_t type = 0; type < BL_META_TYPE_COUNT; type++)
+    {
+        if (0 != meta_index.latest[type])
+        {
+            record = (const BL_meta_record_t *)meta_index.latest[type];
+            lengths[type] = record->length;
+            memcpy(meta_keep[type],
+                   (const void *)(meta_index.latest[type] + sizeof(BL_meta_record_t)),
+                   record->length);
+        }
+    }
+    /* Start the log again from an erased sector */
+    status = meta_erase();
+    if (BL_OK == status)
+    {
+        meta_index.write_add = BL_META_START_ADD;
+        for (uint8_t type = 0; (type < BL_META_TYPE_COUNT) && (BL_OK == status); type++)
+        {
+            if (0 != meta_index.latest[type])
+            {
+                meta_index.latest[type] = 0;
+                status = meta_write_record((BL_meta_type_t)type,
+                                           meta_keep[type], lengths[type]);
+            }
+        }
+    }
+    return status;
+}
+
+static BL_status_t meta_erase(void)
+{
+    BL_status_t status = BL_ERROR;
+    HAL_StatusTypeDef hal_status = HAL_ERROR;
+    FLASH_EraseInitTypeDef erase_configurations =
+        {
+            .TypeErase = FLASH_TYPEERASE_SECTORS,  // Sector Erase Operation
+            .Banks = FLASH_BANK_1,                 // Bank 1
+            .Sector = BL_META_SECTOR,              // Metadata Sector
+            .NbSectors = 1,                        // Only the Metadata Sector
+            .VoltageRange = FLASH_VOLTAGE_RANGE_3, // Device operating range: 2.7V to 3.6V
+        };
+    uint32_t erase_status = 0; // Store the status of Erasing operation
+    /* Unlock the Flash memory */
+    hal_status = HAL_FLASH_Unlock();
+    if (HAL_OK == hal_status)
+    {
+        /* Perfome Erasing */
+        hal_status = HAL_FLASHEx_Erase(&erase_configurations, &erase_status);
+        /* Check for Erasing success */
+        if ((HAL_OK == hal_status) && (ERASE_SUCCESS == erase_status))
+            status = BL_OK;
+        /* Lock the Flash memory */
+        do
+        {
+            hal_status = HAL_FLASH_Lock();
+        } while (HAL_OK != hal_status);
+    }
+    return status;
+}
+
+/******************************************************************************/
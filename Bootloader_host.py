@@ -1,28 +1,172 @@
 import paho.mqtt.client as mqtt
+from paho.mqtt.properties import Properties
+from paho.mqtt.packettypes import PacketTypes
 import ssl
 import time
 import threading
+import struct
+import queue
 import os
+import socket
+import argparse
 
 # MQTT Broker settings
 BROKER = "broker.hivemq.com"
 PORT = 8883
+# Every bridge has its own topics, fota/<device id>/<topic>, set by select_device()
+TOPIC_PREFIX = "fota"
 TOPIC_SEND = "bootloader-receive"
 TOPIC_RECEIVE = "bootloader-send"
+TOPIC_CONTROL = "bootloader-control"
+TOPIC_STATUS = "bootloader-status"
+TOPIC_TELEMETRY = "bootloader-telemetry"
+# Kept by the broker over a lost connection, frames are delivered after it instead of lost
+QOS = 1
+CLIENT_ID = f"fota-host-{socket.gethostname()}"
+RECONNECT_MIN_DELAY = 1
+RECONNECT_MAX_DELAY = 32
+# MQTT 5 profile, used with --mqtt5
+MQTT5_SESSION_EXPIRY = 3600
+MQTT5_RECEIVE_MAXIMUM = 8  # Answers of the bridge in flight towards this host
+MQTT5_TOPIC_ALIASES = 4
+
+# Direct TCP transport of the bridge, tried before the broker when an address is given
+LAN_PORT = 3333
+LAN_CONNECT_TIMEOUT = 1.0
+LAN_HEADER_FORMAT = '>BBH'  # Channel, target, payload length
+LAN_CHANNEL_DEVICE = 0
+LAN_CHANNEL_CONTROL = 1
+LAN_CHANNEL_TELEMETRY = 2
 
 # CRC Configuration
 CRC_POLY = 0x04C11DB7
 CRC_INIT = 0xFFFFFFFF
 CRC_XOR_OUT = 0x00000000
 
-# Delay between packets (in seconds)
-PACKET_DELAY = 0.50  # 500ms
+# Delay between packets (in seconds), only for bridges without flow control.
+# With it the bridge tells the host to hold off whenever its frame pool runs out
+PACKET_DELAY = 0.5
+
+# Bootloader commands
+CMD_GET_INFO = 0x06
+CMD_HELLO = 0x07
+CMD_BATCH = 0x08
+CMD_VERIFY = 0x09
+
+# Batch sub-command results
+BATCH_RESULTS = ('OK', 'FAILED', 'SKIPPED', 'UNSUPPORTED', 'DEFERRED')
+BATCH_CONTINUE_ON_ERROR = 1 << 0
+
+# Application flash sectors erased before an update
+APP_FIRST_SECTOR = 4
+APP_SECTORS = 2
+
+# Protocol and features this host understands
+HOST_PROTOCOL_VERSION = 2
+FEATURE_GET_INFO = 1 << 0
+FEATURE_BUILD_ID = 1 << 1
+FEATURE_BOOT_MAILBOX = 1 << 2
+FEATURE_METADATA_LOG = 1 << 3
+FEATURE_HELLO = 1 << 4
+FEATURE_BATCH = 1 << 5
+FEATURE_VERIFY = 1 << 6
+FEATURE_READY_MARK = 1 << 7  # Only asked for when the bridge strips the mark
+HOST_FEATURES = (FEATURE_GET_INFO | FEATURE_BUILD_ID | FEATURE_BOOT_MAILBOX |
+                 FEATURE_METADATA_LOG | FEATURE_HELLO | FEATURE_BATCH |
+                 FEATURE_VERIFY)
+
+# Bridge control messages
+BRIDGE_MSG_HELLO = 0x01
+BRIDGE_MSG_CACHE_BEGIN = 0x02
+BRIDGE_MSG_CACHE_DATA = 0x03
+BRIDGE_MSG_CACHE_COMMIT = 0x04
+BRIDGE_MSG_CACHE_STATUS = 0x05
+BRIDGE_MSG_AGGREGATE = 0x06
+BRIDGE_MSG_AGGREGATE_STATUS = 0x07
+BRIDGE_MSG_FLOW = 0x08
+BRIDGE_MSG_LOG_LEVEL = 0x09
+BRIDGE_MSG_TRACE = 0x0A
+BRIDGE_PROTOCOL_VERSION = 1
+BRIDGE_FEATURE_IMAGE_CACHE = 1 << 0
+BRIDGE_FEATURE_ACK_PROXY = 1 << 1
+BRIDGE_FEATURE_AGGREGATE = 1 << 2
+BRIDGE_FEATURE_EDGE_CRC = 1 << 3
+BRIDGE_FEATURE_FLOW_CONTROL = 1 << 4
+HOST_BRIDGE_FEATURES = (BRIDGE_FEATURE_IMAGE_CACHE | BRIDGE_FEATURE_ACK_PROXY |
+                        BRIDGE_FEATURE_AGGREGATE | BRIDGE_FEATURE_EDGE_CRC |
+                        BRIDGE_FEATURE_FLOW_CONTROL)
+
+# Longest the device may stay busy (mass erase) before frames are sent anyway
+FLOW_TIMEOUT = 60
+
+# Frames the bridge rejected without forwarding them
+BRIDGE_NACK_MARKER = 0xB0
+BRIDGE_REJECT_REASONS = ('OK', 'CRC', 'LENGTH')
+
+# Frame aggregation through the bridge
+AGGREGATE_RESULTS = ('OK', 'NACK', 'NO_ANSWER', 'MALFORMED', 'BAD_CRC')
+AGGREGATE_ATTEMPTS = 3
+
+# Image cache on the bridge
+CACHE_DATA_SIZE = 248  # Offset header plus data fit one bridge frame
+CACHE_FLAG_VERIFY = 1 << 0
+CACHE_FLAG_JUMP = 1 << 1
+CACHE_STAGES = ('IDLE', 'DOWNLOAD', 'VERIFY', 'ERASE', 'HEADER',
+                'WRITE', 'CHECK', 'JUMP', 'DONE')
+
+# Bridge trace: time in us, frame ID, length, event, info
+TRACE_ENTRY_FORMAT = '>IHHBB'
+TRACE_EVENTS = (None, 'MQTT_RX', 'SPI_SUBMIT', 'SPI_DONE', 'MQTT_TX', 'REJECT',
+                'DROP', 'FLOW', 'AGGREGATE', 'CACHE')
+LOG_LEVELS = ('NONE', 'ERROR', 'WARN', 'INFO', 'DEBUG', 'VERBOSE')
+
+# Bridge telemetry, stage histograms in log2 buckets starting below 128 us
+TELEMETRY_COUNTERS = ('frames', 'bytes_down', 'bytes_up', 'drops', 'rejects')
+TELEMETRY_STAGES = ('downlink', 'device', 'uplink', 'total')
+TELEMETRY_TASKS = ('MQTT', 'SPI', 'Downlink', 'Uplink', 'Cache', 'Telemetry')
+TELEMETRY_BUCKET_SHIFT = 7
+
+# HELLO reply fields after the length and command bytes
+HELLO_FORMAT = '>BBIIBHHBBB'
+HELLO_FIELDS = ('protocol', 'session_protocol', 'features', 'session_features',
+                'crc_modes', 'max_frame', 'chunk_size', 'max_window',
+                'compression', 'delta')
+
+# GET_INFO reply fields after the length and command bytes
+INFO_FORMAT = '>BBBBBIIIIIHHIIIBB'
+INFO_FIELDS = ('info_version', 'major', 'minor', 'patch', 'slot',
+               'address', 'size', 'digest', 'build_id',
+               'features', 'max_frame', 'chunk_size',
+               'app_start', 'app_end', 'meta_address',
+               'first_app_sector', 'flash_sectors')
 
 # Global variables for synchronization
 ack_received = threading.Event()
 nack_received = threading.Event()
 version_received = threading.Event()
+version_expected = threading.Event()
+info_received = threading.Event()
+hello_received = threading.Event()
+batch_received = threading.Event()
+verify_received = threading.Event()
+bridge_hello_received = threading.Event()
 unexpected_message = threading.Event()
+device_ready = threading.Event()
+device_ready.set()
+device_info = {}
+device_hello = {}
+batch_results = []
+verify_result = []
+bridge_hello = {}
+cache_status = queue.Queue()
+aggregate_status = queue.Queue()
+trace_parts = queue.Queue()
+telemetry = {}
+
+# Result of the last capability negotiation
+session = {'protocol': 1, 'features': 0, 'bridge_features': 0, 'bridge_max_message': 0,
+           'bridge_credits': 0,
+           'max_frame': 256, 'chunk_size': 252, 'max_window': 1}
 
 def crc32(data):
     crc = CRC_INIT
@@ -38,41 +182,305 @@ def crc32(data):
 def pad_bytes(data):
     return b''.join(byte.to_bytes(4, 'big') for byte in data)
 
+def parse_frame(payload, command):
+    # Device frames use the host layout: length, command, fields, CRC
+    if len(payload) < 2 or payload[1] != command or payload[0] < 5 or len(payload) <= payload[0]:
+        return None
+    frame = payload[:payload[0] + 1]
+    if crc32(pad_bytes(frame[:-4])) != int.from_bytes(frame[-4:], 'big'):
+        return None
+    return frame[2:-4]
+
+def select_device(bridge_id, target=0):
+    # Bridges use their MAC (lower case hex, no separators) unless they were given a name
+    global TOPIC_SEND, TOPIC_RECEIVE, TOPIC_CONTROL, TOPIC_STATUS, TOPIC_TELEMETRY, CLIENT_ID
+    if not bridge_id or any(c in bridge_id for c in '/+#'):
+        raise ValueError(f"Invalid device ID: {bridge_id!r}")
+    # The first STM32 of a bridge answers on the bridge ID, the others on <bridge ID>-<target>
+    device_id = f"{bridge_id}-{target}" if target else bridge_id
+    TOPIC_SEND = f"{TOPIC_PREFIX}/{device_id}/bootloader-receive"
+    TOPIC_RECEIVE = f"{TOPIC_PREFIX}/{device_id}/bootloader-send"
+    TOPIC_CONTROL = f"{TOPIC_PREFIX}/{device_id}/bootloader-control"
+    TOPIC_STATUS = f"{TOPIC_PREFIX}/{device_id}/bootloader-status"
+    TOPIC_TELEMETRY = f"{TOPIC_PREFIX}/{bridge_id}/bootloader-telemetry"
+    # One host process per device, each with its own broker session
+    CLIENT_ID = f"fota-host-{socket.gethostname()}-{device_id}"
+    return device_id
+
 def print_packet(packet, description):
     print(f"Sending {description}:")
     print(f"Packet (hex): {packet.hex()}")
     print(f"Packet (bytes): {list(packet)}")
     print()
 
+def wait_device_ready(description):
+    # The bridge reports when the device is inside an erase or program, hold the frame until it is back
+    if not session['bridge_features'] & BRIDGE_FEATURE_FLOW_CONTROL or device_ready.is_set():
+        return True
+    print(f"Device busy, holding {description}")
+    if device_ready.wait(timeout=FLOW_TIMEOUT):
+        return True
+    print(f"Device still busy after {FLOW_TIMEOUT} s, sending {description} anyway")
+    return False
+
+def frame_properties(topic):
+    # Numbered frames, the bridge hands the correlation data back on the answer
+    if not session.get('mqtt5') or topic != TOPIC_SEND:
+        return None
+    session['sequence'] = (session.get('sequence', 0) + 1) & 0xFFFFFFFF
+    properties = Properties(PacketTypes.PUBLISH)
+    properties.UserProperty = [('seq', str(session['sequence']))]
+    properties.CorrelationData = struct.pack('>I', session['sequence'])
+    return properties
+
+def reply_to(msg):
+    correlation = getattr(getattr(msg, 'properties', None), 'CorrelationData', None)
+    if correlation is None or len(correlation) != 4:
+        return ""
+    return f" (answer to frame {struct.unpack('>I', correlation)[0]})"
+
 def send_packet(client, topic, packet, description):
+    if topic == TOPIC_SEND:
+        wait_device_ready(description)
     print_packet(packet, description)
-    client.publish(topic, packet)
-    time.sleep(PACKET_DELAY)
+    client.publish(topic, packet, qos=QOS, properties=frame_properties(topic))
+    if not session['bridge_features'] & BRIDGE_FEATURE_FLOW_CONTROL:
+        time.sleep(PACKET_DELAY)
 
 def on_connect(client, userdata, flags, rc, properties=None):
-    print(f"Connected with result code {rc}")
-    client.subscribe(TOPIC_RECEIVE)
+    print(f"Connected with result code {rc}, session present: {flags.session_present}")
+    client.subscribe(TOPIC_RECEIVE, qos=QOS)
+    client.subscribe(TOPIC_STATUS, qos=QOS)
+    client.subscribe(TOPIC_TELEMETRY)
+
+def on_disconnect(client, userdata, flags, rc, properties=None):
+    # loop_start() reconnects on its own, backing off up to RECONNECT_MAX_DELAY
+    print(f"Disconnected with result code {rc}, reconnecting")
+
+class LanMessage:
+    def __init__(self, topic, payload):
+        self.topic = topic
+        self.payload = payload
+
+class LanClient:
+    """The part of the MQTT client this script uses, over the bridge's own TCP port"""
+    def __init__(self, address, target):
+        host, _, port = address.partition(':')
+        self.address = (host, int(port) if port else LAN_PORT)
+        self.target = target
+        self.sock = None
+        self.lock = threading.Lock()
+        self.on_connect = None
+        self.on_disconnect = None
+        self.on_message = None
+
+    def connect(self):
+        self.sock = socket.create_connection(self.address, timeout=LAN_CONNECT_TIMEOUT)
+        self.sock.settimeout(None)
+        self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+    def loop_start(self):
+        threading.Thread(target=self._read_loop, daemon=True).start()
+
+    def loop_stop(self):
+        pass
+
+    def disconnect(self):
+        self.sock.close()
+
+    def subscribe(self, topic, qos=0):
+        # The bridge sends everything on the one connection
+        pass
+
+    def publish(self, topic, payload, qos=0, properties=None):
+        channels = {TOPIC_SEND: LAN_CHANNEL_DEVICE, TOPIC_CONTROL: LAN_CHANNEL_CONTROL}
+        payload = bytes(payload)
+        with self.lock:
+            self.sock.sendall(struct.pack(LAN_HEADER_FORMAT, channels[topic], self.target,
+                                          len(payload)) + payload)
+
+    def _read_exact(self, length):
+        data = b''
+        while len(data) < length:
+            chunk = self.sock.recv(length - len(data))
+            if not chunk:
+                raise ConnectionError("Connection closed by the bridge")
+            data += chunk
+        return data
+
+    def _read_loop(self):
+        topics = {LAN_CHANNEL_DEVICE: TOPIC_RECEIVE, LAN_CHANNEL_CONTROL: TOPIC_STATUS,
+                  LAN_CHANNEL_TELEMETRY: TOPIC_TELEMETRY}
+        try:
+            while True:
+                channel, target, length = struct.unpack(
+                    LAN_HEADER_FORMAT, self._read_exact(struct.calcsize(LAN_HEADER_FORMAT)))
+                payload = self._read_exact(length)
+                # Telemetry covers the whole bridge, the rest belongs to one target
+                if channel in topics and (channel == LAN_CHANNEL_TELEMETRY or target == self.target):
+                    self.on_message(self, None, LanMessage(topics[channel], payload))
+        except OSError as e:
+            print(f"LAN connection lost: {e}")
+
+def connect_lan(address, target):
+    client = LanClient(address, target)
+    try:
+        client.connect()
+    except (OSError, ValueError) as e:
+        print(f"Bridge not reachable at {address} ({e}), using the broker")
+        return None
+    print(f"Connected to the bridge at {client.address[0]}:{client.address[1]}")
+    return client
+
+def on_status(payload):
+    if len(payload) >= 8 and payload[0] == BRIDGE_MSG_HELLO:
+        protocol, features, max_message = struct.unpack_from('>BIH', payload, 1)
+        bridge_hello.clear()
+        bridge_hello.update(protocol=protocol, features=features, max_message=max_message)
+        bridge_hello_received.set()
+    elif len(payload) >= 11 and payload[0] == BRIDGE_MSG_CACHE_STATUS:
+        stage, result, done, total = struct.unpack_from('>BBII', payload, 1)
+        stage = CACHE_STAGES[stage] if stage < len(CACHE_STAGES) else stage
+        cache_status.put((stage, result == 0, done, total))
+    elif len(payload) >= 5 and payload[0] == BRIDGE_MSG_AGGREGATE_STATUS:
+        sequence, count, done = struct.unpack_from('>HBB', payload, 1)
+        results = [AGGREGATE_RESULTS[r] if r < len(AGGREGATE_RESULTS) else r
+                   for r in payload[5:]]
+        aggregate_status.put((sequence, count, done, results))
+    elif len(payload) >= 5 and payload[0] == BRIDGE_MSG_TRACE:
+        first, total = struct.unpack_from('>HH', payload, 1)
+        size = struct.calcsize(TRACE_ENTRY_FORMAT)
+        entries = [struct.unpack_from(TRACE_ENTRY_FORMAT, payload, offset)
+                   for offset in range(5, len(payload) - size + 1, size)]
+        trace_parts.put((first, total, entries))
+    elif len(payload) >= 3 and payload[0] == BRIDGE_MSG_FLOW:
+        session['bridge_credits'] = payload[2]
+        if payload[1] and payload[2]:
+            device_ready.set()
+        else:
+            device_ready.clear()
+
+def decode_telemetry(payload):
+    version, period = struct.unpack_from('>BI', payload, 0)
+    if version != 1:
+        return None
+    index = 5
+    report = {'period_ms': period}
+    for name in TELEMETRY_COUNTERS:
+        report[name], = struct.unpack_from('>I', payload, index)
+        index += 4
+    report['heap_free'], report['heap_min'], stages, buckets = struct.unpack_from('>IIBB', payload, index)
+    index += 10
+    report['stages'] = {}
+    for stage in range(stages):
+        count, total, longest = struct.unpack_from('>III', payload, index)
+        index += 12
+        histogram = struct.unpack_from(f'>{buckets}H', payload, index)
+        index += 2 * buckets
+        name = TELEMETRY_STAGES[stage] if stage < len(TELEMETRY_STAGES) else stage
+        report['stages'][name] = {'count': count, 'mean_us': total // count if count else 0,
+                                  'max_us': longest, 'buckets': histogram}
+    tasks, = struct.unpack_from('>B', payload, index)
+    index += 1
+    report['stack_free'] = {}
+    for task in range(tasks):
+        name = TELEMETRY_TASKS[task] if task < len(TELEMETRY_TASKS) else task
+        report['stack_free'][name], = struct.unpack_from('>I', payload, index)
+        index += 4
+    return report
+
+def print_telemetry(report):
+    seconds = report['period_ms'] / 1000 or 1
+    print(f"Bridge telemetry over {seconds:.1f} s: {report['frames']} frames, "
+          f"{report['bytes_down'] / seconds:.0f} B/s down, {report['bytes_up'] / seconds:.0f} B/s up, "
+          f"{report['drops']} dropped, {report['rejects']} rejected")
+    for name, stage in report['stages'].items():
+        # Upper bound of the bucket holding the median
+        median = None
+        seen = 0
+        for bucket, count in enumerate(stage['buckets']):
+            seen += count
+            if median is None and stage['count'] and seen * 2 >= stage['count']:
+                median = 1 << (bucket + TELEMETRY_BUCKET_SHIFT)
+        median = f"<{median} us" if median else "-"
+        print(f"  {name:<9} mean {stage['mean_us']:>8} us  median {median:>11}  max {stage['max_us']:>8} us")
+    print(f"  heap free {report['heap_free']} B, lowest {report['heap_min']} B")
+    print("  stack never used: " + ", ".join(f"{name} {free} B" for name, free in report['stack_free'].items()))
 
 def on_message(client, userdata, msg):
-    print(f"Received message on {msg.topic}: {msg.payload.hex()}")
-    if msg.payload == b'\xFF':
+    if msg.topic == TOPIC_TELEMETRY:
+        try:
+            report = decode_telemetry(msg.payload)
+        except struct.error:
+            report = None
+        if report is not None:
+            telemetry.clear()
+            telemetry.update(report)
+            if session.get('show_telemetry'):
+                print_telemetry(report)
+        return
+    print(f"Received message on {msg.topic}{reply_to(msg)}: {msg.payload.hex()}")
+    if msg.topic == TOPIC_STATUS:
+        on_status(msg.payload)
+        return
+    if version_expected.is_set() and len(msg.payload) == 3:
+        # A version is only known as one because it was asked for
+        version_expected.clear()
+        major, minor, patch = msg.payload
+        print(f"Version received: {major}.{minor}.{patch}")
+        version_received.set()
+        return
+    fields = parse_frame(msg.payload, CMD_GET_INFO)
+    hello_fields = parse_frame(msg.payload, CMD_HELLO)
+    batch_fields = parse_frame(msg.payload, CMD_BATCH)
+    verify_fields = parse_frame(msg.payload, CMD_VERIFY)
+    if fields is not None and len(fields) >= struct.calcsize(INFO_FORMAT):
+        device_info.clear()
+        device_info.update(zip(INFO_FIELDS, struct.unpack_from(INFO_FORMAT, fields)))
+        print("Device info received")
+        info_received.set()
+    elif hello_fields is not None and len(hello_fields) >= struct.calcsize(HELLO_FORMAT):
+        device_hello.clear()
+        device_hello.update(zip(HELLO_FIELDS, struct.unpack_from(HELLO_FORMAT, hello_fields)))
+        print("Device hello received")
+        hello_received.set()
+    elif batch_fields is not None and len(batch_fields) >= 2:
+        executed, count = batch_fields[0], batch_fields[1]
+        batch_results[:] = [BATCH_RESULTS[r] if r < len(BATCH_RESULTS) else r
+                            for r in batch_fields[2:2 + count]]
+        print(f"Batch result received: {executed}/{count} executed")
+        batch_received.set()
+    elif verify_fields is not None and len(verify_fields) >= 5:
+        result = verify_fields[0]
+        verify_result[:] = [BATCH_RESULTS[result] if result < len(BATCH_RESULTS) else result,
+                            int.from_bytes(verify_fields[1:5], 'big')]
+        print(f"Verify result received: {verify_result[0]}")
+        verify_received.set()
+    elif msg.payload == b'\xFF':
         print("ACK received")
         ack_received.set()
     elif msg.payload == b'\x01':
         print("NACK received")
         nack_received.set()
-    elif len(msg.payload) == 3:
-        major, minor, patch = msg.payload
-        print(f"Version received: {major}.{minor}.{patch}")
-        version_received.set()
+    elif len(msg.payload) == 3 and msg.payload[:2] == bytes([0x01, BRIDGE_NACK_MARKER]):
+        reason = msg.payload[2]
+        reason = BRIDGE_REJECT_REASONS[reason] if reason < len(BRIDGE_REJECT_REASONS) else reason
+        print(f"NACK received from the bridge: {reason}")
+        nack_received.set()
     else:
         print(f"Unexpected message received: {msg.payload.hex()}")
         unexpected_message.set()
 
+def poll_ack(client, description):
+    # With the proxy the bridge polls the device itself and publishes the outcome
+    if session['bridge_features'] & BRIDGE_FEATURE_ACK_PROXY:
+        print(f"Waiting for the ACK polled by the bridge ({description})")
+        return
+    send_packet(client, TOPIC_SEND, b'\x04', f"request for ACK signal ({description})")
+
 def request_ack(client, max_retries=5):
     for attempt in range(max_retries):
-        ack_request = b'\x04'
-        send_packet(client, TOPIC_SEND, ack_request, f"request for ACK signal (attempt {attempt + 1})")
+        poll_ack(client, f"attempt {attempt + 1}")
         
         # Wait for a response with a timeout
         if ack_received.wait(timeout=5):
@@ -104,6 +512,7 @@ def sequence_1(client):
         return
 
     # Send version request
+    version_expected.set()
     version_request = b'\x05'
     send_packet(client, TOPIC_SEND, version_request, "request for version")
 
@@ -111,11 +520,220 @@ def sequence_1(client):
     if version_received.wait(timeout=5):
         print("Communication completed successfully")
     else:
+        version_expected.clear()
         print("Timeout waiting for version")
 
+def get_device_info(client):
+    info_received.clear()
+    command = CMD_GET_INFO.to_bytes(1, 'big')
+    data = b'\x05' + command
+    crc = crc32(pad_bytes(data))
+    packet = data + crc.to_bytes(4, 'big')
+    send_packet(client, TOPIC_SEND, packet, "get device info command")
+
+    if not request_ack(client, 1):
+        return None
+
+    # The reply is pushed by the device once asked for it
+    send_packet(client, TOPIC_SEND, b'\x05', "request for device info")
+    if info_received.wait(timeout=5):
+        return dict(device_info)
+    return None
+
+def verify_device_image(client, digest):
+    # The device recomputes the digest over flash, the GET_INFO one is only its record
+    verify_received.clear()
+    data = b'\x09' + CMD_VERIFY.to_bytes(1, 'big') + digest.to_bytes(4, 'big')
+    crc = crc32(pad_bytes(data))
+    packet = data + crc.to_bytes(4, 'big')
+    send_packet(client, TOPIC_SEND, packet, "verify image command")
+
+    if not request_ack(client, 1):
+        return False
+
+    send_packet(client, TOPIC_SEND, b'\x05', "request for verify result")
+    return verify_received.wait(timeout=10) and verify_result[0] == 'OK'
+
+def batch_entry(command, arguments=b''):
+    # Like a frame without CRC, the length counts the bytes after it
+    return (1 + len(arguments)).to_bytes(1, 'big') + command.to_bytes(1, 'big') + arguments
+
+def send_batch(client, entries, continue_on_error=False, timeout=30):
+    batch_received.clear()
+    flags = BATCH_CONTINUE_ON_ERROR if continue_on_error else 0
+    body = (CMD_BATCH.to_bytes(1, 'big') +
+            flags.to_bytes(1, 'big') +
+            len(entries).to_bytes(1, 'big') +
+            b''.join(entries))
+    data = (len(body) + 4).to_bytes(1, 'big') + body
+    crc = crc32(pad_bytes(data))
+    packet = data + crc.to_bytes(4, 'big')
+    send_packet(client, TOPIC_SEND, packet, f"batch of {len(entries)} commands")
+
+    if not request_ack(client, 1):
+        return None
+
+    # Erasing inside the batch delays the reply, wait for it generously
+    send_packet(client, TOPIC_SEND, b'\x05', "request for batch result")
+    if batch_received.wait(timeout=timeout):
+        return list(batch_results)
+    return None
+
+def sequence_6(client):
+    print("\nUpdate Image (erase, write, verify, jump):")
+    if not session['features'] & FEATURE_BATCH:
+        print("The device does not support batched commands, use the single steps instead.")
+        return
+
+    file_content, major, minor, patch, start_address, build_id = read_image_details()
+    digest = crc32(pad_bytes(file_content))
+
+    # One round trip: erase the application area and open the write session
+    results = send_batch(client, [
+        batch_entry(0x01, bytes([APP_FIRST_SECTOR, APP_SECTORS])),
+        batch_entry(0x02, write_arguments(major, minor, patch, start_address,
+                                          len(file_content), build_id)),
+    ])
+    print(f"Erase and write header: {results}")
+    if results is None or results[-1] != 'DEFERRED' or 'FAILED' in results:
+        print("Update aborted before writing.")
+        return
+
+    if not send_image_chunks(client, file_content):
+        return
+
+    # One round trip: check the digest in flash and start the new image
+    results = send_batch(client, [
+        batch_entry(CMD_VERIFY, digest.to_bytes(4, 'big')),
+        batch_entry(0x03, (0xFFFFFFFF).to_bytes(4, 'big') + b'\xAA'),
+    ])
+    print(f"Verify and jump: {results}")
+    if results is not None and results[0] == 'OK':
+        print("Update completed successfully!")
+    else:
+        print("Verification failed, the device stays in the bootloader.")
+
+def wait_cache_status(timeout):
+    try:
+        stage, ok, done, total = cache_status.get(timeout=timeout)
+    except queue.Empty:
+        return None
+    print(f"Bridge cache: {stage} {'ok' if ok else 'FAILED'} ({done}/{total})")
+    return stage, ok
+
+def sequence_7(client):
+    print("\nUpdate Image through the bridge cache:")
+    if not session['bridge_features'] & BRIDGE_FEATURE_IMAGE_CACHE:
+        print("The bridge has no image cache, use the other update sequences instead.")
+        return
+
+    file_content, major, minor, patch, start_address, build_id = read_image_details()
+    digest = crc32(pad_bytes(file_content))
+    flags = CACHE_FLAG_JUMP
+    if session['features'] & FEATURE_VERIFY:
+        flags |= CACHE_FLAG_VERIFY
+
+    # The bridge erases its cache area and answers when it is ready for data
+    while not cache_status.empty():
+        cache_status.get_nowait()
+    begin = (BRIDGE_MSG_CACHE_BEGIN.to_bytes(1, 'big') +
+             len(file_content).to_bytes(4, 'big') +
+             digest.to_bytes(4, 'big') +
+             bytes([major, minor, patch]) +
+             start_address.to_bytes(4, 'big') +
+             build_id.to_bytes(4, 'big') +
+             bytes([APP_FIRST_SECTOR, APP_SECTORS, flags]))
+    client.publish(TOPIC_CONTROL, begin, qos=1)
+    status = wait_cache_status(timeout=10)
+    if status is None or not status[1]:
+        print("The bridge could not prepare its cache.")
+        return
+
+    # Stream the whole image, the target is not involved yet
+    for offset in range(0, len(file_content), CACHE_DATA_SIZE):
+        data = (BRIDGE_MSG_CACHE_DATA.to_bytes(1, 'big') +
+                offset.to_bytes(4, 'big') +
+                file_content[offset:offset + CACHE_DATA_SIZE])
+        client.publish(TOPIC_CONTROL, data, qos=1)
+    print(f"{len(file_content)} bytes sent to the bridge cache")
+
+    # The bridge checks the digest, then runs the flash session at SPI speed
+    client.publish(TOPIC_CONTROL, BRIDGE_MSG_CACHE_COMMIT.to_bytes(1, 'big'), qos=1)
+    while True:
+        status = wait_cache_status(timeout=60)
+        if status is None:
+            print("Timeout waiting for the bridge.")
+            return
+        stage, ok = status
+        if not ok:
+            print(f"Cached update failed at {stage}.")
+            return
+        if stage == 'DONE':
+            print("Update completed successfully!")
+            return
+
+def negotiate(client):
+    # Bridge first, it answers on its own without touching the device
+    bridge_hello_received.clear()
+    client.publish(TOPIC_CONTROL, bytes([BRIDGE_MSG_HELLO, BRIDGE_PROTOCOL_VERSION]) +
+                   HOST_BRIDGE_FEATURES.to_bytes(4, 'big'))
+    if bridge_hello_received.wait(timeout=2):
+        session['bridge_features'] = bridge_hello['features'] & HOST_BRIDGE_FEATURES
+        session['bridge_max_message'] = bridge_hello['max_message']
+        print(f"Bridge protocol {bridge_hello['protocol']}, features 0x{bridge_hello['features']:08X}")
+    else:
+        session['bridge_features'] = 0
+        print("Bridge did not answer hello, assuming a forwarding-only bridge")
+
+    host_features = HOST_FEATURES
+    if session['bridge_features'] & BRIDGE_FEATURE_FLOW_CONTROL:
+        host_features |= FEATURE_READY_MARK
+    device_ready.set()
+
+    hello_received.clear()
+    command = CMD_HELLO.to_bytes(1, 'big')
+    data = (b'\x0A' +  # Length (10 bytes)
+            command +
+            HOST_PROTOCOL_VERSION.to_bytes(1, 'big') +
+            host_features.to_bytes(4, 'big'))
+    crc = crc32(pad_bytes(data))
+    packet = data + crc.to_bytes(4, 'big')
+    send_packet(client, TOPIC_SEND, packet, "hello command")
+    if request_ack(client, 1):
+        send_packet(client, TOPIC_SEND, b'\x05', "request for hello reply")
+    if hello_received.wait(timeout=2):
+        session.update(protocol=device_hello['session_protocol'],
+                       features=device_hello['session_features'],
+                       max_frame=device_hello['max_frame'],
+                       chunk_size=device_hello['chunk_size'],
+                       max_window=device_hello['max_window'])
+        print(f"Device protocol {device_hello['protocol']}, session protocol {session['protocol']}, "
+              f"features 0x{session['features']:08X}")
+    else:
+        # Older bootloaders NACK the reply request, collect that NACK
+        send_packet(client, TOPIC_SEND, b'\x04', "flush of the unanswered hello")
+        session.update(protocol=1, features=0, max_frame=256, chunk_size=252, max_window=1)
+        print("Device did not answer hello, using the legacy protocol")
+
+def sequence_5(client):
+    info = get_device_info(client)
+    if info is None:
+        print("Timeout waiting for device info")
+        return
+    if info['size'] == 0xFFFFFFFF:
+        print("No image on the device")
+    else:
+        print(f"Image version: {info['major']}.{info['minor']}.{info['patch']} (slot {info['slot']})")
+        print(f"Image address: 0x{info['address']:08X}, size: {info['size']} bytes")
+        print(f"Image digest: 0x{info['digest']:08X}, build ID: 0x{info['build_id']:08X}")
+    print(f"Features: 0x{info['features']:08X}")
+    print(f"Max frame: {info['max_frame']} bytes, chunk: {info['chunk_size']} bytes")
+    print(f"Application area: 0x{info['app_start']:08X} - 0x{info['app_end']:08X}")
+    print(f"Metadata: 0x{info['meta_address']:08X}, first application sector: {info['first_app_sector']}")
+
 def sequence_2(client):
     print("\nErase Flash Memory:")
-    print("1. Mass Erase")
+    print("1. Mass Erase (application area)")
     print("2. Specific Sector Erase")
     choice = input("Enter your choice (1-2): ")
 
@@ -143,10 +761,35 @@ def sequence_2(client):
     else:
         print("Erase command failed")
 
-def sequence_3(client):
-    print("\nFlash Program:")
-    
-    # Step 1: Get the bin or hex file from the user
+def send_and_confirm(client, packet, description):
+    max_retries = 3
+    for attempt in range(max_retries):
+        send_packet(client, TOPIC_SEND, packet, f"{description} (attempt {attempt + 1})")
+
+        ack_received.clear()
+        nack_received.clear()
+
+        poll_ack(client, f"attempt {attempt + 1}")
+
+        if ack_received.wait(timeout=5):
+            print(f"ACK received for {description}")
+            return True
+        elif nack_received.wait(timeout=5):
+            print(f"NACK received. Resending {description}")
+            continue
+        elif not device_ready.is_set() and wait_device_ready(f"the ACK of {description}") \
+                and ack_received.wait(timeout=5):
+            # Accepted before a long operation, the answer only comes once it is over
+            print(f"ACK received for {description}")
+            return True
+        else:
+            print(f"Timeout waiting for response. Retrying {description}")
+
+    print(f"Failed to receive ACK after {max_retries} attempts. Aborting.")
+    return False
+
+def read_image_details():
+    # Get the bin or hex file from the user
     while True:
         file_path = input("Enter the path to the bin or hex file: ")
         if os.path.exists(file_path):
@@ -157,68 +800,124 @@ def sequence_3(client):
     major = int(input("Enter Major Version: "))
     minor = int(input("Enter Minor Version: "))
     patch = int(input("Enter Patch Version: "))
-    
+
     # Get start address from the user
-    start_address = int(input("Enter start address of the program (in hexadecimal): "), 16)
+    start_address = int(input("Enter start address of the program (in hexadecimal, 8010000 or above): "), 16)
+
+    # Optional build ID stored with the image record
+    build_id_text = input("Enter Build ID (in hexadecimal, empty for none): ")
+    build_id = int(build_id_text, 16) if build_id_text else 0
 
     # Read the file
     with open(file_path, 'rb') as file:
         file_content = file.read()
 
-    # Get the size of the program
-    program_size = len(file_content)
+    return file_content, major, minor, patch, start_address, build_id
 
-    # Step 2: Send initial packet
-    command = b'\x02'  # 0x02 for flash program
-    data = (b'\x10' +  # Length (16 bytes)
-            command +
-            major.to_bytes(1, 'big') +
+def write_arguments(major, minor, patch, start_address, program_size, build_id):
+    return (major.to_bytes(1, 'big') +
             minor.to_bytes(1, 'big') +
             patch.to_bytes(1, 'big') +
             start_address.to_bytes(4, 'big') +
-            program_size.to_bytes(4, 'big'))
-    crc = crc32(pad_bytes(data))
-    initial_packet = data + crc.to_bytes(4, 'big')
+            program_size.to_bytes(4, 'big') +
+            build_id.to_bytes(4, 'big'))
 
-    # Function to send a packet and request ACK
-    def send_and_confirm(packet, description):
-        max_retries = 3
-        for attempt in range(max_retries):
-            send_packet(client, TOPIC_SEND, packet, f"{description} (attempt {attempt + 1})")
-            
-            ack_received.clear()
-            nack_received.clear()
-            
-            ack_request = b'\x04'
-            send_packet(client, TOPIC_SEND, ack_request, f"request for ACK signal (attempt {attempt + 1})")
-            
-            if ack_received.wait(timeout=5):
-                print(f"ACK received for {description}")
-                return True
-            elif nack_received.wait(timeout=5):
-                print(f"NACK received. Resending {description}")
-                continue
-            else:
-                print(f"Timeout waiting for response. Retrying {description}")
-        
-        print(f"Failed to receive ACK after {max_retries} attempts. Aborting.")
-        return False
+def send_aggregated(client, packets):
+    # As many frames per message as the bridge takes, each ACK polled by the bridge
+    max_message = session.get('bridge_max_message', 0)
+    index = 0
+    sequence = 0
+    failures = 0
+    while index < len(packets):
+        group = []
+        size = 4
+        while (index + len(group) < len(packets) and len(group) < 255 and
+               size + 2 + len(packets[index + len(group)]) <= max_message):
+            size += 2 + len(packets[index + len(group)])
+            group.append(packets[index + len(group)])
+        if not group:
+            print("A frame does not fit the bridge aggregate size.")
+            return False
 
-    # Send initial packet
-    if not send_and_confirm(initial_packet, "initial flash program packet"):
-        return
+        message = (BRIDGE_MSG_AGGREGATE.to_bytes(1, 'big') +
+                   sequence.to_bytes(2, 'big') +
+                   len(group).to_bytes(1, 'big') +
+                   b''.join(len(p).to_bytes(2, 'big') + p for p in group))
+        wait_device_ready(f"frames {index + 1}-{index + len(group)}")
+        print(f"Sending frames {index + 1}-{index + len(group)} in one message")
+        client.publish(TOPIC_CONTROL, message, qos=1)
+        try:
+            while True:
+                status = aggregate_status.get(timeout=60)
+                if status[0] == sequence:
+                    break
+        except queue.Empty:
+            print("Timeout waiting for the aggregate status.")
+            return False
+
+        _, _, done, results = status
+        print(f"Aggregate {sequence}: {done}/{len(group)} frames confirmed {results}")
+        # Whatever was confirmed stays written, carry on from the first failure
+        index += done
+        sequence = (sequence + 1) & 0xFFFF
+        if done < len(group):
+            failures += 1
+            if failures >= AGGREGATE_ATTEMPTS:
+                print(f"Failed to deliver frame {index + 1}. Aborting.")
+                return False
+    return True
 
-    # Step 4 and 5: Send file content in chunks
+def send_image_chunks(client, file_content):
     chunk_size = 252
+    packets = []
     for i in range(0, len(file_content), chunk_size):
         chunk = file_content[i:i+chunk_size]
         crc = crc32(pad_bytes(chunk))
-        packet = chunk + crc.to_bytes(4, 'big')
-        
-        if not send_and_confirm(packet, f"file chunk {i//chunk_size + 1}"):
-            return
+        packets.append(chunk + crc.to_bytes(4, 'big'))
+
+    if session['bridge_features'] & BRIDGE_FEATURE_AGGREGATE:
+        return send_aggregated(client, packets)
+
+    for i, packet in enumerate(packets):
+        if not send_and_confirm(client, packet, f"file chunk {i + 1}"):
+            return False
+    return True
+
+def sequence_3(client):
+    print("\nFlash Program:")
+
+    file_content, major, minor, patch, start_address, build_id = read_image_details()
+
+    # Get the size of the program
+    program_size = len(file_content)
+
+    # Skip the transfer when the device already runs this exact image, checked in flash
+    digest = crc32(pad_bytes(file_content))
+    info = get_device_info(client) if session['features'] & FEATURE_GET_INFO else None
+    if (info is not None and
+            info['address'] == start_address and
+            info['size'] == program_size and
+            info['digest'] == digest and
+            session['features'] & FEATURE_VERIFY and
+            verify_device_image(client, digest)):
+        print("The device already holds this image, nothing to flash.")
+        return
+
+    # Send initial packet
+    command = b'\x02'  # 0x02 for flash program
+    data = (b'\x14' +  # Length (20 bytes)
+            command +
+            write_arguments(major, minor, patch, start_address, program_size, build_id))
+    crc = crc32(pad_bytes(data))
+    initial_packet = data + crc.to_bytes(4, 'big')
+
+    if not send_and_confirm(client, initial_packet, "initial flash program packet"):
+        return
+
+    # Send file content in chunks
+    if not send_image_chunks(client, file_content):
+        return
 
-    # Step 6: Print success message
     print("Flash programming completed successfully!")
 
 def sequence_4(client):
@@ -257,22 +956,100 @@ def sequence_4(client):
         print("Jump command failed")
 
 
+def sequence_8(client):
+    # Everything still in the bridge's trace ring, oldest first
+    while not trace_parts.empty():
+        trace_parts.get_nowait()
+    client.publish(TOPIC_CONTROL, bytes([BRIDGE_MSG_TRACE]), qos=QOS)
+    entries = {}
+    total = None
+    while total is None or len(entries) < total:
+        try:
+            first, total, part = trace_parts.get(timeout=5)
+        except queue.Empty:
+            print("Timeout waiting for the bridge trace")
+            break
+        for index, entry in enumerate(part):
+            entries[first + index] = entry
+    if not entries:
+        print("Bridge trace is empty")
+        return
+    start = entries[min(entries)][0]
+    print(f"{'time (ms)':>10} {'frame':>6} {'event':<11} {'len':>5} info")
+    for index in sorted(entries):
+        time_us, frame, length, event, info = entries[index]
+        name = TRACE_EVENTS[event] if event < len(TRACE_EVENTS) else event
+        # The timestamp is the low 32 bits of the bridge's microsecond clock
+        elapsed = ((time_us - start) & 0xFFFFFFFF) / 1000
+        print(f"{elapsed:>10.3f} {frame:>6} {name:<11} {length:>5} 0x{info:02X}")
+
+    level = input(f"Bridge log level {'/'.join(LOG_LEVELS)} (Enter to keep): ").strip().upper()
+    if level in LOG_LEVELS:
+        client.publish(TOPIC_CONTROL, bytes([BRIDGE_MSG_LOG_LEVEL, LOG_LEVELS.index(level)]), qos=QOS)
+        print(f"Bridge log level set to {level}")
+
 def main():
-    client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2)
-    client.on_connect = on_connect
-    client.on_message = on_message
+    parser = argparse.ArgumentParser(description="Update a device through its MQTT bridge")
+    parser.add_argument('--device', default=os.environ.get('FOTA_DEVICE'),
+                        help="ID of the bridge (MAC or provisioned name), defaults to $FOTA_DEVICE")
+    parser.add_argument('--target', type=int, default=0,
+                        help="STM32 behind the bridge, 0 for the first; run one host per target to update them together")
+    parser.add_argument('--telemetry', action='store_true',
+                        help="Print every telemetry report of the bridge as it arrives")
+    parser.add_argument('--lan', default=os.environ.get('FOTA_LAN'),
+                        help="Bridge address on the local network, host[:port], defaults to $FOTA_LAN; "
+                             "the broker is used when it is not reachable")
+    parser.add_argument('--mqtt5', action='store_true',
+                        help="Connect with MQTT 5: topic aliases, receive maximum and numbered frames")
+    args = parser.parse_args()
+    session['show_telemetry'] = args.telemetry
+    session['mqtt5'] = args.mqtt5
+    device_id = args.device or input("Enter the device ID: ").strip()
+    # A MAC may be given as printed by the bridge or with separators
+    if len(device_id) == 17 and all(c in '0123456789abcdefABCDEF:-' for c in device_id):
+        device_id = device_id.replace(':', '').replace('-', '')
+    if len(device_id) == 12 and all(c in '0123456789abcdefABCDEF' for c in device_id):
+        device_id = device_id.lower()
+    device_id = select_device(device_id, args.target)
+    print(f"Device {device_id}, topics {TOPIC_PREFIX}/{device_id}/...")
+
+    client = connect_lan(args.lan, args.target) if args.lan else None
+    if client is not None:
+        client.on_message = on_message
+        client.loop_start()
+    else:
+        if args.mqtt5:
+            # The session is kept through clean_start and the expiry given on connect
+            client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=CLIENT_ID,
+                                 protocol=mqtt.MQTTv5)
+        else:
+            client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=CLIENT_ID, clean_session=False)
+        client.on_connect = on_connect
+        client.on_disconnect = on_disconnect
+        client.on_message = on_message
+        client.reconnect_delay_set(min_delay=RECONNECT_MIN_DELAY, max_delay=RECONNECT_MAX_DELAY)
 
-    # Set up SSL/TLS
-    client.tls_set(cert_reqs=ssl.CERT_REQUIRED, tls_version=ssl.PROTOCOL_TLSv1_2)
-    client.tls_insecure_set(True)  # For self-signed certificates
+        # Set up SSL/TLS
+        client.tls_set(cert_reqs=ssl.CERT_REQUIRED, tls_version=ssl.PROTOCOL_TLSv1_2)
+        client.tls_insecure_set(True)  # For self-signed certificates
 
-    client.connect(BROKER, PORT, 60)
+        if args.mqtt5:
+            properties = Properties(PacketTypes.CONNECT)
+            properties.SessionExpiryInterval = MQTT5_SESSION_EXPIRY
+            properties.ReceiveMaximum = MQTT5_RECEIVE_MAXIMUM
+            properties.TopicAliasMaximum = MQTT5_TOPIC_ALIASES
+            client.connect(BROKER, PORT, 60, clean_start=False, properties=properties)
+        else:
+            client.connect(BROKER, PORT, 60)
 
-    # Start the MQTT client loop in a separate thread
-    client.loop_start()
+        # Start the MQTT client loop in a separate thread
+        client.loop_start()
 
-    # Wait for the connection to be established
-    time.sleep(1)
+        # Wait for the connection to be established
+        time.sleep(1)
+
+    # Agree on the features used for this session
+    negotiate(client)
 
     while True:
         print("\nSelect a sequence to run:")
@@ -280,9 +1057,14 @@ def main():
         print("2. Erase Flash Memory")
         print("3. Flash Program")
         print("4. Jump to Address in Flash Memory")
+        print("5. Get Device Info")
+        print("6. Update Image (batched erase, write, verify, jump)")
+        print("7. Update Image through the bridge cache")
+        print("8. Bridge trace and log level")
+        print("9. Last bridge telemetry")
         print("0. Exit")
 
-        choice = input("Enter your choice (0-4): ")
+        choice = input("Enter your choice (0-9): ")
 
         if choice == '1':
             sequence_1(client)
@@ -292,6 +1074,19 @@ def main():
             sequence_3(client)
         elif choice == '4':
             sequence_4(client)
+        elif choice == '5':
+            sequence_5(client)
+        elif choice == '6':
+            sequence_6(client)
+        elif choice == '7':
+            sequence_7(client)
+        elif choice == '8':
+            sequence_8(client)
+        elif choice == '9':
+            if telemetry:
+                print_telemetry(telemetry)
+            else:
+                print("No telemetry received from the bridge yet")
         elif choice == '0':
             break
         else:
@@ -301,6 +1096,8 @@ def main():
         ack_received.clear()
         nack_received.clear()
         version_received.clear()
+        info_received.clear()
+        batch_received.clear()
         unexpected_message.clear()
 
     # Stop the MQTT client loop and disconnect
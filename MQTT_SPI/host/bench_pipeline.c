@@ -0,0 +1,157 @@
+/*
+ * bench_pipeline.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  An image streamed through one target's data path on the host, erase,
+ *  write session and chunks over and over, with ACK_PROXY and EDGE_CRC on.
+ *  Reports the frames per second, the image bytes per second and the
+ *  percentiles of the latency from the MQTT event to the publish of the
+ *  answer. The master's gap between two frames stands for the STM32's
+ *  polling, left at 0 the bridge and the core are all that is measured.
+ *
+ *  bench_pipeline [frames] [master gap us]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "host_bridge.h"
+#include "mock_bootloader.h"
+#include "mock_mqtt.h"
+#include "mock_spi_slave.h"
+#include "Bridge_Check.h"
+
+#define CMD_ERASE               0x01
+#define CMD_WRITE               0x02
+#define DEVICE_ID               "bench"
+#define TOPIC_RX                "fota/" DEVICE_ID "/" TOPIC_DEVICE_RX
+#define FEATURES                (BRIDGE_FEATURE_ACK_PROXY | BRIDGE_FEATURE_EDGE_CRC)
+#define BENCH_FRAMES            20000
+#define BENCH_CHUNK             128         //CHUNK_SIZE of the host script
+#define BENCH_ROUND_CHUNKS      (MOCK_APP_SIZE / BENCH_CHUNK)
+
+typedef struct
+{
+	uint64_t sent_ns;
+	uint64_t *latency_ns;
+	uint32_t answers;
+} bench_t;
+
+static mock_bootloader_t device;
+static mock_mqtt_t mqtt;
+static host_bridge_t bridge;
+static bench_t bench;
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((uint64_t)now.tv_sec * 1000000000ULL) + (uint64_t)now.tv_nsec;
+}
+
+static void bench_published(void *ctx, const char *topic, const uint8_t *data, int len)
+{
+	bench.latency_ns[bench.answers++] = bench_now_ns() - bench.sent_ns;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+static double bench_percentile_us(const uint64_t *sorted, uint32_t count, uint32_t percent)
+{
+	uint32_t index = (uint32_t)(((uint64_t)count * percent + 99) / 100);
+	return (double)sorted[(index > 0) ? (index - 1) : 0] / 1000.0;
+}
+
+//The next frame of the endless update, its length
+static uint16_t bench_frame(uint8_t *frame, uint32_t number, uint32_t *image_bytes)
+{
+	uint8_t args[15] = {0};
+	uint32_t step = number % (BENCH_ROUND_CHUNKS + 2);
+	uint32_t value = 0;
+	if (0 == step)
+	{
+		args[0] = 4;
+		args[1] = 2;
+		return mock_command_frame(frame, CMD_ERASE, args, 2);
+	}
+	if (1 == step)
+	{
+		value = MOCK_APP_START;
+		args[3] = (uint8_t)(value >> 24);
+		args[4] = (uint8_t)(value >> 16);
+		value = BENCH_ROUND_CHUNKS * BENCH_CHUNK;
+		args[7] = (uint8_t)(value >> 24);
+		args[8] = (uint8_t)(value >> 16);
+		args[9] = (uint8_t)(value >> 8);
+		args[10] = (uint8_t)value;
+		return mock_command_frame(frame, CMD_WRITE, args, sizeof(args));
+	}
+	for (uint16_t i = 0; i < BENCH_CHUNK; i++)
+	{
+		frame[i] = (uint8_t)((number * 7) + i);
+	}
+	value = bridge_frame_crc(frame, BENCH_CHUNK);
+	frame[BENCH_CHUNK] = (uint8_t)(value >> 24);
+	frame[BENCH_CHUNK + 1] = (uint8_t)(value >> 16);
+	frame[BENCH_CHUNK + 2] = (uint8_t)(value >> 8);
+	frame[BENCH_CHUNK + 3] = (uint8_t)value;
+	*image_bytes += BENCH_CHUNK;
+	return BENCH_CHUNK + 4;
+}
+
+int main(int argc, char *argv[])
+{
+	uint32_t frames = (argc > 1) ? (uint32_t)strtoul(argv[1], NULL, 0) : BENCH_FRAMES;
+	uint32_t gap_us = (argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 0) : 0;
+	uint8_t frame[FRAME_SIZE];
+	uint32_t image_bytes = 0;
+	uint64_t start_ns = 0;
+	double elapsed_s = 0;
+
+	bench.latency_ns = calloc((0 != frames) ? frames : 1, sizeof(uint64_t));
+	if ((0 == frames) || (NULL == bench.latency_ns))
+	{
+		printf("usage: %s [frames] [master gap us]\n", argv[0]);
+		return 1;
+	}
+	mock_bootloader_init(&device);
+	mock_spi_slave_attach(SPI2_HOST, &device, gap_us);
+	host_bridge_init(&bridge, mock_mqtt_init(&mqtt, host_bridge_event), SPI2_HOST, DEVICE_ID, FEATURES);
+	mqtt.published_cb = bench_published;
+
+	start_ns = bench_now_ns();
+	for (uint32_t number = 0; number < frames; number++)
+	{
+		uint16_t len = bench_frame(frame, number, &image_bytes);
+		bench.sent_ns = bench_now_ns();
+		mock_mqtt_deliver(&mqtt, TOPIC_RX, frame, len);
+	}
+	elapsed_s = (double)(bench_now_ns() - start_ns) / 1e9;
+
+	qsort(bench.latency_ns, bench.answers, sizeof(uint64_t), bench_compare);
+	printf("%u frames, %u SPI exchanges, master gap %u us\n", frames, mock_spi_slave_clocked(SPI2_HOST), gap_us);
+	printf("throughput %.0f frames/s, %.3f MB/s of image\n", frames / elapsed_s, image_bytes / elapsed_s / 1e6);
+	printf("latency us p50 %.2f p90 %.2f p99 %.2f max %.2f\n",
+		   bench_percentile_us(bench.latency_ns, bench.answers, 50),
+		   bench_percentile_us(bench.latency_ns, bench.answers, 90),
+		   bench_percentile_us(bench.latency_ns, bench.answers, 99),
+		   bench_percentile_us(bench.latency_ns, bench.answers, 100));
+	free(bench.latency_ns);
+
+	//Every frame answered with an ACK, none of them lost on the way
+	if ((bench.answers != frames) || (0 != device.nacks) || (0 != bridge.rejected) || (0 != bridge.timeouts))
+	{
+		printf("FAIL %u answers, %u NACKs, %u rejected, %u timeouts\n",
+			   bench.answers, device.nacks, bridge.rejected, bridge.timeouts);
+		return 1;
+	}
+	return 0;
+}
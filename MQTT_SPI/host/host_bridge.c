@@ -0,0 +1,95 @@
+/*
+ * host_bridge.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "host_bridge.h"
+#include "mock_mqtt.h"
+
+static esp_err_t host_bridge_clock(host_bridge_t *bridge);
+static void host_bridge_publish(host_bridge_t *bridge, const uint8_t *data, uint16_t len);
+
+
+void host_bridge_init(host_bridge_t *bridge, esp_mqtt_client_handle_t client, spi_host_device_t host,
+					  const char *device_id, uint32_t features)
+{
+	memset(bridge, 0x00, sizeof(*bridge));
+	bridge->client = client;
+	bridge->host = host;
+	bridge->features = features;
+	bridge_core_downlink_init(&bridge->downlink);
+	bridge_core_uplink_init(&bridge->uplink);
+	snprintf(bridge->topic_tx, sizeof(bridge->topic_tx), "%s%s/%s", TOPIC_PREFIX, device_id, TOPIC_DEVICE_TX);
+	client->handler_ctx = bridge;
+}
+
+//MQTT_EVENT_DATA on bootloader-receive, answered before it returns
+void host_bridge_event(esp_mqtt_event_handle_t event)
+{
+	host_bridge_t *bridge = (host_bridge_t *)event->client->handler_ctx;
+	uint8_t nack[FRAME_SIZE];
+	bridge_reject_t reason = BRIDGE_FRAME_OK;
+	core_down_t action;
+	if ((MQTT_EVENT_DATA != event->event_id) || (event->data_len <= 0) || (event->data_len > FRAME_SIZE))
+	{
+		return;
+	}
+	bridge->frames++;
+	memcpy(bridge->tx, event->data, event->data_len);
+	bridge->tx_len = (uint16_t)event->data_len;
+	action = bridge_core_downlink(&bridge->downlink, bridge->tx, bridge->tx_len, bridge->features, &reason);
+	switch (action)
+	{
+	case CORE_DOWN_REJECT:
+	case CORE_DOWN_HELD:
+		bridge->rejected += (CORE_DOWN_REJECT == action) ? 1 : 0;
+		host_bridge_publish(bridge, nack, bridge_core_nack(nack, sizeof(nack), reason, bridge->features));
+		return;
+	case CORE_DOWN_HOLD:
+		//The host polls next, the NACK goes out then
+		bridge->rejected++;
+		return;
+	case CORE_DOWN_PROXY:
+		if (ESP_OK != host_bridge_clock(bridge))
+		{
+			return;
+		}
+		bridge->tx_len = bridge_core_poll(bridge->tx, sizeof(bridge->tx));
+		break;
+	default:
+		break;
+	}
+	if (ESP_OK != host_bridge_clock(bridge))
+	{
+		return;
+	}
+	bridge_core_uplink_answer(&bridge->uplink, bridge->tx, bridge->tx_len, bridge->rx, bridge->features);
+	host_bridge_publish(bridge, bridge->rx,
+						bridge_core_answer_len(bridge->tx, bridge->tx_len, bridge->rx, sizeof(bridge->rx)));
+}
+
+//One exchange with the master, the frame is only gone once it was clocked
+static esp_err_t host_bridge_clock(host_bridge_t *bridge)
+{
+	spi_slave_transaction_t *done = NULL;
+	esp_err_t ret = ESP_OK;
+	bridge->trans.length = bridge->tx_len * 8;
+	bridge->trans.tx_buffer = bridge->tx;
+	bridge->trans.rx_buffer = bridge->rx;
+	ret = spi_slave_queue_trans(bridge->host, &bridge->trans, portMAX_DELAY);
+	if (ESP_OK == ret)
+	{
+		ret = spi_slave_get_trans_result(bridge->host, &done, portMAX_DELAY);
+	}
+	bridge->timeouts += (ESP_OK == ret) ? 0 : 1;
+	return ret;
+}
+
+static void host_bridge_publish(host_bridge_t *bridge, const uint8_t *data, uint16_t len)
+{
+	esp_mqtt_client_publish(bridge->client, bridge->topic_tx, (const char *)data, len, 1, 0);
+}
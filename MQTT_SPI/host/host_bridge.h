@@ -0,0 +1,47 @@
+/*
+ * host_bridge.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  One target's data path of the bridge on the host: what main_applicaion
+ *  and main_uplink do with a frame, done in line from the MQTT event
+ *  through the core, the SPI slave driver and back to a publish. No tasks
+ *  or queues, so a frame's latency is the CPU time of the path. The empty
+ *  probe frame of FLOW_CONTROL is not armed here, and a frame the master
+ *  never clocks stays queued in the driver like on the ESP32.
+ */
+
+#ifndef HOST_HOST_BRIDGE_H_
+#define HOST_HOST_BRIDGE_H_
+
+#include <stdint.h>
+
+#include "Bridge_Core.h"
+#include "Frame_Pool.h"
+#include "driver/spi_slave.h"
+#include "mqtt_client.h"
+
+typedef struct
+{
+	esp_mqtt_client_handle_t client;
+	spi_host_device_t host;
+	uint32_t features;
+	core_downlink_t downlink;
+	core_uplink_t uplink;
+	char topic_tx[TOPIC_MAX_LENGTH];
+	spi_slave_transaction_t trans;
+	uint8_t tx[FRAME_SIZE];
+	uint8_t rx[FRAME_SIZE];
+	uint16_t tx_len;
+	//Counters
+	uint32_t frames;
+	uint32_t rejected;
+	uint32_t timeouts;
+} host_bridge_t;
+
+void host_bridge_init(host_bridge_t *bridge, esp_mqtt_client_handle_t client, spi_host_device_t host,
+					  const char *device_id, uint32_t features);
+void host_bridge_event(esp_mqtt_event_handle_t event);
+
+#endif /* HOST_HOST_BRIDGE_H_ */
@@ -0,0 +1,36 @@
+/*
+ * host_test.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Just enough to check and count, every test is a plain executable that
+ *  ctest runs and that fails with a non-zero exit code.
+ */
+
+#ifndef HOST_HOST_TEST_H_
+#define HOST_HOST_TEST_H_
+
+#include <stdio.h>
+
+static int host_test_failures = 0;
+
+#define CHECK(cond)                                                             \
+	do {                                                                        \
+		if (!(cond))                                                            \
+		{                                                                       \
+			printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);     \
+			host_test_failures++;                                               \
+		}                                                                       \
+	} while (0)
+
+#define RUN(test)                                                               \
+	do {                                                                        \
+		int failures = host_test_failures;                                      \
+		test();                                                                 \
+		printf("%s %s\n", (failures == host_test_failures) ? "ok  " : "FAIL", #test); \
+	} while (0)
+
+#define HOST_TEST_RESULT()      ((0 == host_test_failures) ? 0 : 1)
+
+#endif /* HOST_HOST_TEST_H_ */
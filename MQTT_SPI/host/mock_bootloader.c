@@ -0,0 +1,182 @@
+/*
+ * mock_bootloader.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+
+#include "mock_bootloader.h"
+
+#define CMD_ERASE               0x01
+#define CMD_WRITE               0x02
+#define CMD_JUMP                0x03
+#define WAIT_FOR_ACK_SIGNAL     0x04
+#define REPEATED_SIGNAL         0x05
+#define CMD_VERIFY              0x09
+#define ACK_SIGNAL              0xFF
+#define NACK_SIGNAL             0x01
+#define CRC_LENGTH              4
+
+#define GET_4BYTES(buf, index)                      \
+	(((uint32_t)(buf)[(index)] << 24) | ((uint32_t)(buf)[(index) + 1] << 16) | \
+	 ((uint32_t)(buf)[(index) + 2] << 8) | (uint32_t)(buf)[(index) + 3])
+#define PUT_4BYTES(buf, index, value)               \
+	do {                                            \
+		(buf)[(index)]     = (uint8_t)((value) >> 24); \
+		(buf)[(index) + 1] = (uint8_t)((value) >> 16); \
+		(buf)[(index) + 2] = (uint8_t)((value) >> 8);  \
+		(buf)[(index) + 3] = (uint8_t)(value);         \
+	} while (0)
+
+static bool mock_crc_ok(const uint8_t *frame, uint16_t len);
+static bool mock_command(mock_bootloader_t *device, const uint8_t *frame, uint16_t len);
+static bool mock_chunk(mock_bootloader_t *device, const uint8_t *frame, uint16_t len);
+
+
+void mock_bootloader_init(mock_bootloader_t *device)
+{
+	memset(device, 0x00, sizeof(*device));
+	memset(device->flash, 0xFF, sizeof(device->flash));
+}
+
+esp_err_t mock_bootloader_transfer(void *ctx, const uint8_t *tx, uint16_t len, uint8_t *rx)
+{
+	mock_bootloader_t *device = (mock_bootloader_t *)ctx;
+	bool ok = false;
+	if ((0 != device->silent_after) && (device->exchanges >= device->silent_after))
+	{
+		return ESP_ERR_TIMEOUT;
+	}
+	device->exchanges++;
+	memset(rx, 0x00, MOCK_FRAME_SIZE);
+	if ((1 == len) && (WAIT_FOR_ACK_SIGNAL == tx[0]))
+	{
+		rx[0] = device->pending;
+		return ESP_OK;
+	}
+	if ((1 == len) && (REPEATED_SIGNAL == tx[0]))
+	{
+		memcpy(rx, device->pushed, device->pushed_len);
+		return ESP_OK;
+	}
+	//A corrupted frame is NACKed without being looked at
+	if (0 != device->nack_frames)
+	{
+		device->nack_frames--;
+		ok = false;
+	}
+	else if (!mock_crc_ok(tx, len))
+	{
+		ok = false;
+	}
+	else if (device->writing)
+	{
+		ok = mock_chunk(device, tx, len);
+	}
+	else
+	{
+		ok = mock_command(device, tx, len);
+	}
+	device->pending = ok ? ACK_SIGNAL : NACK_SIGNAL;
+	device->nacks += ok ? 0 : 1;
+	return ESP_OK;
+}
+
+//Same as the bootloader CRC unit, every byte fed as a big-endian word
+uint32_t mock_frame_crc(const uint8_t *data, uint32_t len)
+{
+	uint32_t crc = 0xFFFFFFFFUL;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		crc ^= (uint32_t)data[i];
+		for (uint8_t bit = 0; bit < 32; bit++)
+		{
+			crc = (crc & 0x80000000UL) ? ((crc << 1) ^ 0x04C11DB7UL) : (crc << 1);
+		}
+	}
+	return crc;
+}
+
+//Host layout: length (index of the last byte), command, arguments, CRC
+uint16_t mock_command_frame(uint8_t *frame, uint8_t command, const uint8_t *args, uint8_t len)
+{
+	frame[0] = len + 5;
+	frame[1] = command;
+	memcpy(&frame[2], args, len);
+	PUT_4BYTES(frame, len + 2, mock_frame_crc(frame, len + 2));
+	return len + 6;
+}
+
+static bool mock_crc_ok(const uint8_t *frame, uint16_t len)
+{
+	return (len > CRC_LENGTH) && (GET_4BYTES(frame, len - CRC_LENGTH) == mock_frame_crc(frame, len - CRC_LENGTH));
+}
+
+static bool mock_command(mock_bootloader_t *device, const uint8_t *frame, uint16_t len)
+{
+	uint32_t offset = 0;
+	uint32_t end = 0;
+	uint32_t digest = 0;
+	if ((len != (uint16_t)frame[0] + 1))
+	{
+		return false;
+	}
+	switch (frame[1])
+	{
+	case CMD_ERASE:
+		//Only the application sectors exist here
+		if ((frame[2] < 4) || ((frame[2] + frame[3]) > 6) || (0 == frame[3]))
+		{
+			return false;
+		}
+		offset = (4 == frame[2]) ? 0 : MOCK_SECTOR_5_OFFSET;
+		end = ((frame[2] + frame[3]) == 5) ? MOCK_SECTOR_5_OFFSET : MOCK_APP_SIZE;
+		memset(&device->flash[offset], 0xFF, end - offset);
+		device->erases++;
+		return true;
+	case CMD_WRITE:
+		device->write_add = GET_4BYTES(frame, 5);
+		device->write_size = GET_4BYTES(frame, 9);
+		if ((device->write_add < MOCK_APP_START) ||
+			((device->write_add - MOCK_APP_START + device->write_size) > MOCK_APP_SIZE))
+		{
+			return false;
+		}
+		device->written = 0;
+		device->writing = (0 != device->write_size);
+		return true;
+	case CMD_VERIFY:
+		digest = mock_frame_crc(&device->flash[device->write_add - MOCK_APP_START], device->write_size);
+		device->pushed[0] = 10;
+		device->pushed[1] = CMD_VERIFY;
+		device->pushed[2] = (digest == GET_4BYTES(frame, 2)) ? 0 : 1;
+		PUT_4BYTES(device->pushed, 3, digest);
+		PUT_4BYTES(device->pushed, 7, mock_frame_crc(device->pushed, 7));
+		device->pushed_len = 11;
+		return true;
+	case CMD_JUMP:
+		device->jumped = true;
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool mock_chunk(mock_bootloader_t *device, const uint8_t *frame, uint16_t len)
+{
+	uint32_t size = len - CRC_LENGTH;
+	uint32_t offset = device->write_add - MOCK_APP_START + device->written;
+	if ((device->written + size) > device->write_size)
+	{
+		return false;
+	}
+	//Flash only clears bits
+	for (uint32_t i = 0; i < size; i++)
+	{
+		device->flash[offset + i] &= frame[i];
+	}
+	device->written += size;
+	device->writing = (device->written < device->write_size);
+	return true;
+}
@@ -0,0 +1,52 @@
+/*
+ * mock_bootloader.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The STM32 bootloader as the bridge sees it on the wire, in RAM. Every
+ *  call is one whole frame exchange: commands and chunks are checked and
+ *  executed, a WAIT_FOR_ACK poll gets the ACK or NACK of the frame before
+ *  it and REPEATED gets the reply the last command pushed. Faults are
+ *  injected by the tests through the fields below.
+ */
+
+#ifndef HOST_MOCK_BOOTLOADER_H_
+#define HOST_MOCK_BOOTLOADER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_err.h"
+
+#define MOCK_FRAME_SIZE         256
+#define MOCK_APP_START          0x08010000UL
+#define MOCK_APP_SIZE           0x30000UL   //Sectors 4 and 5
+#define MOCK_SECTOR_5_OFFSET    0x10000UL
+
+typedef struct
+{
+	uint8_t flash[MOCK_APP_SIZE];
+	uint32_t write_add;
+	uint32_t write_size;
+	uint32_t written;
+	bool writing;
+	uint8_t pending;            //Signal clocked out on the next poll
+	uint8_t pushed[MOCK_FRAME_SIZE];
+	uint16_t pushed_len;
+	bool jumped;
+	//Faults
+	uint16_t nack_frames;       //The next frames fail their CRC check
+	uint32_t silent_after;      //Exchanges answered before the link goes quiet, 0 for never
+	//Counters
+	uint32_t exchanges;
+	uint32_t nacks;
+	uint32_t erases;
+} mock_bootloader_t;
+
+void mock_bootloader_init(mock_bootloader_t *device);
+esp_err_t mock_bootloader_transfer(void *ctx, const uint8_t *tx, uint16_t len, uint8_t *rx);
+uint32_t mock_frame_crc(const uint8_t *data, uint32_t len);
+uint16_t mock_command_frame(uint8_t *frame, uint8_t command, const uint8_t *args, uint8_t len);
+
+#endif /* HOST_MOCK_BOOTLOADER_H_ */
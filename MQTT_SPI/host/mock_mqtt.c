@@ -0,0 +1,55 @@
+/*
+ * mock_mqtt.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+
+#include "mock_mqtt.h"
+
+
+esp_mqtt_client_handle_t mock_mqtt_init(mock_mqtt_t *mqtt, mock_mqtt_handler_t handler)
+{
+	memset(mqtt, 0x00, sizeof(*mqtt));
+	mqtt->handler = handler;
+	return mqtt;
+}
+
+//The whole message in one event, as esp-mqtt does when it fits its buffer
+void mock_mqtt_deliver(esp_mqtt_client_handle_t client, const char *topic, const uint8_t *data, int len)
+{
+	esp_mqtt_event_t event = {
+		.event_id = MQTT_EVENT_DATA,
+		.client = client,
+		.data = (char *)data,
+		.data_len = len,
+		.total_data_len = len,
+		.current_data_offset = 0,
+		.topic = (char *)topic,
+		.topic_len = (int)strlen(topic),
+		.msg_id = ++client->msg_id,
+		.qos = 1,
+	};
+	client->delivered++;
+	client->handler(&event);
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+							int len, int qos, int retain)
+{
+	if ((len < 0) || (len > MOCK_MQTT_DATA_MAX))
+	{
+		return -1;
+	}
+	strncpy(client->topic, topic, MOCK_MQTT_TOPIC_MAX - 1);
+	memcpy(client->data, data, len);
+	client->len = len;
+	client->published++;
+	client->bytes += len;
+	if (NULL != client->published_cb)
+	{
+		client->published_cb(client->ctx, topic, (const uint8_t *)data, len);
+	}
+	return ++client->msg_id;
+}
@@ -0,0 +1,45 @@
+/*
+ * mock_mqtt.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  esp-mqtt without a broker. Messages from the host are handed to the
+ *  bridge's event handler as MQTT_EVENT_DATA, what the bridge publishes is
+ *  counted and the last message kept for the tests to look at.
+ */
+
+#ifndef HOST_MOCK_MQTT_H_
+#define HOST_MOCK_MQTT_H_
+
+#include <stdint.h>
+
+#include "mqtt_client.h"
+
+#define MOCK_MQTT_TOPIC_MAX     64
+#define MOCK_MQTT_DATA_MAX      512
+
+typedef void (*mock_mqtt_handler_t)(esp_mqtt_event_handle_t event);
+typedef void (*mock_mqtt_published_t)(void *ctx, const char *topic, const uint8_t *data, int len);
+
+typedef struct esp_mqtt_client
+{
+	mock_mqtt_handler_t handler;
+	void *handler_ctx;                     //For the handler, the bridge it feeds
+	mock_mqtt_published_t published_cb;    //Called on every publish, NULL for none
+	void *ctx;
+	int msg_id;
+	//Counters
+	uint32_t delivered;
+	uint32_t published;
+	uint32_t bytes;
+	//Last publish
+	char topic[MOCK_MQTT_TOPIC_MAX];
+	uint8_t data[MOCK_MQTT_DATA_MAX];
+	int len;
+} mock_mqtt_t;
+
+esp_mqtt_client_handle_t mock_mqtt_init(mock_mqtt_t *mqtt, mock_mqtt_handler_t handler);
+void mock_mqtt_deliver(esp_mqtt_client_handle_t client, const char *topic, const uint8_t *data, int len);
+
+#endif /* HOST_MOCK_MQTT_H_ */
@@ -0,0 +1,78 @@
+/*
+ * mock_spi_slave.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+#include <time.h>
+
+#include "mock_spi_slave.h"
+
+typedef struct
+{
+	mock_bootloader_t *device;
+	uint32_t master_gap_us;
+	const spi_slave_transaction_t *queue[MOCK_SPI_QUEUE];
+	uint8_t head;
+	uint8_t count;
+	uint32_t clocked;
+} mock_spi_slave_t;
+
+static mock_spi_slave_t slaves[SPI_HOST_MAX];
+
+
+void mock_spi_slave_attach(spi_host_device_t host, mock_bootloader_t *device, uint32_t master_gap_us)
+{
+	memset(&slaves[host], 0x00, sizeof(slaves[host]));
+	slaves[host].device = device;
+	slaves[host].master_gap_us = master_gap_us;
+}
+
+uint32_t mock_spi_slave_clocked(spi_host_device_t host)
+{
+	return slaves[host].clocked;
+}
+
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, const spi_slave_transaction_t *trans_desc,
+								TickType_t ticks_to_wait)
+{
+	mock_spi_slave_t *slave = &slaves[host];
+	if ((NULL == slave->device) || (MOCK_SPI_QUEUE == slave->count))
+	{
+		return ESP_ERR_TIMEOUT;
+	}
+	slave->queue[(slave->head + slave->count++) % MOCK_SPI_QUEUE] = trans_desc;
+	return ESP_OK;
+}
+
+//The master clocks the oldest armed frame, nothing comes back while the link is quiet
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t **trans_desc,
+									 TickType_t ticks_to_wait)
+{
+	mock_spi_slave_t *slave = &slaves[host];
+	spi_slave_transaction_t *trans = NULL;
+	struct timespec gap = {0};
+	if (0 == slave->count)
+	{
+		return ESP_ERR_TIMEOUT;
+	}
+	trans = (spi_slave_transaction_t *)slave->queue[slave->head];
+	if (0 != slave->master_gap_us)
+	{
+		gap.tv_sec = slave->master_gap_us / 1000000UL;
+		gap.tv_nsec = (long)(slave->master_gap_us % 1000000UL) * 1000L;
+		nanosleep(&gap, NULL);
+	}
+	if (ESP_OK != mock_bootloader_transfer(slave->device, trans->tx_buffer, (uint16_t)(trans->length / 8),
+										   trans->rx_buffer))
+	{
+		return ESP_ERR_TIMEOUT;
+	}
+	trans->trans_len = trans->length;
+	slave->head = (slave->head + 1) % MOCK_SPI_QUEUE;
+	slave->count--;
+	slave->clocked++;
+	*trans_desc = trans;
+	return ESP_OK;
+}
@@ -0,0 +1,27 @@
+/*
+ * mock_spi_slave.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The ESP-IDF SPI slave driver with the STM32 master behind it. Queued
+ *  transactions are clocked one at a time against the mock bootloader when
+ *  the bridge asks for a result, after the gap the master leaves between
+ *  two frames. The host harness queues the frame's own length, on the wire
+ *  the master clocks FRAME_SIZE and the bootloader finds the end itself.
+ */
+
+#ifndef HOST_MOCK_SPI_SLAVE_H_
+#define HOST_MOCK_SPI_SLAVE_H_
+
+#include <stdint.h>
+
+#include "driver/spi_slave.h"
+#include "mock_bootloader.h"
+
+#define MOCK_SPI_QUEUE          3   //SPI_IN_FLIGHT of the bridge
+
+void mock_spi_slave_attach(spi_host_device_t host, mock_bootloader_t *device, uint32_t master_gap_us);
+uint32_t mock_spi_slave_clocked(spi_host_device_t host);
+
+#endif /* HOST_MOCK_SPI_SLAVE_H_ */
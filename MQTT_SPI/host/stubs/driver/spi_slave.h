@@ -0,0 +1,42 @@
+/*
+ * spi_slave.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The part of the ESP-IDF SPI slave driver the bridge uses to hand frames
+ *  to the STM32 master, for the host build. mock_spi_slave.c plays the
+ *  master behind it.
+ */
+
+#ifndef HOST_STUBS_DRIVER_SPI_SLAVE_H_
+#define HOST_STUBS_DRIVER_SPI_SLAVE_H_
+
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+
+typedef enum
+{
+	SPI1_HOST = 0,
+	SPI2_HOST,
+	SPI3_HOST,
+	SPI_HOST_MAX,
+} spi_host_device_t;
+
+typedef struct
+{
+	size_t length;              //Bits to clock
+	size_t trans_len;           //Bits the master clocked
+	const void *tx_buffer;
+	void *rx_buffer;
+	void *user;
+} spi_slave_transaction_t;
+
+esp_err_t spi_slave_queue_trans(spi_host_device_t host, const spi_slave_transaction_t *trans_desc,
+								TickType_t ticks_to_wait);
+esp_err_t spi_slave_get_trans_result(spi_host_device_t host, spi_slave_transaction_t **trans_desc,
+									 TickType_t ticks_to_wait);
+
+#endif /* HOST_STUBS_DRIVER_SPI_SLAVE_H_ */
@@ -0,0 +1,24 @@
+/*
+ * esp_rom_crc.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include "esp_rom_crc.h"
+
+#define CRC32_POLY          0x04C11DB7UL
+
+
+uint32_t esp_rom_crc32_be(uint32_t crc, uint8_t const *buf, uint32_t len)
+{
+	crc = ~crc;
+	for (uint32_t i = 0; i < len; i++)
+	{
+		crc ^= (uint32_t)buf[i] << 24;
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x80000000UL) ? ((crc << 1) ^ CRC32_POLY) : (crc << 1);
+		}
+	}
+	return ~crc;
+}
@@ -0,0 +1,18 @@
+/*
+ * esp_rom_crc.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The big-endian CRC-32 of the ESP32 ROM, for the host build. Like the ROM
+ *  it inverts the register on the way in and out.
+ */
+
+#ifndef HOST_STUBS_ESP_ROM_CRC_H_
+#define HOST_STUBS_ESP_ROM_CRC_H_
+
+#include <stdint.h>
+
+uint32_t esp_rom_crc32_be(uint32_t crc, uint8_t const *buf, uint32_t len);
+
+#endif /* HOST_STUBS_ESP_ROM_CRC_H_ */
@@ -0,0 +1,23 @@
+/*
+ * FreeRTOS.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Only the types the headers of the plain C modules name, for the host
+ *  build. Nothing here schedules anything.
+ */
+
+#ifndef HOST_STUBS_FREERTOS_H_
+#define HOST_STUBS_FREERTOS_H_
+
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef int BaseType_t;
+
+#define portMAX_DELAY       ((TickType_t)0xFFFFFFFFUL)
+#define pdTRUE              1
+#define pdFALSE             0
+
+#endif /* HOST_STUBS_FREERTOS_H_ */
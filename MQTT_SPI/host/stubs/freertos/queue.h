@@ -0,0 +1,15 @@
+/*
+ * queue.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+
+#ifndef HOST_STUBS_FREERTOS_QUEUE_H_
+#define HOST_STUBS_FREERTOS_QUEUE_H_
+
+#include "freertos/FreeRTOS.h"
+
+typedef void *QueueHandle_t;
+
+#endif /* HOST_STUBS_FREERTOS_QUEUE_H_ */
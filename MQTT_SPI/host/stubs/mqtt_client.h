@@ -0,0 +1,44 @@
+/*
+ * mqtt_client.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The part of esp-mqtt the bridge receives frames and publishes answers
+ *  with, for the host build. mock_mqtt.c stands in for the client.
+ */
+
+#ifndef HOST_STUBS_MQTT_CLIENT_H_
+#define HOST_STUBS_MQTT_CLIENT_H_
+
+#include "esp_err.h"
+
+typedef struct esp_mqtt_client *esp_mqtt_client_handle_t;
+
+typedef enum
+{
+	MQTT_EVENT_CONNECTED = 1,
+	MQTT_EVENT_DISCONNECTED,
+	MQTT_EVENT_DATA,
+} esp_mqtt_event_id_t;
+
+typedef struct
+{
+	esp_mqtt_event_id_t event_id;
+	esp_mqtt_client_handle_t client;
+	char *data;
+	int data_len;
+	int total_data_len;
+	int current_data_offset;
+	char *topic;
+	int topic_len;
+	int msg_id;
+	int qos;
+} esp_mqtt_event_t;
+
+typedef esp_mqtt_event_t *esp_mqtt_event_handle_t;
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data,
+							int len, int qos, int retain);
+
+#endif /* HOST_STUBS_MQTT_CLIENT_H_ */
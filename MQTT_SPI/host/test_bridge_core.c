@@ -0,0 +1,220 @@
+/*
+ * test_bridge_core.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The bridge core on its own, then one target's whole data path from the
+ *  mock MQTT client through the mock SPI slave to the mock bootloader.
+ */
+#include <string.h>
+
+#include "host_test.h"
+#include "host_bridge.h"
+#include "mock_bootloader.h"
+#include "mock_mqtt.h"
+#include "mock_spi_slave.h"
+#include "Bridge_Check.h"
+
+#define CMD_ERASE               0x01
+#define CMD_WRITE               0x02
+#define CMD_VERIFY              0x09
+#define DEVICE_ID               "host"
+#define FEATURES                (BRIDGE_FEATURE_ACK_PROXY | BRIDGE_FEATURE_EDGE_CRC)
+
+static mock_bootloader_t device;
+static mock_mqtt_t mqtt;
+static host_bridge_t bridge;
+
+static uint16_t erase_frame(uint8_t *frame)
+{
+	const uint8_t args[] = {4, 1};
+	return mock_command_frame(frame, CMD_ERASE, args, sizeof(args));
+}
+
+static void test_crc_matches_the_device(void)
+{
+	uint8_t data[300];
+	for (uint16_t i = 0; i < sizeof(data); i++)
+	{
+		data[i] = (uint8_t)(i * 13);
+	}
+	//Across the ROM blocks and shorter than one
+	CHECK(mock_frame_crc(data, sizeof(data)) == bridge_frame_crc(data, sizeof(data)));
+	CHECK(mock_frame_crc(data, 5) == bridge_frame_crc(data, 5));
+}
+
+static void test_check_frame(void)
+{
+	uint8_t frame[FRAME_SIZE];
+	uint16_t len = erase_frame(frame);
+	CHECK(BRIDGE_FRAME_OK == bridge_check_frame(frame, len));
+	CHECK(BRIDGE_FRAME_OK == bridge_check_frame(frame, 1));
+	CHECK(BRIDGE_REJECT_LENGTH == bridge_check_frame(frame, 4));
+	CHECK(BRIDGE_REJECT_LENGTH == bridge_check_frame(frame, FRAME_SIZE + 1));
+	frame[2] ^= 0x01;
+	CHECK(BRIDGE_REJECT_CRC == bridge_check_frame(frame, len));
+}
+
+static void test_downlink_actions(void)
+{
+	core_downlink_t downlink;
+	bridge_reject_t reason;
+	uint8_t frame[FRAME_SIZE];
+	uint8_t poll = BL_WAIT_FOR_ACK_SIGNAL;
+	uint16_t len = erase_frame(frame);
+	bridge_core_downlink_init(&downlink);
+	CHECK(CORE_DOWN_FORWARD == bridge_core_downlink(&downlink, frame, len, 0, &reason));
+	CHECK(CORE_DOWN_PROXY == bridge_core_downlink(&downlink, frame, len, FEATURES, &reason));
+	CHECK(CORE_DOWN_FORWARD == bridge_core_downlink(&downlink, &poll, 1, FEATURES, &reason));
+	frame[3] ^= 0x01;
+	CHECK(CORE_DOWN_REJECT == bridge_core_downlink(&downlink, frame, len, FEATURES, &reason));
+	CHECK(BRIDGE_REJECT_CRC == reason);
+	//Without the proxy the rejection waits for the host's poll
+	CHECK(CORE_DOWN_HOLD == bridge_core_downlink(&downlink, frame, len, 0, &reason));
+	CHECK(CORE_DOWN_HELD == bridge_core_downlink(&downlink, &poll, 1, 0, &reason));
+	CHECK(BRIDGE_REJECT_CRC == reason);
+	CHECK(CORE_DOWN_FORWARD == bridge_core_downlink(&downlink, &poll, 1, 0, &reason));
+}
+
+static void test_nack(void)
+{
+	uint8_t answer[8];
+	CHECK(1 == bridge_core_nack(answer, sizeof(answer), BRIDGE_REJECT_CRC, 0));
+	CHECK(BL_NACK_SIGNAL == answer[0]);
+	CHECK(3 == bridge_core_nack(answer, sizeof(answer), BRIDGE_REJECT_LENGTH, BRIDGE_FEATURE_EDGE_CRC));
+	CHECK((BRIDGE_NACK_MARKER == answer[1]) && (BRIDGE_REJECT_LENGTH == answer[2]));
+}
+
+static void test_answer_len(void)
+{
+	uint8_t poll = BL_WAIT_FOR_ACK_SIGNAL;
+	uint8_t repeated = BL_REPEATED_SIGNAL;
+	uint8_t answer[FRAME_SIZE] = {0};
+	const uint8_t digest[] = {0, 0x12, 0x34, 0x56, 0x78};
+	answer[0] = BL_ACK_SIGNAL;
+	CHECK(1 == bridge_core_answer_len(&poll, 1, answer, sizeof(answer)));
+	//A pushed reply is as long as it says, zeros and all
+	CHECK(11 == bridge_core_answer_len(&repeated, 1, answer,
+									   mock_command_frame(answer, CMD_VERIFY, digest, sizeof(digest)) + 100));
+	memset(answer, 0x00, sizeof(answer));
+	answer[0] = 1;
+	answer[2] = 7;
+	CHECK(BL_VERSION_LENGTH == bridge_core_answer_len(&repeated, 1, answer, sizeof(answer)));
+}
+
+static void test_uplink_flow(void)
+{
+	core_uplink_t uplink;
+	uint8_t poll = BL_WAIT_FOR_ACK_SIGNAL;
+	uint8_t answer[FRAME_SIZE] = {BL_READY_SIGNAL};
+	bridge_core_uplink_init(&uplink);
+	//The ready mark never reaches the host
+	CHECK(0 == bridge_core_uplink_answer(&uplink, &poll, 1, answer, BRIDGE_FEATURE_FLOW_CONTROL));
+	CHECK(0x00 == answer[0]);
+	answer[0] = BL_ACK_SIGNAL;
+	CHECK(CORE_UP_ARM_PROBE == bridge_core_uplink_answer(&uplink, &poll, 1, answer, BRIDGE_FEATURE_FLOW_CONTROL));
+	CHECK(0 == bridge_core_uplink_answer(&uplink, &poll, 1, answer, 0));
+	bridge_core_probe_armed(&uplink, true);
+	CHECK(bridge_core_uplink_watching(&uplink));
+	CHECK(CORE_UP_FLOW == bridge_core_uplink_timeout(&uplink));
+	CHECK(0 == bridge_core_uplink_timeout(&uplink));
+	//Still repeating the ACK, then back with the ready mark
+	CHECK(CORE_UP_ARM_PROBE == bridge_core_uplink_probe(&uplink, answer));
+	answer[0] = BL_READY_SIGNAL;
+	CHECK(CORE_UP_FLOW == bridge_core_uplink_probe(&uplink, answer));
+	CHECK(uplink.ready && !uplink.probe_armed);
+}
+
+static void test_aggregate(void)
+{
+	core_aggregate_t aggregate;
+	uint8_t data[64] = {BRIDGE_MSG_AGGREGATE, 0x00, 0x07, 3};
+	uint16_t index = BRIDGE_AGGREGATE_HEADER;
+	const uint8_t *frame = NULL;
+	uint16_t len = 0;
+	for (uint8_t i = 0; i < 3; i++)
+	{
+		len = erase_frame(&data[index + 2]);
+		data[index] = 0;
+		data[index + 1] = (uint8_t)len;
+		index += 2 + len;
+	}
+	//The second frame is corrupted, the third is never sent
+	data[BRIDGE_AGGREGATE_HEADER + 2 + len + 2 + 3] ^= 0x01;
+	bridge_core_aggregate_begin(&aggregate, data, index, FRAME_SIZE);
+	CHECK(bridge_core_aggregate_next(&aggregate, &frame, &len));
+	CHECK(&data[BRIDGE_AGGREGATE_HEADER + 2] == frame);
+	bridge_core_aggregate_result(&aggregate, AGGREGATE_OK);
+	CHECK(!bridge_core_aggregate_next(&aggregate, &frame, &len));
+	CHECK(!bridge_core_aggregate_next(&aggregate, &frame, &len));
+	CHECK(BRIDGE_AGGREGATE_STATUS_HEADER + 2 == bridge_core_aggregate_status(&aggregate));
+	CHECK((3 == aggregate.status[3]) && (1 == aggregate.status[4]));
+	CHECK((AGGREGATE_OK == aggregate.status[5]) && (AGGREGATE_BAD_CRC == aggregate.status[6]));
+}
+
+static void setup_path(void)
+{
+	mock_bootloader_init(&device);
+	mock_spi_slave_attach(SPI2_HOST, &device, 0);
+	host_bridge_init(&bridge, mock_mqtt_init(&mqtt, host_bridge_event), SPI2_HOST, DEVICE_ID, FEATURES);
+}
+
+static void test_path_command_is_proxied(void)
+{
+	uint8_t frame[FRAME_SIZE];
+	setup_path();
+	mock_mqtt_deliver(&mqtt, "fota/" DEVICE_ID "/" TOPIC_DEVICE_RX, frame, erase_frame(frame));
+	//The frame and the bridge's own poll, only the poll's answer is published
+	CHECK(2 == mock_spi_slave_clocked(SPI2_HOST));
+	CHECK(1 == device.erases);
+	CHECK(1 == mqtt.published);
+	CHECK((1 == mqtt.len) && (BL_ACK_SIGNAL == mqtt.data[0]));
+	CHECK(0 == strcmp("fota/" DEVICE_ID "/" TOPIC_DEVICE_TX, mqtt.topic));
+}
+
+static void test_path_corrupted_frame_stays_on_the_bridge(void)
+{
+	uint8_t frame[FRAME_SIZE];
+	uint16_t len = 0;
+	setup_path();
+	len = erase_frame(frame);
+	frame[len - 1] ^= 0xFF;
+	mock_mqtt_deliver(&mqtt, "fota/" DEVICE_ID "/" TOPIC_DEVICE_RX, frame, len);
+	CHECK(0 == device.exchanges);
+	CHECK(1 == bridge.rejected);
+	CHECK((3 == mqtt.len) && (BL_NACK_SIGNAL == mqtt.data[0]) && (BRIDGE_REJECT_CRC == mqtt.data[2]));
+}
+
+static void test_path_pushed_reply(void)
+{
+	uint8_t frame[FRAME_SIZE];
+	uint8_t repeated = BL_REPEATED_SIGNAL;
+	uint8_t digest[5] = {0};
+	//An empty write session at the application, the digest is over nothing
+	uint8_t header[15] = {1, 0, 0, 0x08, 0x01, 0x00, 0x00};
+	setup_path();
+	mock_mqtt_deliver(&mqtt, "fota/" DEVICE_ID "/" TOPIC_DEVICE_RX, frame,
+					  mock_command_frame(frame, CMD_WRITE, header, sizeof(header)));
+	mock_mqtt_deliver(&mqtt, "fota/" DEVICE_ID "/" TOPIC_DEVICE_RX, frame,
+					  mock_command_frame(frame, CMD_VERIFY, digest, sizeof(digest)));
+	mock_mqtt_deliver(&mqtt, "fota/" DEVICE_ID "/" TOPIC_DEVICE_RX, &repeated, 1);
+	CHECK(3 == mqtt.published);
+	CHECK((11 == mqtt.len) && (CMD_VERIFY == mqtt.data[1]));
+	CHECK(BRIDGE_FRAME_OK == bridge_check_frame(mqtt.data, mqtt.len));
+}
+
+int main(void)
+{
+	RUN(test_crc_matches_the_device);
+	RUN(test_check_frame);
+	RUN(test_downlink_actions);
+	RUN(test_nack);
+	RUN(test_answer_len);
+	RUN(test_uplink_flow);
+	RUN(test_aggregate);
+	RUN(test_path_command_is_proxied);
+	RUN(test_path_corrupted_frame_stays_on_the_bridge);
+	RUN(test_path_pushed_reply);
+	return HOST_TEST_RESULT();
+}
@@ -0,0 +1,165 @@
+"""
+test_broker.py
+
+ Created on: Oct 19, 2026
+     Author: ahmed
+
+ The MQTT 5 profile of the bridge on a local mosquitto: the host script's
+ numbered frames come back with their correlation data, and the broker
+ holds back the frames beyond the receive maximum the bridge connects
+ with. A stand-in client plays the bridge with the same connect profile.
+ Without mosquitto or paho-mqtt it exits with SKIP_CODE, ctest shows it
+ as skipped.
+"""
+import os
+import queue
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import unittest
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+# Importing the host script must not leave bytecode next to it in the tree
+sys.dont_write_bytecode = True
+sys.path.insert(0, os.path.join(HERE, '..', '..'))
+
+try:
+    import paho.mqtt.client as mqtt
+    from paho.mqtt.properties import Properties
+    from paho.mqtt.packettypes import PacketTypes
+    import Bootloader_host as host
+except ImportError:
+    mqtt = None
+
+MOSQUITTO = shutil.which('mosquitto')
+BRIDGE_ID = 'host-test'
+TARGETS = 1
+RECEIVE_TIMEOUT = 2.0
+SETTLE_TIME = 0.5
+SKIP_CODE = 77          # SKIP_RETURN_CODE of the test in CMakeLists.txt
+
+
+def bridge_receive_maximum(targets):
+    # Same as MQTT5_RECEIVE_MAXIMUM in MQTT_Task.c, from the pool size in Frame_Pool.h
+    with open(os.path.join(HERE, '..', 'main', 'Frame_Pool.h')) as header:
+        per_target = int(re.search(r'#define\s+FRAME_POOL_COUNT\s+\((\d+)\s*\*\s*CONFIG_BRIDGE_TARGETS\)',
+                                   header.read()).group(1))
+    return (per_target * targets - 2 * targets) // 2
+
+
+def free_port():
+    with socket.socket(socket.AF_INET, socket.SOCK_STREAM) as sock:
+        sock.bind(('127.0.0.1', 0))
+        return sock.getsockname()[1]
+
+
+class Broker:
+    def __init__(self):
+        self.port = free_port()
+        self.dir = tempfile.TemporaryDirectory()
+        config = os.path.join(self.dir.name, 'mosquitto.conf')
+        with open(config, 'w') as conf:
+            conf.write(f"listener {self.port} 127.0.0.1\nallow_anonymous true\n")
+        self.process = subprocess.Popen([MOSQUITTO, '-c', config],
+                                        stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        deadline = time.monotonic() + RECEIVE_TIMEOUT
+        while True:
+            try:
+                socket.create_connection(('127.0.0.1', self.port), timeout=0.1).close()
+                return
+            except OSError:
+                if time.monotonic() > deadline:
+                    self.stop()
+                    raise
+                time.sleep(0.05)
+
+    def stop(self):
+        self.process.terminate()
+        self.process.wait()
+        self.dir.cleanup()
+
+
+class Client:
+    """A paho MQTT 5 client that queues what it receives"""
+    def __init__(self, port, client_id, topic, receive_maximum=None, manual_ack=False):
+        self.messages = queue.Queue()
+        self.subscribed = threading.Event()
+        self.client = mqtt.Client(mqtt.CallbackAPIVersion.VERSION2, client_id=client_id,
+                                  protocol=mqtt.MQTTv5, manual_ack=manual_ack)
+        self.client.on_message = lambda client, userdata, msg: self.messages.put(msg)
+        self.client.on_subscribe = lambda client, userdata, mid, reason_codes, properties: self.subscribed.set()
+        properties = Properties(PacketTypes.CONNECT)
+        if receive_maximum is not None:
+            properties.ReceiveMaximum = receive_maximum
+        self.client.connect('127.0.0.1', port, 60, clean_start=True, properties=properties)
+        self.client.loop_start()
+        self.client.subscribe(topic, qos=host.QOS)
+        if not self.subscribed.wait(RECEIVE_TIMEOUT):
+            raise TimeoutError(f"{client_id} not subscribed")
+
+    def get(self):
+        return self.messages.get(timeout=RECEIVE_TIMEOUT)
+
+    def stop(self):
+        self.client.loop_stop()
+        self.client.disconnect()
+
+
+class Mqtt5ProfileTest(unittest.TestCase):
+    def setUp(self):
+        self.broker = Broker()
+        host.select_device(BRIDGE_ID)
+        host.session['mqtt5'] = True
+        host.session['sequence'] = 0
+        self.receive_maximum = bridge_receive_maximum(TARGETS)
+        # Frames are only acknowledged once the bridge has taken them, like the frame pool does
+        self.bridge = Client(self.broker.port, 'bridge', host.TOPIC_SEND,
+                             receive_maximum=self.receive_maximum, manual_ack=True)
+        self.host = Client(self.broker.port, 'host', host.TOPIC_RECEIVE)
+
+    def tearDown(self):
+        self.host.stop()
+        self.bridge.stop()
+        self.broker.stop()
+
+    def send_frame(self, payload):
+        self.host.client.publish(host.TOPIC_SEND, payload, qos=host.QOS,
+                                 properties=host.frame_properties(host.TOPIC_SEND))
+
+    def test_correlation_comes_back_on_the_answer(self):
+        self.send_frame(bytes([0x04]))
+        self.send_frame(bytes([0x04]))
+        for sequence in (1, 2):
+            frame = self.bridge.get()
+            self.bridge.client.ack(frame.mid, frame.qos)
+            answer = Properties(PacketTypes.PUBLISH)
+            answer.CorrelationData = frame.properties.CorrelationData
+            self.bridge.client.publish(host.TOPIC_RECEIVE, bytes([0xFF]), qos=host.QOS, properties=answer)
+            self.assertEqual(f" (answer to frame {sequence})", host.reply_to(self.host.get()))
+
+    def test_frames_beyond_receive_maximum_are_held(self):
+        self.assertGreater(self.receive_maximum, 0)
+        for _ in range(self.receive_maximum + 3):
+            self.send_frame(bytes([0x04]))
+        frames = [self.bridge.get() for _ in range(self.receive_maximum)]
+        time.sleep(SETTLE_TIME)
+        self.assertTrue(self.bridge.messages.empty())
+        # Every frame the bridge is done with lets one more through
+        self.bridge.client.ack(frames[0].mid, frames[0].qos)
+        frames.append(self.bridge.get())
+        time.sleep(SETTLE_TIME)
+        self.assertTrue(self.bridge.messages.empty())
+        sequences = [int.from_bytes(frame.properties.CorrelationData, 'big') for frame in frames]
+        self.assertEqual(list(range(1, self.receive_maximum + 2)), sequences)
+
+
+if __name__ == '__main__':
+    if not (MOSQUITTO and mqtt):
+        print("skipped, needs mosquitto and paho-mqtt")
+        sys.exit(SKIP_CODE)
+    unittest.main()
@@ -0,0 +1,231 @@
+/*
+ * test_image_cache.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The image cache on a RAM partition, flashing the mock bootloader.
+ */
+#include <string.h>
+
+#include "host_test.h"
+#include "mock_bootloader.h"
+#include "Image_Cache.h"
+
+#define PARTITION_SIZE          (64 * 1024)
+#define IMAGE_SIZE              5000
+#define DOWNLOAD_CHUNK          200
+
+typedef struct
+{
+	uint8_t data[PARTITION_SIZE];
+	uint32_t erased;
+} ram_partition_t;
+
+typedef struct
+{
+	cache_stage_t stage;
+	esp_err_t result;
+	uint32_t reports;
+} progress_t;
+
+static ram_partition_t partition;
+static mock_bootloader_t device;
+static uint8_t image[IMAGE_SIZE];
+static progress_t progress;
+
+static esp_err_t ram_erase(void *ctx, uint32_t offset, uint32_t len)
+{
+	ram_partition_t *ram = (ram_partition_t *)ctx;
+	if ((0 != (offset % CACHE_ERASE_SIZE)) || ((offset + len) > PARTITION_SIZE))
+	{
+		return ESP_ERR_INVALID_ARG;
+	}
+	memset(&ram->data[offset], 0xFF, len);
+	ram->erased += len;
+	return ESP_OK;
+}
+
+static esp_err_t ram_write(void *ctx, uint32_t offset, const void *data, uint32_t len)
+{
+	ram_partition_t *ram = (ram_partition_t *)ctx;
+	if ((offset + len) > PARTITION_SIZE)
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+	for (uint32_t i = 0; i < len; i++)
+	{
+		ram->data[offset + i] &= ((const uint8_t *)data)[i];
+	}
+	return ESP_OK;
+}
+
+static esp_err_t ram_read(void *ctx, uint32_t offset, void *data, uint32_t len)
+{
+	ram_partition_t *ram = (ram_partition_t *)ctx;
+	if ((offset + len) > PARTITION_SIZE)
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+	memcpy(data, &ram->data[offset], len);
+	return ESP_OK;
+}
+
+static void on_progress(void *ctx, cache_stage_t stage, esp_err_t result, uint32_t done, uint32_t total)
+{
+	progress.stage = stage;
+	progress.result = result;
+	progress.reports++;
+}
+
+static const cache_storage_t storage = {
+	.erase = ram_erase,
+	.write = ram_write,
+	.read = ram_read,
+	.size = PARTITION_SIZE,
+	.ctx = &partition,
+};
+
+static const cache_link_t link = {
+	.transfer = mock_bootloader_transfer,
+	.ctx = &device,
+};
+
+static image_cache_t cache = {
+	.storage = &storage,
+	.link = &link,
+	.progress = on_progress,
+};
+
+static image_cache_header_t setup(void)
+{
+	image_cache_header_t header;
+	memset(&partition, 0x00, sizeof(partition));
+	memset(&progress, 0x00, sizeof(progress));
+	mock_bootloader_init(&device);
+	for (uint32_t i = 0; i < IMAGE_SIZE; i++)
+	{
+		//Zeros in it too, they are data like any other byte
+		image[i] = (uint8_t)((i % 7) ? (i * 31) : 0);
+	}
+	header = (image_cache_header_t){
+		.size = IMAGE_SIZE,
+		.digest = mock_frame_crc(image, IMAGE_SIZE),
+		.major = 1,
+		.minor = 2,
+		.patch = 3,
+		.address = MOCK_APP_START,
+		.build_id = 0x1234,
+		.first_sector = 4,
+		.sector_count = 2,
+		.flags = CACHE_FLAG_VERIFY | CACHE_FLAG_JUMP,
+	};
+	return header;
+}
+
+static esp_err_t download(image_cache_header_t *header)
+{
+	esp_err_t ret = image_cache_begin(&cache, header);
+	for (uint32_t offset = 0; (offset < IMAGE_SIZE) && (ESP_OK == ret); offset += DOWNLOAD_CHUNK)
+	{
+		uint16_t len = ((IMAGE_SIZE - offset) > DOWNLOAD_CHUNK) ? DOWNLOAD_CHUNK : (IMAGE_SIZE - offset);
+		ret = image_cache_write(&cache, offset, &image[offset], len);
+	}
+	return ret;
+}
+
+static void test_update_end_to_end(void)
+{
+	image_cache_header_t header = setup();
+	CHECK(ESP_OK == download(&header));
+	CHECK(IMAGE_SIZE == cache.received);
+	//Only the blocks the image needs
+	CHECK(CACHE_ERASE_SIZE * 2 == partition.erased);
+	CHECK(ESP_OK == image_cache_verify(&cache));
+	CHECK(ESP_OK == image_cache_flash(&cache));
+	CHECK(0 == memcmp(device.flash, image, IMAGE_SIZE));
+	CHECK(1 == device.erases);
+	CHECK(device.jumped);
+	CHECK(0 == device.nacks);
+	CHECK((CACHE_STAGE_DONE == progress.stage) && (ESP_OK == progress.result));
+}
+
+static void test_digest_mismatch(void)
+{
+	image_cache_header_t header = setup();
+	header.digest ^= 1;
+	CHECK(ESP_OK == download(&header));
+	CHECK(ESP_ERR_INVALID_CRC == image_cache_verify(&cache));
+	CHECK(0 == device.exchanges);
+}
+
+static void test_image_too_large(void)
+{
+	image_cache_header_t header = setup();
+	header.size = PARTITION_SIZE + 1;
+	CHECK(ESP_ERR_INVALID_SIZE == image_cache_begin(&cache, &header));
+	CHECK(0 == partition.erased);
+}
+
+static void test_write_past_image(void)
+{
+	image_cache_header_t header = setup();
+	CHECK(ESP_OK == image_cache_begin(&cache, &header));
+	CHECK(ESP_ERR_INVALID_SIZE == image_cache_write(&cache, IMAGE_SIZE - 10, image, 20));
+}
+
+static void test_nacked_frame_is_sent_again(void)
+{
+	image_cache_header_t header = setup();
+	CHECK(ESP_OK == download(&header));
+	device.nack_frames = 2;
+	CHECK(ESP_OK == image_cache_flash(&cache));
+	CHECK(2 == device.nacks);
+	CHECK(0 == memcmp(device.flash, image, IMAGE_SIZE));
+}
+
+static void test_nacked_until_given_up(void)
+{
+	image_cache_header_t header = setup();
+	CHECK(ESP_OK == download(&header));
+	device.nack_frames = 3;
+	CHECK(ESP_ERR_INVALID_CRC == image_cache_flash(&cache));
+	CHECK(!device.jumped);
+	CHECK((CACHE_STAGE_DONE == progress.stage) && (ESP_OK != progress.result));
+}
+
+static void test_link_goes_quiet(void)
+{
+	image_cache_header_t header = setup();
+	CHECK(ESP_OK == download(&header));
+	//Past the erase and the header, inside the chunks
+	device.silent_after = 10;
+	CHECK(ESP_ERR_TIMEOUT == image_cache_flash(&cache));
+	//Nothing else is sent once the link timed out
+	CHECK(10 == device.exchanges);
+	CHECK(!device.jumped);
+	CHECK((CACHE_STAGE_DONE == progress.stage) && (ESP_ERR_TIMEOUT == progress.result));
+}
+
+static void test_flash_check_fails(void)
+{
+	image_cache_header_t header = setup();
+	CHECK(ESP_OK == download(&header));
+	//The device ends up with something else than the cache
+	partition.data[100] ^= 0xFF;
+	CHECK(ESP_ERR_INVALID_CRC == image_cache_flash(&cache));
+	CHECK(!device.jumped);
+}
+
+int main(void)
+{
+	RUN(test_update_end_to_end);
+	RUN(test_digest_mismatch);
+	RUN(test_image_too_large);
+	RUN(test_write_past_image);
+	RUN(test_nacked_frame_is_sent_again);
+	RUN(test_nacked_until_given_up);
+	RUN(test_link_goes_quiet);
+	RUN(test_flash_check_fails);
+	return HOST_TEST_RESULT();
+}
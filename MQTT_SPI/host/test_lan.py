@@ -0,0 +1,133 @@
+"""
+test_lan.py
+
+ Created on: Oct 19, 2026
+     Author: ahmed
+
+ The LAN client of Bootloader_host.py against a local socket server that
+ speaks the bridge's framing, [channel][target][len BE16] then the payload.
+"""
+import os
+import queue
+import socket
+import struct
+import sys
+import threading
+import types
+import unittest
+
+# Importing the host script must not leave bytecode next to it in the tree
+sys.dont_write_bytecode = True
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', '..'))
+
+try:
+    import paho.mqtt.client  # noqa: F401
+except ImportError:
+    # The LAN transport never touches the broker, a bare module is enough to import the script
+    for name in ('paho', 'paho.mqtt', 'paho.mqtt.client', 'paho.mqtt.properties', 'paho.mqtt.packettypes'):
+        sys.modules[name] = types.ModuleType(name)
+    sys.modules['paho.mqtt.properties'].Properties = object
+    sys.modules['paho.mqtt.packettypes'].PacketTypes = object
+
+import Bootloader_host as host  # noqa: E402
+
+RECEIVE_TIMEOUT = 2.0
+TARGET = 1
+
+
+class FakeBridge:
+    """One connection at a time, what the bridge's LAN task accepts"""
+    def __init__(self):
+        self.server = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.server.bind(('127.0.0.1', 0))
+        self.server.listen(1)
+        self.address = f"127.0.0.1:{self.server.getsockname()[1]}"
+        self.received = queue.Queue()
+        self.conn = None
+        self.accepted = threading.Event()
+        threading.Thread(target=self._serve, daemon=True).start()
+
+    def _read_exact(self, length):
+        data = b''
+        while len(data) < length:
+            chunk = self.conn.recv(length - len(data))
+            if not chunk:
+                raise ConnectionError
+            data += chunk
+        return data
+
+    def _serve(self):
+        self.conn, _ = self.server.accept()
+        self.accepted.set()
+        try:
+            while True:
+                header = self._read_exact(struct.calcsize(host.LAN_HEADER_FORMAT))
+                channel, target, length = struct.unpack(host.LAN_HEADER_FORMAT, header)
+                self.received.put((channel, target, self._read_exact(length)))
+        except OSError:
+            pass
+
+    def send(self, channel, target, payload):
+        self.conn.sendall(struct.pack(host.LAN_HEADER_FORMAT, channel, target, len(payload)) + payload)
+
+    def close(self):
+        if self.conn:
+            self.conn.close()
+        self.server.close()
+
+
+class LanClientTest(unittest.TestCase):
+    def setUp(self):
+        self.bridge = FakeBridge()
+        self.messages = queue.Queue()
+        self.client = host.connect_lan(self.bridge.address, TARGET)
+        self.assertIsNotNone(self.client)
+        self.client.on_message = lambda client, userdata, msg: self.messages.put((msg.topic, msg.payload))
+        self.client.loop_start()
+        self.assertTrue(self.bridge.accepted.wait(RECEIVE_TIMEOUT))
+
+    def tearDown(self):
+        self.client.disconnect()
+        self.bridge.close()
+
+    def test_frame_and_control_channels(self):
+        frame = bytes([0x05, 0x0A, 0x00, 0x00, 0x12, 0x34])
+        self.client.publish(host.TOPIC_SEND, frame)
+        self.client.publish(host.TOPIC_CONTROL, bytes([0x01]))
+        self.assertEqual((host.LAN_CHANNEL_DEVICE, TARGET, frame), self.bridge.received.get(timeout=RECEIVE_TIMEOUT))
+        self.assertEqual((host.LAN_CHANNEL_CONTROL, TARGET, bytes([0x01])),
+                         self.bridge.received.get(timeout=RECEIVE_TIMEOUT))
+
+    def test_answers_reach_their_topics(self):
+        self.bridge.send(host.LAN_CHANNEL_DEVICE, TARGET, bytes([0xFF]))
+        self.bridge.send(host.LAN_CHANNEL_CONTROL, TARGET, bytes([0x02, 0x00]))
+        self.assertEqual((host.TOPIC_RECEIVE, bytes([0xFF])), self.messages.get(timeout=RECEIVE_TIMEOUT))
+        self.assertEqual((host.TOPIC_STATUS, bytes([0x02, 0x00])), self.messages.get(timeout=RECEIVE_TIMEOUT))
+
+    def test_other_targets_are_dropped(self):
+        # Telemetry covers the whole bridge, it gets through whatever its target
+        self.bridge.send(host.LAN_CHANNEL_DEVICE, TARGET + 1, bytes([0x01]))
+        self.bridge.send(host.LAN_CHANNEL_TELEMETRY, TARGET + 1, bytes([0x07]))
+        self.assertEqual((host.TOPIC_TELEMETRY, bytes([0x07])), self.messages.get(timeout=RECEIVE_TIMEOUT))
+        self.assertTrue(self.messages.empty())
+
+    def test_payload_split_across_segments(self):
+        # Zeros and a length past one byte, the header and payload come in pieces
+        payload = bytes(i % 3 for i in range(300))
+        message = struct.pack(host.LAN_HEADER_FORMAT, host.LAN_CHANNEL_DEVICE, TARGET, len(payload)) + payload
+        for start in range(0, len(message), 7):
+            self.bridge.conn.sendall(message[start:start + 7])
+        self.assertEqual((host.TOPIC_RECEIVE, payload), self.messages.get(timeout=RECEIVE_TIMEOUT))
+
+
+class LanFallbackTest(unittest.TestCase):
+    def test_no_bridge_falls_back_to_the_broker(self):
+        unused = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        unused.bind(('127.0.0.1', 0))
+        port = unused.getsockname()[1]
+        unused.close()
+        self.assertIsNone(host.connect_lan(f"127.0.0.1:{port}", TARGET))
+
+
+if __name__ == '__main__':
+    unittest.main()
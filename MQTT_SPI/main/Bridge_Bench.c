@@ -0,0 +1,84 @@
+/*
+ * Bridge_Bench.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <inttypes.h>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "Bridge_Bench.h"
+#include "Bridge_Tasks.h"
+#include "Frame_Pool.h"
+#include "MQTT_Task.h"
+
+#if CONFIG_BRIDGE_BENCHMARK
+
+#define BENCH_TARGET            0
+#define BENCH_IN_FLIGHT         4
+#define BENCH_REPORT_MS         5000
+
+#if CONFIG_BRIDGE_BENCHMARK_LOOPBACK
+#define BENCH_PATH              "loopback"
+#elif CONFIG_BRIDGE_SPI_MASTER
+#define BENCH_PATH              "SPI master"
+#else
+#define BENCH_PATH              "SPI slave, STM32 paced"
+#endif
+
+static const char *TAG = "BENCH";
+static SemaphoreHandle_t bench_credits = NULL;
+static uint32_t bench_done = 0;
+static portMUX_TYPE bench_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+void Bench_Task(void *par)
+{
+	//All zeros, the bootloader takes it as no command and keeps waiting for one
+	static const uint8_t idle_frame[1] = {0x00};
+	int64_t start = esp_timer_get_time();
+	int64_t now = 0;
+	uint32_t done = 0;
+	uint32_t reported = 0;
+
+	//A few frames ahead, so the pipeline never waits for this task
+	bench_credits = xSemaphoreCreateCounting(BENCH_IN_FLIGHT, BENCH_IN_FLIGHT);
+	ESP_LOGI(TAG, "Feeding target %d over %s, %s tasks", BENCH_TARGET, BENCH_PATH, BRIDGE_TASK_LAYOUT);
+	while (1)
+	{
+		if (xSemaphoreTake(bench_credits, BENCH_REPORT_MS / portTICK_PERIOD_MS) &&
+			!bridge_frame_submit(BENCH_TARGET, idle_frame, sizeof(idle_frame), FRAME_SOURCE_BENCH))
+		{
+			xSemaphoreGive(bench_credits);
+		}
+		now = esp_timer_get_time();
+		if ((now - start) >= (BENCH_REPORT_MS * 1000))
+		{
+			portENTER_CRITICAL(&bench_lock);
+			done = bench_done;
+			portEXIT_CRITICAL(&bench_lock);
+			ESP_LOGI(TAG, "%s, %s: %" PRIu32 " frames/s, %u frames free, heap low-water %" PRIu32 " bytes",
+					 BENCH_PATH, BRIDGE_TASK_LAYOUT, (uint32_t)(((uint64_t)(done - reported) * 1000000) / (now - start)),
+					 frame_pool_available(), esp_get_minimum_free_heap_size());
+			reported = done;
+			start = now;
+		}
+	}
+}
+
+//Called by the publisher for every answer to a benchmark frame
+void bench_frame_done(void)
+{
+	portENTER_CRITICAL(&bench_lock);
+	bench_done++;
+	portEXIT_CRITICAL(&bench_lock);
+	xSemaphoreGive(bench_credits);
+}
+
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Bridge_Bench.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Stress benchmark of the frame pipeline. Idle frames are fed to the first
+ *  target as fast as the pipeline takes them, their answers are counted at
+ *  the publisher and dropped, and the sustained rate is logged. Built with
+ *  and without BRIDGE_PINNED_TASKS it compares the two task layouts. With
+ *  BRIDGE_BENCHMARK_LOOPBACK the SPI tasks answer in place of the STM32,
+ *  whose polling would otherwise set the rate.
+ */
+
+#ifndef MAIN_BRIDGE_BENCH_H_
+#define MAIN_BRIDGE_BENCH_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_BRIDGE_BENCHMARK
+void Bench_Task(void *par);
+void bench_frame_done(void);
+#else
+#define bench_frame_done()      do { } while (0)
+#endif
+
+#endif /* MAIN_BRIDGE_BENCH_H_ */
@@ -0,0 +1,53 @@
+/*
+ * Bridge_Check.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include "Bridge_Check.h"
+#include "Frame_Pool.h"
+#include "esp_rom_crc.h"
+
+#define CHECK_BLOCK         16          //Bytes padded per ROM call
+#define CRC_LENGTH          4
+
+
+//CRC-32/MPEG-2 over every byte padded to a big-endian word, as the host and the STM32 CRC unit do.
+//The ROM routine is the same polynomial with the register inverted on the way in and out.
+uint32_t bridge_frame_crc(const uint8_t *data, uint16_t len)
+{
+	uint8_t padded[CHECK_BLOCK * 4] = {0};
+	uint32_t crc = 0xFFFFFFFFUL;
+	uint16_t block = 0;
+	for (uint16_t index = 0; index < len; index += block)
+	{
+		block = ((len - index) > CHECK_BLOCK) ? CHECK_BLOCK : (len - index);
+		for (uint16_t i = 0; i < block; i++)
+		{
+			padded[(i * 4) + 3] = data[index + i];
+		}
+		crc = ~esp_rom_crc32_be(~crc, padded, block * 4);
+	}
+	return crc;
+}
+
+//Commands and chunks both end with the CRC of everything before it, signals carry none
+bridge_reject_t bridge_check_frame(const uint8_t *data, uint16_t len)
+{
+	uint32_t frame_crc = 0;
+	if (1 == len)
+	{
+		return BRIDGE_FRAME_OK;
+	}
+	if ((len <= CRC_LENGTH) || (len > FRAME_SIZE))
+	{
+		return BRIDGE_REJECT_LENGTH;
+	}
+	frame_crc = ((uint32_t)data[len - 4] << 24) | ((uint32_t)data[len - 3] << 16) |
+				((uint32_t)data[len - 2] << 8) | (uint32_t)data[len - 1];
+	if (frame_crc != bridge_frame_crc(data, len - CRC_LENGTH))
+	{
+		return BRIDGE_REJECT_CRC;
+	}
+	return BRIDGE_FRAME_OK;
+}
@@ -0,0 +1,18 @@
+/*
+ * Bridge_Check.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+
+#ifndef MAIN_BRIDGE_CHECK_H_
+#define MAIN_BRIDGE_CHECK_H_
+
+#include <stdint.h>
+
+#include "Bridge_Protocol.h"
+
+uint32_t bridge_frame_crc(const uint8_t *data, uint16_t len);
+bridge_reject_t bridge_check_frame(const uint8_t *data, uint16_t len);
+
+#endif /* MAIN_BRIDGE_CHECK_H_ */
@@ -0,0 +1,221 @@
+/*
+ * Bridge_Core.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+
+#include "Bridge_Core.h"
+#include "Bridge_Check.h"
+
+
+void bridge_core_downlink_init(core_downlink_t *downlink)
+{
+	downlink->rejected = BRIDGE_FRAME_OK;
+}
+
+//A corrupted frame stops here, the device would only NACK it after a whole SPI round
+core_down_t bridge_core_downlink(core_downlink_t *downlink, const uint8_t *data, uint16_t len,
+								 uint32_t features, bridge_reject_t *reason)
+{
+	*reason = bridge_check_frame(data, len);
+	if (BRIDGE_FRAME_OK != *reason)
+	{
+		if (features & BRIDGE_FEATURE_ACK_PROXY)
+		{
+			return CORE_DOWN_REJECT;
+		}
+		downlink->rejected = *reason;
+		return CORE_DOWN_HOLD;
+	}
+	if (BRIDGE_FRAME_OK != downlink->rejected)
+	{
+		*reason = downlink->rejected;
+		downlink->rejected = BRIDGE_FRAME_OK;
+		if ((1 == len) && (BL_WAIT_FOR_ACK_SIGNAL == data[0]))
+		{
+			return CORE_DOWN_HELD;
+		}
+	}
+	//Commands and chunks are answered by Send_ACK()/Send_NACK(), the bridge polls it.
+	//The frame's own answer is not worth publishing, only the poll result is.
+	if ((features & BRIDGE_FEATURE_ACK_PROXY) && (len > 1))
+	{
+		return CORE_DOWN_PROXY;
+	}
+	return CORE_DOWN_FORWARD;
+}
+
+//The NACK the device would have sent, the reason only goes to hosts that asked for it
+uint16_t bridge_core_nack(uint8_t *answer, uint16_t size, bridge_reject_t reason, uint32_t features)
+{
+	memset(answer, 0x00, size);
+	answer[0] = BL_NACK_SIGNAL;
+	if (features & BRIDGE_FEATURE_EDGE_CRC)
+	{
+		answer[1] = BRIDGE_NACK_MARKER;
+		answer[2] = reason;
+		return 3;
+	}
+	return 1;
+}
+
+//Turn the frame into the poll for its ACK
+uint16_t bridge_core_poll(uint8_t *frame, uint16_t size)
+{
+	memset(frame, 0x00, size);
+	frame[0] = BL_WAIT_FOR_ACK_SIGNAL;
+	return 1;
+}
+
+
+void bridge_core_uplink_init(core_uplink_t *uplink)
+{
+	uplink->probe_armed = false;
+	uplink->ready = true;
+}
+
+//The probe is only timed while the device is thought to be ready
+bool bridge_core_uplink_watching(const core_uplink_t *uplink)
+{
+	return uplink->probe_armed && uplink->ready;
+}
+
+//The device did not come back for the probe, it is inside a long operation
+uint8_t bridge_core_uplink_timeout(core_uplink_t *uplink)
+{
+	if (bridge_core_uplink_watching(uplink))
+	{
+		uplink->ready = false;
+		return CORE_UP_FLOW;
+	}
+	return 0;
+}
+
+uint8_t bridge_core_uplink_probe(core_uplink_t *uplink, const uint8_t *answer)
+{
+	uplink->probe_armed = false;
+	if ((BL_ACK_SIGNAL == answer[0]) || (BL_NACK_SIGNAL == answer[0]))
+	{
+		//Still repeating its answer to a poll, ask again on its next transaction
+		return CORE_UP_ARM_PROBE;
+	}
+	if (!uplink->ready)
+	{
+		//Marked by bootloaders that know the ready mark, a clocked probe is enough for the others
+		uplink->ready = true;
+		return CORE_UP_FLOW;
+	}
+	return 0;
+}
+
+uint8_t bridge_core_uplink_answer(core_uplink_t *uplink, const uint8_t *frame, uint16_t len,
+								  uint8_t *answer, uint32_t features)
+{
+	//The ready mark is for the bridge only, a reply requested with REPEATED is never marked
+	if ((BL_READY_SIGNAL == answer[0]) && (BL_REPEATED_SIGNAL != frame[0]))
+	{
+		answer[0] = 0x00;
+	}
+	//An ACK means the device starts executing, watch when it is back
+	if ((features & BRIDGE_FEATURE_FLOW_CONTROL) && !uplink->probe_armed &&
+		(1 == len) && (BL_WAIT_FOR_ACK_SIGNAL == frame[0]) && (BL_ACK_SIGNAL == answer[0]))
+	{
+		return CORE_UP_ARM_PROBE;
+	}
+	return 0;
+}
+
+void bridge_core_probe_armed(core_uplink_t *uplink, bool armed)
+{
+	uplink->probe_armed = armed;
+}
+
+//The master clocks a whole frame, only the device's answer goes to the host, zeros included
+uint16_t bridge_core_answer_len(const uint8_t *frame, uint16_t len, const uint8_t *answer, uint16_t answer_len)
+{
+	uint16_t framed = (uint16_t)answer[0] + 1;
+	if ((1 == len) && (BL_REPEATED_SIGNAL == frame[0]))
+	{
+		//A pushed reply carries its own length and CRC, only the version does not
+		if ((1 < framed) && (framed <= answer_len) && (BRIDGE_FRAME_OK == bridge_check_frame(answer, framed)))
+		{
+			return framed;
+		}
+		return (answer_len < BL_VERSION_LENGTH) ? answer_len : BL_VERSION_LENGTH;
+	}
+	//Polls, commands and chunks are answered with a signal in the first byte
+	return (answer_len < 1) ? answer_len : 1;
+}
+
+
+void bridge_core_aggregate_begin(core_aggregate_t *aggregate, const uint8_t *data, uint16_t len,
+								 uint16_t frame_max)
+{
+	aggregate->data = data;
+	aggregate->len = len;
+	aggregate->frame_max = frame_max;
+	aggregate->index = BRIDGE_AGGREGATE_HEADER;
+	aggregate->count = data[3];
+	aggregate->sent = 0;
+	aggregate->result = AGGREGATE_OK;
+}
+
+//The next frame to clock, false once all are sent or one of them failed
+bool bridge_core_aggregate_next(core_aggregate_t *aggregate, const uint8_t **frame, uint16_t *len)
+{
+	const uint8_t *data = aggregate->data;
+	uint16_t index = aggregate->index;
+	uint16_t frame_len = 0;
+	if ((aggregate->sent >= aggregate->count) || (AGGREGATE_OK != aggregate->result))
+	{
+		return false;
+	}
+	frame_len = (index + 2 <= aggregate->len) ? (((uint16_t)data[index] << 8) | data[index + 1]) : 0;
+	index += 2;
+	if ((0 == frame_len) || (frame_len > aggregate->frame_max) || ((index + frame_len) > aggregate->len))
+	{
+		bridge_core_aggregate_result(aggregate, AGGREGATE_MALFORMED);
+		return false;
+	}
+	aggregate->index = index + frame_len;
+	if (BRIDGE_FRAME_OK != bridge_check_frame(&data[index], frame_len))
+	{
+		bridge_core_aggregate_result(aggregate, AGGREGATE_BAD_CRC);
+		return false;
+	}
+	*frame = &data[index];
+	*len = frame_len;
+	return true;
+}
+
+void bridge_core_aggregate_result(core_aggregate_t *aggregate, uint8_t result)
+{
+	aggregate->result = result;
+	aggregate->status[BRIDGE_AGGREGATE_STATUS_HEADER + aggregate->sent++] = result;
+}
+
+//AGGREGATE_STATUS for the host, its length
+uint16_t bridge_core_aggregate_status(core_aggregate_t *aggregate)
+{
+	aggregate->status[0] = BRIDGE_MSG_AGGREGATE_STATUS;
+	aggregate->status[1] = aggregate->data[1];
+	aggregate->status[2] = aggregate->data[2];
+	aggregate->status[3] = aggregate->count;
+	aggregate->status[4] = (AGGREGATE_OK == aggregate->result) ? aggregate->sent : (aggregate->sent - 1);
+	return BRIDGE_AGGREGATE_STATUS_HEADER + aggregate->sent;
+}
+
+uint8_t bridge_core_poll_result(const uint8_t *answer)
+{
+	if (BL_ACK_SIGNAL == answer[0])
+	{
+		return AGGREGATE_OK;
+	}
+	if (BL_NACK_SIGNAL == answer[0])
+	{
+		return AGGREGATE_NACK;
+	}
+	return AGGREGATE_NO_ANSWER;
+}
@@ -0,0 +1,80 @@
+/*
+ * Bridge_Core.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  What the bridge decides about each frame, without any ESP-IDF call. The
+ *  tasks own the queues, the pool and the transports: they hand the core
+ *  the bytes of a frame and its answer, and carry out what it returns.
+ *  Plain C on plain buffers, like the image cache, so it builds for a host
+ *  as well as for the ESP32.
+ */
+
+#ifndef MAIN_BRIDGE_CORE_H_
+#define MAIN_BRIDGE_CORE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "Bridge_Protocol.h"
+
+typedef enum
+{
+	CORE_DOWN_FORWARD = 0,      //Clock the frame as it is
+	CORE_DOWN_PROXY,            //Clock the frame, then its ACK poll in its place
+	CORE_DOWN_REJECT,           //Failed the check, answer with a NACK from the bridge now
+	CORE_DOWN_HOLD,             //Failed the check, the NACK waits for the host's poll
+	CORE_DOWN_HELD,             //The poll for a held rejection, answer it with the NACK
+} core_down_t;
+
+/* Returned by the uplink, what the task has to do next */
+#define CORE_UP_FLOW            (1 << 0)    //Tell the host the device is ready or busy
+#define CORE_UP_ARM_PROBE       (1 << 1)    //Arm the empty frame that watches the device
+
+typedef struct
+{
+	bridge_reject_t rejected;   //Answered on the host's next poll
+} core_downlink_t;
+
+typedef struct
+{
+	bool probe_armed;
+	bool ready;
+} core_uplink_t;
+
+typedef struct
+{
+	const uint8_t *data;
+	uint16_t len;
+	uint16_t frame_max;         //Longest frame the caller can clock
+	uint16_t index;
+	uint8_t count;
+	uint8_t sent;
+	uint8_t result;
+	uint8_t status[BRIDGE_AGGREGATE_STATUS_HEADER + UINT8_MAX];
+} core_aggregate_t;
+
+void bridge_core_downlink_init(core_downlink_t *downlink);
+core_down_t bridge_core_downlink(core_downlink_t *downlink, const uint8_t *data, uint16_t len,
+								 uint32_t features, bridge_reject_t *reason);
+uint16_t bridge_core_nack(uint8_t *answer, uint16_t size, bridge_reject_t reason, uint32_t features);
+uint16_t bridge_core_poll(uint8_t *frame, uint16_t size);
+
+void bridge_core_uplink_init(core_uplink_t *uplink);
+bool bridge_core_uplink_watching(const core_uplink_t *uplink);
+uint8_t bridge_core_uplink_timeout(core_uplink_t *uplink);
+uint8_t bridge_core_uplink_probe(core_uplink_t *uplink, const uint8_t *answer);
+uint8_t bridge_core_uplink_answer(core_uplink_t *uplink, const uint8_t *frame, uint16_t len,
+								  uint8_t *answer, uint32_t features);
+void bridge_core_probe_armed(core_uplink_t *uplink, bool armed);
+uint16_t bridge_core_answer_len(const uint8_t *frame, uint16_t len, const uint8_t *answer, uint16_t answer_len);
+
+void bridge_core_aggregate_begin(core_aggregate_t *aggregate, const uint8_t *data, uint16_t len,
+								 uint16_t frame_max);
+bool bridge_core_aggregate_next(core_aggregate_t *aggregate, const uint8_t **frame, uint16_t *len);
+void bridge_core_aggregate_result(core_aggregate_t *aggregate, uint8_t result);
+uint16_t bridge_core_aggregate_status(core_aggregate_t *aggregate);
+uint8_t bridge_core_poll_result(const uint8_t *answer);
+
+#endif /* MAIN_BRIDGE_CORE_H_ */
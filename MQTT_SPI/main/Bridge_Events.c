@@ -0,0 +1,35 @@
+/*
+ * Bridge_Events.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include "Bridge_Events.h"
+
+static EventGroupHandle_t bridge_events = NULL;
+
+
+//Called by app_main before any task exists
+void bridge_events_init(void)
+{
+	if (NULL == bridge_events)
+	{
+		bridge_events = xEventGroupCreate();
+	}
+}
+
+void bridge_events_set(EventBits_t bits)
+{
+	xEventGroupSetBits(bridge_events, bits);
+}
+
+void bridge_events_clear(EventBits_t bits)
+{
+	xEventGroupClearBits(bridge_events, bits);
+}
+
+//True once every bit is set, the bits are left set for the others
+bool bridge_events_wait(EventBits_t bits, TickType_t wait)
+{
+	return (xEventGroupWaitBits(bridge_events, bits, pdFALSE, pdTRUE, wait) & bits) == bits;
+}
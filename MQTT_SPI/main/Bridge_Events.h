@@ -0,0 +1,40 @@
+/*
+ * Bridge_Events.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Startup and link state of the bridge. Each task sets its bit once its
+ *  side is up, app_main waits for all of them instead of sleeping.
+ */
+
+#ifndef MAIN_BRIDGE_EVENTS_H_
+#define MAIN_BRIDGE_EVENTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/event_groups.h"
+
+#define BRIDGE_EVENT_WIFI_UP        (1 << 0)    //IP_EVENT_STA_GOT_IP
+#define BRIDGE_EVENT_MQTT_UP        (1 << 1)    //MQTT_EVENT_CONNECTED
+#define BRIDGE_EVENT_SPI_UP         (1 << 2)    //Slave initialized, transactions can be queued
+
+#if CONFIG_BRIDGE_LAN
+//A host on the LAN does not need the broker, the MQTT side joins when it can
+#define BRIDGE_EVENTS_READY         (BRIDGE_EVENT_WIFI_UP | \
+                                     BRIDGE_EVENT_SPI_UP)
+#else
+#define BRIDGE_EVENTS_READY         (BRIDGE_EVENT_WIFI_UP | \
+                                     BRIDGE_EVENT_MQTT_UP | \
+                                     BRIDGE_EVENT_SPI_UP)
+#endif
+
+void bridge_events_init(void);
+void bridge_events_set(EventBits_t bits);
+void bridge_events_clear(EventBits_t bits);
+bool bridge_events_wait(EventBits_t bits, TickType_t wait);
+
+#endif /* MAIN_BRIDGE_EVENTS_H_ */
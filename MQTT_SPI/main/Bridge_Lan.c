@@ -0,0 +1,200 @@
+/*
+ * Bridge_Lan.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+
+#include "lwip/sockets.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "Bridge_Lan.h"
+#include "Bridge_Protocol.h"
+#include "Bridge_Events.h"
+#include "Bridge_Trace.h"
+#include "Bridge_Telemetry.h"
+#include "Frame_Pool.h"
+#include "MQTT_Task.h"
+#include "SPI_Task.h"
+
+#if CONFIG_BRIDGE_LAN
+
+#define LAN_MAX(a, b)           (((a) > (b)) ? (a) : (b))
+//The longest answer of any task: a frame, a telemetry report, an aggregate status or a trace part
+#define LAN_SEND_MAX            LAN_MAX(LAN_MAX(FRAME_SIZE, BRIDGE_TELEMETRY_MAX), \
+										LAN_MAX(BRIDGE_AGGREGATE_STATUS_HEADER + UINT8_MAX, \
+												BRIDGE_TRACE_HEADER + (BRIDGE_TRACE_PART * TRACE_ENTRY_LENGTH)))
+#define LAN_SEND_TIMEOUT_MS     1000
+#define LAN_ACCEPT_RETRY_MS     1000
+
+static bool lan_read(int sock, uint8_t *data, uint16_t len);
+static bool lan_write(int sock, const uint8_t *data, uint16_t len);
+static void lan_serve(int sock);
+
+static const char *TAG = "LAN";
+static SemaphoreHandle_t lan_lock = NULL;
+static int lan_client = -1;
+static uint8_t lan_payload[BRIDGE_AGGREGATE_MAX];
+static uint8_t lan_out[LAN_HEADER_LENGTH + LAN_SEND_MAX];
+
+
+void Lan_Task(void *par)
+{
+	int listener = -1;
+	int sock = -1;
+	int one = 1;
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(CONFIG_BRIDGE_LAN_PORT),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	struct timeval timeout = {
+		.tv_sec = LAN_SEND_TIMEOUT_MS / 1000,
+		.tv_usec = (LAN_SEND_TIMEOUT_MS % 1000) * 1000,
+	};
+
+	lan_lock = xSemaphoreCreateMutex();
+	bridge_events_wait(BRIDGE_EVENT_WIFI_UP, portMAX_DELAY);
+	listener = socket(AF_INET, SOCK_STREAM, IPPROTO_IP);
+	if ((listener < 0) ||
+		(0 != setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))) ||
+		(0 != bind(listener, (struct sockaddr *)&addr, sizeof(addr))) ||
+		(0 != listen(listener, 1)))
+	{
+		ESP_LOGE(TAG, "No listener on port %d, errno %d", CONFIG_BRIDGE_LAN_PORT, errno);
+		vTaskDelete(NULL);
+		return;
+	}
+	ESP_LOGI(TAG, "Listening on port %d", CONFIG_BRIDGE_LAN_PORT);
+
+	while (1)
+	{
+		//One host at a time, the next one waits in the backlog
+		sock = accept(listener, NULL, NULL);
+		if (sock < 0)
+		{
+			ESP_LOGW(TAG, "Accept failed, errno %d", errno);
+			vTaskDelay(LAN_ACCEPT_RETRY_MS / portTICK_PERIOD_MS);
+			continue;
+		}
+		//Every frame is a small write, it goes out now instead of waiting for more
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		//A host that stops reading costs the sender a second, then the connection
+		setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+		ESP_LOGI(TAG, "Host connected");
+		xSemaphoreTake(lan_lock, portMAX_DELAY);
+		lan_client = sock;
+		xSemaphoreGive(lan_lock);
+
+		lan_serve(sock);
+
+		xSemaphoreTake(lan_lock, portMAX_DELAY);
+		lan_client = -1;
+		xSemaphoreGive(lan_lock);
+		close(sock);
+		ESP_LOGI(TAG, "Host disconnected");
+	}
+}
+
+bool lan_connected(void)
+{
+	return (lan_client >= 0);
+}
+
+//Called by every task that answers the host, one message at a time on the socket
+void lan_send(uint8_t channel, uint8_t target, const uint8_t *data, uint16_t len)
+{
+	if (NULL == lan_lock)
+	{
+		return;
+	}
+	if (len > LAN_SEND_MAX)
+	{
+		//Only a message added without growing LAN_SEND_MAX gets here
+		ESP_LOGW(TAG, "Message of %u bytes on channel %u too long, dropped", len, channel);
+		BRIDGE_TRACE(TRACE_DROP, 0, len, TRACE_DROP_TOO_LONG);
+		telemetry_count(TELEMETRY_DROPS, 1);
+		return;
+	}
+	xSemaphoreTake(lan_lock, portMAX_DELAY);
+	if (lan_client >= 0)
+	{
+		lan_out[0] = channel;
+		lan_out[1] = target;
+		lan_out[2] = (uint8_t)(len >> 8);
+		lan_out[3] = (uint8_t)(len);
+		memcpy(&lan_out[LAN_HEADER_LENGTH], data, len);
+		if (!lan_write(lan_client, lan_out, LAN_HEADER_LENGTH + len))
+		{
+			//The reader sees the connection end and cleans up
+			ESP_LOGW(TAG, "Host not reading, connection closed");
+			shutdown(lan_client, SHUT_RDWR);
+		}
+	}
+	xSemaphoreGive(lan_lock);
+}
+
+static void lan_serve(int sock)
+{
+	uint8_t header[LAN_HEADER_LENGTH];
+	uint16_t len = 0;
+	while (lan_read(sock, header, LAN_HEADER_LENGTH))
+	{
+		len = ((uint16_t)header[2] << 8) | header[3];
+		//Out of step with the host, it starts over with a new connection
+		if ((len > sizeof(lan_payload)) || !lan_read(sock, lan_payload, len))
+		{
+			break;
+		}
+		if (header[1] >= SPI_TARGET_COUNT)
+		{
+			ESP_LOGW(TAG, "No target %d, message dropped", header[1]);
+			continue;
+		}
+		switch (header[0])
+		{
+		case LAN_CHANNEL_DEVICE:
+			bridge_frame_submit(header[1], lan_payload, len, FRAME_SOURCE_LAN);
+			break;
+		case LAN_CHANNEL_CONTROL:
+			bridge_control(header[1], lan_payload, len);
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+static bool lan_read(int sock, uint8_t *data, uint16_t len)
+{
+	int ret = 0;
+	for (uint16_t done = 0; done < len; done += ret)
+	{
+		ret = recv(sock, data + done, len - done, 0);
+		if (ret <= 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool lan_write(int sock, const uint8_t *data, uint16_t len)
+{
+	int ret = 0;
+	for (uint16_t done = 0; done < len; done += ret)
+	{
+		ret = send(sock, data + done, len - done, 0);
+		if (ret <= 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,30 @@
+/*
+ * Bridge_Lan.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Local transport next to MQTT. A host on the same network connects over
+ *  TCP and exchanges the same payloads as on the topics, each behind a
+ *  small header (see LAN_HEADER_LENGTH), without the broker round trip.
+ *  Frames remember the transport they came on and are answered on it.
+ */
+
+#ifndef MAIN_BRIDGE_LAN_H_
+#define MAIN_BRIDGE_LAN_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdkconfig.h"
+
+#if CONFIG_BRIDGE_LAN
+void Lan_Task(void *par);
+bool lan_connected(void);
+void lan_send(uint8_t channel, uint8_t target, const uint8_t *data, uint16_t len);
+#else
+#define lan_connected()                             (false)
+#define lan_send(channel, target, data, len)        do { } while (0)
+#endif
+
+#endif /* MAIN_BRIDGE_LAN_H_ */
@@ -0,0 +1,141 @@
+/*
+ * Bridge_Protocol.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+
+#ifndef MAIN_BRIDGE_PROTOCOL_H_
+#define MAIN_BRIDGE_PROTOCOL_H_
+
+#include <stdint.h>
+
+/* Every bridge has its own topics, fota/<device id>/<topic>. The id is
+ * CONFIG_BRIDGE_DEVICE_ID, or the station MAC when that is left empty.
+ * With several STM32 behind one bridge the first keeps that id and the
+ * others are <device id>-<index>, each with topics of its own. */
+#define TOPIC_PREFIX                "fota/"
+#define TOPIC_MAX_LENGTH            64
+#define DEVICE_ID_MAX_LENGTH        32
+#define TARGET_ID_SEPARATOR         "-"
+/* Bootloader frames from the host and replies to it */
+#define TOPIC_DEVICE_RX             "bootloader-receive"
+#define TOPIC_DEVICE_TX             "bootloader-send"
+/* Messages addressed to the bridge itself and its answers */
+#define TOPIC_CONTROL               "bootloader-control"
+#define TOPIC_STATUS                "bootloader-status"
+/* Periodic report of where the time of the frames goes */
+#define TOPIC_TELEMETRY             "bootloader-telemetry"
+
+#define BRIDGE_PROTOCOL_VERSION     1
+
+/* Bridge feature bits, announced in the HELLO answer */
+#define BRIDGE_FEATURE_IMAGE_CACHE  (1UL << 0)
+#define BRIDGE_FEATURE_ACK_PROXY    (1UL << 1)
+#define BRIDGE_FEATURE_AGGREGATE    (1UL << 2)
+#define BRIDGE_FEATURE_EDGE_CRC     (1UL << 3)
+#define BRIDGE_FEATURE_FLOW_CONTROL (1UL << 4)
+
+#define BRIDGE_FEATURES             (BRIDGE_FEATURE_IMAGE_CACHE | \
+                                     BRIDGE_FEATURE_ACK_PROXY   | \
+                                     BRIDGE_FEATURE_AGGREGATE   | \
+                                     BRIDGE_FEATURE_EDGE_CRC    | \
+                                     BRIDGE_FEATURE_FLOW_CONTROL)
+
+/* Bootloader signals the bridge acts on */
+#define BL_WAIT_FOR_ACK_SIGNAL      0x04
+#define BL_REPEATED_SIGNAL          0x05
+#define BL_ACK_SIGNAL               0xFF
+#define BL_NACK_SIGNAL              0x01
+#define BL_READY_SIGNAL             0xA5    //Clocked out while the device waits for a frame
+#define BL_VERSION_LENGTH           3       //Major, minor, patch, the only reply without a frame
+
+/* First byte of every control and status message */
+typedef enum
+{
+	BRIDGE_MSG_HELLO = 0x01,
+	BRIDGE_MSG_CACHE_BEGIN,
+	BRIDGE_MSG_CACHE_DATA,
+	BRIDGE_MSG_CACHE_COMMIT,
+	BRIDGE_MSG_CACHE_STATUS,
+	BRIDGE_MSG_AGGREGATE,
+	BRIDGE_MSG_AGGREGATE_STATUS,
+	BRIDGE_MSG_FLOW,
+	BRIDGE_MSG_LOG_LEVEL,
+	BRIDGE_MSG_TRACE,
+} bridge_msg_t;
+
+/* HELLO request: id, protocol, features to enable (BE32, optional) */
+#define BRIDGE_HELLO_REQUEST_LENGTH 6
+/* HELLO answer: id, protocol, features (BE32), max message (BE16) */
+#define BRIDGE_HELLO_LENGTH         8
+
+/* CACHE_BEGIN: id, size (BE32), digest (BE32), major, minor, patch,
+ * address (BE32), build id (BE32), first sector, sector count, flags */
+#define BRIDGE_CACHE_BEGIN_LENGTH   23
+/* CACHE_DATA: id, offset (BE32), image bytes */
+#define BRIDGE_CACHE_DATA_HEADER    5
+/* CACHE_STATUS: id, stage, result, done (BE32), total (BE32) */
+#define BRIDGE_CACHE_STATUS_LENGTH  11
+
+/* AGGREGATE: id, sequence (BE16), count, then count times length (BE16) and frame.
+ * Every frame is ACK polled by the bridge, the first one failing stops the rest. */
+#define BRIDGE_AGGREGATE_MAX        4096
+#define BRIDGE_AGGREGATE_HEADER     4
+#define BRIDGE_AGGREGATE_RETRIES    3
+/* AGGREGATE_STATUS: id, sequence (BE16), count, done, one result per frame sent */
+#define BRIDGE_AGGREGATE_STATUS_HEADER  5
+
+typedef enum
+{
+	AGGREGATE_OK = 0,
+	AGGREGATE_NACK,             //Still NACKed after the retries
+	AGGREGATE_NO_ANSWER,        //The poll returned neither ACK nor NACK
+	AGGREGATE_MALFORMED,        //Length runs past the message or the frame size
+	AGGREGATE_BAD_CRC,          //Rejected by the bridge, never reached the device
+} aggregate_result_t;
+
+/* Frames failing the bridge check are answered with a NACK instead of being
+ * forwarded. Hosts that enabled EDGE_CRC get NACK, marker, reason, others a
+ * plain NACK. */
+#define BRIDGE_NACK_MARKER          0xB0
+
+typedef enum
+{
+	BRIDGE_FRAME_OK = 0,
+	BRIDGE_REJECT_CRC,
+	BRIDGE_REJECT_LENGTH,
+} bridge_reject_t;
+
+/* FLOW: id, ready, credits. After an ACK the bridge keeps an empty frame armed,
+ * the device is busy when it is not clocked within BRIDGE_FLOW_BUSY_MS and ready
+ * again once it comes back with the ready mark. Credits are the frames the
+ * bridge can take from the host right now, 0 while the device is busy. A message
+ * arriving with the pool empty is dropped and answered with 0 credits, the next
+ * FLOW with credits comes once the pool has frames again. */
+#define BRIDGE_FLOW_LENGTH          3
+#define BRIDGE_FLOW_BUSY_MS         100
+
+/* LOG_LEVEL: id, esp_log_level_t for every tag, within CONFIG_LOG_MAXIMUM_LEVEL */
+#define BRIDGE_LOG_LEVEL_LENGTH     2
+/* TRACE request: id. Answered with as many TRACE messages as needed:
+ * id, first entry (BE16), entries kept (BE16), entries of TRACE_ENTRY_LENGTH */
+#define BRIDGE_TRACE_HEADER         5
+#define BRIDGE_TRACE_PART           40
+
+/* TELEMETRY, every CONFIG_BRIDGE_TELEMETRY_PERIOD_MS on its own topic:
+ * version, period ms (BE32), frames, bytes down, bytes up, drops, rejects (BE32 each),
+ * free heap, minimum free heap (BE32), stage count, bucket count, then per stage
+ * count, sum us, max us (BE32) and the buckets (BE16), then task count and the
+ * stack high-water mark of each task in bytes (BE32) */
+#define BRIDGE_TELEMETRY_MAX        256
+
+/* LAN transport (CONFIG_BRIDGE_LAN): one TCP client at a time on
+ * CONFIG_BRIDGE_LAN_PORT. Every message is channel, target, length (BE16)
+ * and the payload the matching topic would carry. */
+#define LAN_HEADER_LENGTH           4
+#define LAN_CHANNEL_DEVICE          0   //bootloader-receive, answered on bootloader-send
+#define LAN_CHANNEL_CONTROL         1   //bootloader-control, answered on bootloader-status
+#define LAN_CHANNEL_TELEMETRY       2   //bootloader-telemetry
+
+#endif /* MAIN_BRIDGE_PROTOCOL_H_ */
@@ -0,0 +1,63 @@
+/*
+ * Bridge_Tasks.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Where every task of the bridge runs and at which priority. Wi-Fi, lwIP
+ *  and the MQTT client sit on core 0, the tasks that talk to the network
+ *  join them there. The frame pipeline has core 1 to itself, the SPI and
+ *  GPIO interrupts follow the SPI task that installs them.
+ */
+
+#ifndef MAIN_BRIDGE_TASKS_H_
+#define MAIN_BRIDGE_TASKS_H_
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+
+#if CONFIG_BRIDGE_PINNED_TASKS && !CONFIG_FREERTOS_UNICORE
+#define BRIDGE_CORE_NETWORK         0
+#define BRIDGE_CORE_PIPELINE        1
+#define BRIDGE_TASK_LAYOUT          "pinned"
+
+//The SPI task answers the DMA first, the uplink frees frames before the downlink takes new ones
+#define TASK_SPI_PRIORITY           7
+#define TASK_UPLINK_PRIORITY        6
+#define TASK_DOWNLINK_PRIORITY      5
+#define TASK_CACHE_PRIORITY         4
+//Next to the MQTT client task (CONFIG_MQTT_TASK_PRIORITY), below lwIP and Wi-Fi
+#define TASK_MQTT_PRIORITY          5
+#define TASK_LAN_PRIORITY           5
+#define TASK_TELEMETRY_PRIORITY     1
+#define TASK_BENCH_PRIORITY         1
+#else
+//Anywhere, at the priorities the bridge always had
+#define BRIDGE_CORE_NETWORK         tskNO_AFFINITY
+#define BRIDGE_CORE_PIPELINE        tskNO_AFFINITY
+#define BRIDGE_TASK_LAYOUT          "unpinned"
+
+#define TASK_SPI_PRIORITY           2
+#define TASK_UPLINK_PRIORITY        1
+#define TASK_DOWNLINK_PRIORITY      1
+#define TASK_CACHE_PRIORITY         1
+#define TASK_MQTT_PRIORITY          1
+#define TASK_LAN_PRIORITY           1
+#define TASK_TELEMETRY_PRIORITY     1
+#define TASK_BENCH_PRIORITY         1
+#endif
+
+//Bytes. The telemetry report carries the high-water mark of each, trim from there.
+//Not tuned yet, no board has reported its marks for the pinned or the unpinned layout.
+//The telemetry task logs any task left with less than TASK_STACK_MARGIN.
+#define TASK_SPI_STACK              (1024*2)
+#define TASK_UPLINK_STACK           (1024*2)
+#define TASK_DOWNLINK_STACK         (1024*2)
+#define TASK_CACHE_STACK            (1024*4)
+#define TASK_MQTT_STACK             (1024*10)   //Brings up NVS and Wi-Fi before it publishes
+#define TASK_LAN_STACK              (1024*3)
+#define TASK_TELEMETRY_STACK        (1024*3)
+#define TASK_BENCH_STACK            (1024*2)
+#define TASK_STACK_MARGIN           512
+
+#endif /* MAIN_BRIDGE_TASKS_H_ */
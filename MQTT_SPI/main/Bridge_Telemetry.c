@@ -0,0 +1,195 @@
+/*
+ * Bridge_Telemetry.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+
+#include "Bridge_Telemetry.h"
+#include "Bridge_Protocol.h"
+#include "Bridge_Tasks.h"
+#include "MQTT_Task.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_system.h"
+
+typedef struct
+{
+	uint32_t count;
+	uint32_t sum;               //us, wraps after an hour of frames in one period
+	uint32_t max;
+	uint16_t buckets[TELEMETRY_BUCKETS];
+} telemetry_histogram_t;
+
+typedef struct
+{
+	telemetry_histogram_t stages[TELEMETRY_STAGES];
+	uint32_t counters[TELEMETRY_COUNTERS];
+} telemetry_period_t;
+
+static uint16_t telemetry_encode(const telemetry_period_t *period, uint32_t elapsed, uint8_t *out);
+static void telemetry_check_stacks(void);
+static void telemetry_record(telemetry_histogram_t *histogram, uint32_t us);
+static uint16_t telemetry_put32(uint8_t *out, uint16_t index, uint32_t value);
+static uint16_t telemetry_put16(uint8_t *out, uint16_t index, uint16_t value);
+
+static const char *TAG = "TELEMETRY";
+static telemetry_period_t telemetry_current;
+static TaskHandle_t telemetry_tasks[TELEMETRY_TASKS];
+static portMUX_TYPE telemetry_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+//Publishes and restarts the period, only this task ever reads the numbers
+void Telemetry_Task(void *par)
+{
+	static telemetry_period_t period;
+	static uint8_t report[BRIDGE_TELEMETRY_MAX];
+	uint32_t start = (uint32_t)esp_timer_get_time();
+	uint32_t now = 0;
+	telemetry_watch_task(TELEMETRY_TASK_TELEMETRY, xTaskGetCurrentTaskHandle());
+	while (1)
+	{
+		vTaskDelay(CONFIG_BRIDGE_TELEMETRY_PERIOD_MS / portTICK_PERIOD_MS);
+		portENTER_CRITICAL(&telemetry_lock);
+		period = telemetry_current;
+		memset(&telemetry_current, 0x00, sizeof(telemetry_current));
+		portEXIT_CRITICAL(&telemetry_lock);
+		now = (uint32_t)esp_timer_get_time();
+		mqtt_publish_telemetry(report, telemetry_encode(&period, (now - start) / 1000, report));
+		telemetry_check_stacks();
+		start = now;
+	}
+}
+
+void telemetry_watch_task(telemetry_task_t task, TaskHandle_t handle)
+{
+	if (task < TELEMETRY_TASKS)
+	{
+		telemetry_tasks[task] = handle;
+	}
+}
+
+void telemetry_stamp(frame_t *frame, frame_time_t stage)
+{
+	frame->time[stage] = (uint32_t)esp_timer_get_time();
+}
+
+//The answer carries the stamps of its frame, it closes the record once handed to the outbox
+void telemetry_frame(const frame_t *reply, uint16_t published)
+{
+	uint32_t now = (uint32_t)esp_timer_get_time();
+	const uint32_t *time = reply->time;
+	//Answers the bridge made itself miss a stage, they are not the host's frames
+	for (uint8_t stage = 0; stage < FRAME_TIMES; stage++)
+	{
+		if (0 == time[stage])
+		{
+			return;
+		}
+	}
+	portENTER_CRITICAL(&telemetry_lock);
+	telemetry_record(&telemetry_current.stages[TELEMETRY_DOWNLINK], time[FRAME_TIME_SPI_QUEUE] - time[FRAME_TIME_MQTT_RX]);
+	telemetry_record(&telemetry_current.stages[TELEMETRY_DEVICE], time[FRAME_TIME_SPI_DONE] - time[FRAME_TIME_SPI_QUEUE]);
+	telemetry_record(&telemetry_current.stages[TELEMETRY_UPLINK], now - time[FRAME_TIME_SPI_DONE]);
+	telemetry_record(&telemetry_current.stages[TELEMETRY_TOTAL], now - time[FRAME_TIME_MQTT_RX]);
+	telemetry_current.counters[TELEMETRY_FRAMES]++;
+	telemetry_current.counters[TELEMETRY_BYTES_UP] += published;
+	portEXIT_CRITICAL(&telemetry_lock);
+}
+
+void telemetry_count(telemetry_counter_t counter, uint32_t value)
+{
+	portENTER_CRITICAL(&telemetry_lock);
+	telemetry_current.counters[counter] += value;
+	portEXIT_CRITICAL(&telemetry_lock);
+}
+
+
+static void telemetry_record(telemetry_histogram_t *histogram, uint32_t us)
+{
+	uint8_t bucket = 0;
+	while ((bucket < (TELEMETRY_BUCKETS - 1)) && (us >= (1UL << (bucket + TELEMETRY_BUCKET_SHIFT))))
+	{
+		bucket++;
+	}
+	histogram->count++;
+	histogram->sum += us;
+	if (us > histogram->max)
+	{
+		histogram->max = us;
+	}
+	if (UINT16_MAX != histogram->buckets[bucket])
+	{
+		histogram->buckets[bucket]++;
+	}
+}
+
+//Layout in Bridge_Protocol.h, everything big endian like the rest of the protocol
+static uint16_t telemetry_encode(const telemetry_period_t *period, uint32_t elapsed, uint8_t *out)
+{
+	uint16_t index = 0;
+	out[index++] = TELEMETRY_VERSION;
+	index = telemetry_put32(out, index, elapsed);
+	for (uint8_t counter = 0; counter < TELEMETRY_COUNTERS; counter++)
+	{
+		index = telemetry_put32(out, index, period->counters[counter]);
+	}
+	index = telemetry_put32(out, index, esp_get_free_heap_size());
+	index = telemetry_put32(out, index, esp_get_minimum_free_heap_size());
+	out[index++] = TELEMETRY_STAGES;
+	out[index++] = TELEMETRY_BUCKETS;
+	for (uint8_t stage = 0; stage < TELEMETRY_STAGES; stage++)
+	{
+		const telemetry_histogram_t *histogram = &period->stages[stage];
+		index = telemetry_put32(out, index, histogram->count);
+		index = telemetry_put32(out, index, histogram->sum);
+		index = telemetry_put32(out, index, histogram->max);
+		for (uint8_t bucket = 0; bucket < TELEMETRY_BUCKETS; bucket++)
+		{
+			index = telemetry_put16(out, index, histogram->buckets[bucket]);
+		}
+	}
+	//Bytes of stack never used, a task not started yet reports 0
+	out[index++] = TELEMETRY_TASKS;
+	for (uint8_t task = 0; task < TELEMETRY_TASKS; task++)
+	{
+		index = telemetry_put32(out, index, (NULL != telemetry_tasks[task]) ?
+								(uint32_t)uxTaskGetStackHighWaterMark(telemetry_tasks[task]) : 0);
+	}
+	return index;
+}
+
+//A task that came this close to the end of its stack wants a bigger TASK_*_STACK
+static void telemetry_check_stacks(void)
+{
+	UBaseType_t unused = 0;
+	for (uint8_t task = 0; task < TELEMETRY_TASKS; task++)
+	{
+		if (NULL == telemetry_tasks[task])
+		{
+			continue;
+		}
+		unused = uxTaskGetStackHighWaterMark(telemetry_tasks[task]);
+		if (unused < TASK_STACK_MARGIN)
+		{
+			ESP_LOGW(TAG, "%s: %u bytes of stack never used", pcTaskGetName(telemetry_tasks[task]), (unsigned)unused);
+		}
+	}
+}
+
+static uint16_t telemetry_put32(uint8_t *out, uint16_t index, uint32_t value)
+{
+	out[index++] = (uint8_t)(value >> 24);
+	out[index++] = (uint8_t)(value >> 16);
+	out[index++] = (uint8_t)(value >> 8);
+	out[index++] = (uint8_t)(value);
+	return index;
+}
+
+static uint16_t telemetry_put16(uint8_t *out, uint16_t index, uint16_t value)
+{
+	out[index++] = (uint8_t)(value >> 8);
+	out[index++] = (uint8_t)(value);
+	return index;
+}
@@ -0,0 +1,67 @@
+/*
+ * Bridge_Telemetry.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Where the time of a frame goes. Every frame is stamped when it arrives
+ *  from MQTT, when it is queued to the SPI slave and when the master clocked
+ *  it; its answer closes the record when it is published. The stages are
+ *  kept as log2 histograms and published every period with the counters,
+ *  the heap low-water mark and the stack high-water mark of every task.
+ */
+
+#ifndef MAIN_BRIDGE_TELEMETRY_H_
+#define MAIN_BRIDGE_TELEMETRY_H_
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "Frame_Pool.h"
+
+typedef enum
+{
+	TELEMETRY_DOWNLINK = 0,     //MQTT received to queued for the master
+	TELEMETRY_DEVICE,           //Queued to clocked, the STM32 polling us
+	TELEMETRY_UPLINK,           //Clocked to handed to the outbox
+	TELEMETRY_TOTAL,            //MQTT received to published
+	TELEMETRY_STAGES,
+} telemetry_stage_t;
+
+typedef enum
+{
+	TELEMETRY_FRAMES = 0,       //Answers published
+	TELEMETRY_BYTES_DOWN,       //Frame bytes from the host
+	TELEMETRY_BYTES_UP,         //Answer bytes published
+	TELEMETRY_DROPS,            //Messages or answers lost in the bridge
+	TELEMETRY_REJECTS,          //Frames failing the bridge check
+	TELEMETRY_COUNTERS,
+} telemetry_counter_t;
+
+typedef enum
+{
+	TELEMETRY_TASK_MQTT = 0,
+	TELEMETRY_TASK_SPI,
+	TELEMETRY_TASK_DOWNLINK,
+	TELEMETRY_TASK_UPLINK,
+	TELEMETRY_TASK_CACHE,
+	TELEMETRY_TASK_TELEMETRY,
+	TELEMETRY_TASKS,
+} telemetry_task_t;
+
+/* Bucket i counts stages shorter than 2^(i + TELEMETRY_BUCKET_SHIFT) us,
+ * the last one everything longer */
+#define TELEMETRY_BUCKETS           12
+#define TELEMETRY_BUCKET_SHIFT      7
+#define TELEMETRY_VERSION           1
+
+void Telemetry_Task(void *par);
+void telemetry_watch_task(telemetry_task_t task, TaskHandle_t handle);
+void telemetry_stamp(frame_t *frame, frame_time_t stage);
+void telemetry_frame(const frame_t *reply, uint16_t published);
+void telemetry_count(telemetry_counter_t counter, uint32_t value);
+
+#endif /* MAIN_BRIDGE_TELEMETRY_H_ */
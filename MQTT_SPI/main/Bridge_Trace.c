@@ -0,0 +1,77 @@
+/*
+ * Bridge_Trace.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include "Bridge_Trace.h"
+
+#if CONFIG_BRIDGE_TRACE
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+
+typedef struct
+{
+	uint32_t time;
+	uint16_t frame;
+	uint16_t len;
+	uint8_t event;
+	uint8_t info;
+} trace_entry_t;
+
+static trace_entry_t trace_ring[CONFIG_BRIDGE_TRACE_ENTRIES];
+static uint32_t trace_next = 0;            //Entries ever written, the ring keeps the last ones
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+
+
+//Called from every task of the data path, the SPI and MQTT tasks run on both cores
+void bridge_trace(uint8_t event, uint16_t frame, uint16_t len, uint8_t info)
+{
+	uint32_t time = (uint32_t)esp_timer_get_time();
+	trace_entry_t *entry = NULL;
+	portENTER_CRITICAL(&trace_lock);
+	entry = &trace_ring[trace_next % CONFIG_BRIDGE_TRACE_ENTRIES];
+	trace_next++;
+	entry->time = time;
+	entry->frame = frame;
+	entry->len = len;
+	entry->event = event;
+	entry->info = info;
+	portEXIT_CRITICAL(&trace_lock);
+}
+
+uint16_t bridge_trace_count(void)
+{
+	uint32_t next = trace_next;
+	return (next < CONFIG_BRIDGE_TRACE_ENTRIES) ? (uint16_t)next : CONFIG_BRIDGE_TRACE_ENTRIES;
+}
+
+//Oldest first, entries overwritten while reading are returned as they are now
+uint16_t bridge_trace_read(uint16_t first, uint16_t count, uint8_t *out)
+{
+	trace_entry_t entry;
+	uint32_t oldest = 0;
+	uint16_t read = 0;
+	for (; (read < count) && ((first + read) < bridge_trace_count()); read++)
+	{
+		portENTER_CRITICAL(&trace_lock);
+		oldest = (trace_next > CONFIG_BRIDGE_TRACE_ENTRIES) ? (trace_next - CONFIG_BRIDGE_TRACE_ENTRIES) : 0;
+		entry = trace_ring[(oldest + first + read) % CONFIG_BRIDGE_TRACE_ENTRIES];
+		portEXIT_CRITICAL(&trace_lock);
+		out[0] = (uint8_t)(entry.time >> 24);
+		out[1] = (uint8_t)(entry.time >> 16);
+		out[2] = (uint8_t)(entry.time >> 8);
+		out[3] = (uint8_t)(entry.time);
+		out[4] = (uint8_t)(entry.frame >> 8);
+		out[5] = (uint8_t)(entry.frame);
+		out[6] = (uint8_t)(entry.len >> 8);
+		out[7] = (uint8_t)(entry.len);
+		out[8] = entry.event;
+		out[9] = entry.info;
+		out += TRACE_ENTRY_LENGTH;
+	}
+	return read;
+}
+
+#endif
@@ -0,0 +1,60 @@
+/*
+ * Bridge_Trace.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  Binary trace of the data path. Every entry is a timestamp, the frame it
+ *  belongs to and what happened to it, kept in a RAM ring and published on
+ *  request. Recording is a few stores, nothing is formatted or printed.
+ *  Without CONFIG_BRIDGE_TRACE the calls compile to nothing.
+ */
+
+#ifndef MAIN_BRIDGE_TRACE_H_
+#define MAIN_BRIDGE_TRACE_H_
+
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+typedef enum
+{
+	TRACE_MQTT_RX = 1,          //Frame complete and queued, len
+	TRACE_SPI_SUBMIT,           //Armed for the master, len
+	TRACE_SPI_DONE,             //Clocked by the master, len of the answer
+	TRACE_MQTT_TX,              //Answer handed to the outbox, len published
+	TRACE_REJECT,               //Failed the bridge check, info is the reason
+	TRACE_DROP,                 //Lost on the way, info is a trace_drop_t
+	TRACE_FLOW,                 //Device busy or ready, info 1 when ready
+	TRACE_AGGREGATE,            //Aggregate finished, len frames sent, info last result
+	TRACE_CACHE,                //Cached update moved on, info is the stage
+} trace_event_t;
+
+typedef enum
+{
+	TRACE_DROP_INCOMPLETE = 0,
+	TRACE_DROP_TOO_LONG,
+	TRACE_DROP_NO_FRAME,
+	TRACE_DROP_OUTBOX,
+} trace_drop_t;
+
+/* Published layout of an entry: time in us (BE32), frame (BE16), len (BE16), event, info */
+#define TRACE_ENTRY_LENGTH      10
+
+#if CONFIG_BRIDGE_TRACE
+
+void bridge_trace(uint8_t event, uint16_t frame, uint16_t len, uint8_t info);
+uint16_t bridge_trace_read(uint16_t first, uint16_t count, uint8_t *out);
+uint16_t bridge_trace_count(void);
+
+#define BRIDGE_TRACE(event, frame, len, info)   bridge_trace((event), (frame), (len), (info))
+
+#else
+
+#define BRIDGE_TRACE(event, frame, len, info)   do { } while (0)
+#define bridge_trace_read(first, count, out)    (0)
+#define bridge_trace_count()                    (0)
+
+#endif
+
+#endif /* MAIN_BRIDGE_TRACE_H_ */
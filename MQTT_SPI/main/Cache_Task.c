@@ -0,0 +1,255 @@
+/*
+ * Cache_Task.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include "Cache_Task.h"
+#include "Bridge_Protocol.h"
+#include "SPI_Task.h"
+#include "MQTT_Task.h"
+#include "Bridge_Trace.h"
+
+#define CACHE_LINK_WAIT         (10000 / portTICK_PERIOD_MS)
+
+#define GET_4BYTES(buf, index)                      \
+	(((uint32_t)(buf)[(index)] << 24) | ((uint32_t)(buf)[(index) + 1] << 16) | \
+	 ((uint32_t)(buf)[(index) + 2] << 8) | (uint32_t)(buf)[(index) + 3])
+
+static esp_err_t partition_erase(void *ctx, uint32_t offset, uint32_t len);
+static esp_err_t partition_write(void *ctx, uint32_t offset, const void *data, uint32_t len);
+static esp_err_t partition_read(void *ctx, uint32_t offset, void *data, uint32_t len);
+static esp_err_t spi_link_transfer(void *ctx, const uint8_t *tx, uint16_t len, uint8_t *rx);
+static bool spi_link_collect(uint8_t *rx);
+static void cache_status(void *ctx, cache_stage_t stage, esp_err_t result, uint32_t done, uint32_t total);
+static void cache_reply(uint8_t target, cache_stage_t stage, esp_err_t result, uint32_t done, uint32_t total);
+static void cache_handle(const frame_t *frame);
+
+static const char *TAG = "CACHE";
+static QueueHandle_t cache_queue = NULL;
+static QueueHandle_t cache_link_done = NULL;
+static cache_storage_t cache_storage;
+//One image cache for the bridge, the target that sent CACHE_BEGIN owns it until the next one
+static uint8_t cache_target = 0;
+//Timed out but still armed in the SPI driver, the link is dead until it is clocked
+static frame_t *cache_link_pending = NULL;
+static const cache_link_t cache_link = {
+	.transfer = spi_link_transfer,
+	.ctx = NULL,
+};
+static image_cache_t cache = {
+	.storage = &cache_storage,
+	.link = &cache_link,
+	.progress = cache_status,
+};
+
+
+void Cache_Task(void *par)
+{
+	frame_t *frame = NULL;
+	const esp_partition_t *partition = NULL;
+
+	cache_queue = xQueueCreate(FRAME_POOL_COUNT, sizeof(frame_t *));
+	cache_link_done = xQueueCreate(FRAME_POOL_COUNT, sizeof(frame_t *));
+
+	partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA,
+										 (esp_partition_subtype_t)CACHE_PARTITION_SUBTYPE,
+										 CACHE_PARTITION_LABEL);
+	if (NULL == partition)
+	{
+		//Every CACHE_BEGIN is refused with a size error
+		ESP_LOGE(TAG, "No %s partition", CACHE_PARTITION_LABEL);
+	}
+	cache_storage = (cache_storage_t){
+		.erase = partition_erase,
+		.write = partition_write,
+		.read = partition_read,
+		.size = (NULL != partition) ? partition->size : 0,
+		.ctx = (void *)partition,
+	};
+
+	while (1)
+	{
+		if (xQueueReceive(cache_queue, &frame, portMAX_DELAY))
+		{
+			cache_handle(frame);
+			frame_free(frame);
+		}
+	}
+}
+
+//Called from the MQTT event handler, the work itself runs in the cache task
+bool cache_control(uint8_t target, const uint8_t *data, int len)
+{
+	frame_t *frame = NULL;
+	if ((NULL == cache_queue) || (len < 1) || (len > FRAME_SIZE))
+	{
+		return false;
+	}
+	//The MQTT client is never held up, the host hears of the drop right away
+	frame = frame_alloc(0);
+	if (NULL == frame)
+	{
+		ESP_LOGW(TAG, "No free frame, control message dropped");
+		cache_reply(target, (BRIDGE_MSG_CACHE_COMMIT == data[0]) ? CACHE_STAGE_VERIFY : CACHE_STAGE_DOWNLOAD,
+					ESP_ERR_NO_MEM, 0, 0);
+		return false;
+	}
+	memcpy(frame->data, data, len);
+	frame->len = (uint16_t)len;
+	frame->target = target;
+	xQueueSend(cache_queue, &frame, portMAX_DELAY);
+	return true;
+}
+
+static void cache_handle(const frame_t *frame)
+{
+	esp_err_t ret = ESP_ERR_INVALID_SIZE;
+	const uint8_t *data = frame->data;
+	image_cache_header_t header;
+	switch (data[0])
+	{
+	case BRIDGE_MSG_CACHE_BEGIN:
+		cache_target = frame->target;
+		if (BRIDGE_CACHE_BEGIN_LENGTH == frame->len)
+		{
+			header.size = GET_4BYTES(data, 1);
+			header.digest = GET_4BYTES(data, 5);
+			header.major = data[9];
+			header.minor = data[10];
+			header.patch = data[11];
+			header.address = GET_4BYTES(data, 12);
+			header.build_id = GET_4BYTES(data, 16);
+			header.first_sector = data[20];
+			header.sector_count = data[21];
+			header.flags = data[22];
+			ret = image_cache_begin(&cache, &header);
+		}
+		//The host starts streaming once the area is erased
+		cache_status(NULL, CACHE_STAGE_DOWNLOAD, ret, 0, cache.header.size);
+		break;
+	case BRIDGE_MSG_CACHE_DATA:
+		if (BRIDGE_CACHE_DATA_HEADER < frame->len)
+		{
+			ret = image_cache_write(&cache, GET_4BYTES(data, 1), &data[BRIDGE_CACHE_DATA_HEADER],
+									frame->len - BRIDGE_CACHE_DATA_HEADER);
+		}
+		//Only failures are answered, the commit reports the rest
+		if (ESP_OK != ret)
+		{
+			cache_status(NULL, CACHE_STAGE_DOWNLOAD, ret, cache.received, cache.header.size);
+		}
+		break;
+	case BRIDGE_MSG_CACHE_COMMIT:
+		ret = image_cache_verify(&cache);
+		if (ESP_OK == ret)
+		{
+			ESP_LOGI(TAG, "Image of %" PRIu32 " bytes cached, flashing the target", cache.header.size);
+			ret = image_cache_flash(&cache);
+		}
+		else
+		{
+			cache_status(NULL, CACHE_STAGE_VERIFY, ret, cache.received, cache.header.size);
+		}
+		ESP_LOGI(TAG, "Cached update %s", (ESP_OK == ret) ? "done" : "failed");
+		break;
+	default:
+		break;
+	}
+}
+
+static void cache_status(void *ctx, cache_stage_t stage, esp_err_t result, uint32_t done, uint32_t total)
+{
+	cache_reply(cache_target, stage, result, done, total);
+}
+
+static void cache_reply(uint8_t target, cache_stage_t stage, esp_err_t result, uint32_t done, uint32_t total)
+{
+	uint8_t status[BRIDGE_CACHE_STATUS_LENGTH];
+	BRIDGE_TRACE(TRACE_CACHE, 0, (uint16_t)(done / CACHE_CHUNK_SIZE), (uint8_t)stage);
+	status[0] = BRIDGE_MSG_CACHE_STATUS;
+	status[1] = (uint8_t)stage;
+	status[2] = (ESP_OK == result) ? 0 : 1;
+	status[3] = (uint8_t)(done >> 24);
+	status[4] = (uint8_t)(done >> 16);
+	status[5] = (uint8_t)(done >> 8);
+	status[6] = (uint8_t)(done);
+	status[7] = (uint8_t)(total >> 24);
+	status[8] = (uint8_t)(total >> 16);
+	status[9] = (uint8_t)(total >> 8);
+	status[10] = (uint8_t)(total);
+	mqtt_publish_status(target, status, sizeof(status));
+}
+
+static esp_err_t partition_erase(void *ctx, uint32_t offset, uint32_t len)
+{
+	return esp_partition_erase_range((const esp_partition_t *)ctx, offset, len);
+}
+
+static esp_err_t partition_write(void *ctx, uint32_t offset, const void *data, uint32_t len)
+{
+	return esp_partition_write((const esp_partition_t *)ctx, offset, data, len);
+}
+
+static esp_err_t partition_read(void *ctx, uint32_t offset, void *data, uint32_t len)
+{
+	return esp_partition_read((const esp_partition_t *)ctx, offset, data, len);
+}
+
+//Same path as the frames coming from MQTT, only the completion comes back here
+static esp_err_t spi_link_transfer(void *ctx, const uint8_t *tx, uint16_t len, uint8_t *rx)
+{
+	frame_t *frame = NULL;
+	frame_t *reply = NULL;
+	//A frame queued now would be clocked after the stale one, the device would take both
+	if ((NULL != cache_link_pending) && !spi_link_collect(NULL))
+	{
+		return ESP_ERR_TIMEOUT;
+	}
+	frame = frame_alloc(CACHE_LINK_WAIT);
+	reply = frame_alloc(CACHE_LINK_WAIT);
+	if ((NULL == frame) || (NULL == reply))
+	{
+		frame_free(frame);
+		frame_free(reply);
+		return ESP_ERR_NO_MEM;
+	}
+	memcpy(frame->data, tx, len);
+	memset(frame->data + len, 0x00, FRAME_SIZE - len);
+	frame->len = len;
+	frame->target = cache_target;
+	reply->target = cache_target;
+	frame->reply = reply;
+	frame->done = cache_link_done;
+	if (ESP_OK != SPI_submit(frame))
+	{
+		frame_free(frame);
+		frame_free(reply);
+		return ESP_FAIL;
+	}
+	if (!spi_link_collect(rx))
+	{
+		ESP_LOGW(TAG, "Target %u did not clock the frame, link held until it does", cache_target);
+		cache_link_pending = frame;
+		return ESP_ERR_TIMEOUT;
+	}
+	return ESP_OK;
+}
+
+//Only one frame of the cache is ever armed, it either comes back or stays pending
+static bool spi_link_collect(uint8_t *rx)
+{
+	frame_t *done = NULL;
+	if (!xQueueReceive(cache_link_done, &done, CACHE_LINK_WAIT))
+	{
+		return false;
+	}
+	if (NULL != rx)
+	{
+		memcpy(rx, done->reply->data, FRAME_SIZE);
+	}
+	frame_free(done->reply);
+	frame_free(done);
+	cache_link_pending = NULL;
+	return true;
+}
@@ -0,0 +1,30 @@
+/*
+ * Cache_Task.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+
+#ifndef MAIN_CACHE_TASK_H_
+#define MAIN_CACHE_TASK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+#include "esp_partition.h"
+
+#include "Image_Cache.h"
+#include "Frame_Pool.h"
+
+#define CACHE_PARTITION_LABEL       "fota_cache"
+#define CACHE_PARTITION_SUBTYPE     0x40
+
+void Cache_Task(void *par);
+bool cache_control(uint8_t target, const uint8_t *data, int len);
+
+#endif /* MAIN_CACHE_TASK_H_ */
@@ -0,0 +1,82 @@
+/*
+ * Frame_Pool.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+
+#include "Frame_Pool.h"
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char *TAG = "FRAME_POOL";
+static frame_t frames[FRAME_POOL_COUNT];
+static QueueHandle_t free_frames = NULL;
+
+
+esp_err_t frame_pool_init(void)
+{
+	if (NULL != free_frames)
+	{
+		return ESP_OK;
+	}
+	free_frames = xQueueCreate(FRAME_POOL_COUNT, sizeof(frame_t *));
+	if (NULL == free_frames)
+	{
+		return ESP_ERR_NO_MEM;
+	}
+	for (uint8_t i = 0; i < FRAME_POOL_COUNT; i++)
+	{
+		frame_t *frame = &frames[i];
+		//The SPI slave DMA reads and writes these buffers directly
+		frame->data = heap_caps_malloc(FRAME_SIZE, MALLOC_CAP_DMA);
+		if (NULL == frame->data)
+		{
+			ESP_LOGE(TAG, "No DMA memory for frame %d", i);
+			return ESP_ERR_NO_MEM;
+		}
+		frame->len = 0;
+		frame->reply = NULL;
+		frame->done = NULL;
+		frame->kind = FRAME_KIND_DATA;
+		frame->target = 0;
+		frame->source = FRAME_SOURCE_MQTT;
+		frame->id = 0;
+		frame->correlation_len = 0;
+		memset(frame->time, 0x00, sizeof(frame->time));
+		xQueueSend(free_frames, &frame, 0);
+	}
+	return ESP_OK;
+}
+
+frame_t *frame_alloc(TickType_t wait)
+{
+	frame_t *frame = NULL;
+	if ((NULL != free_frames) && xQueueReceive(free_frames, &frame, wait))
+	{
+		frame->len = 0;
+		frame->reply = NULL;
+		frame->done = NULL;
+		frame->kind = FRAME_KIND_DATA;
+		frame->target = 0;
+		frame->source = FRAME_SOURCE_MQTT;
+		frame->id = 0;
+		frame->correlation_len = 0;
+		memset(frame->time, 0x00, sizeof(frame->time));
+	}
+	return frame;
+}
+
+void frame_free(frame_t *frame)
+{
+	if (NULL != frame)
+	{
+		xQueueSend(free_frames, &frame, 0);
+	}
+}
+
+uint8_t frame_pool_available(void)
+{
+	return (NULL != free_frames) ? (uint8_t)uxQueueMessagesWaiting(free_frames) : 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Frame_Pool.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+
+#ifndef MAIN_FRAME_POOL_H_
+#define MAIN_FRAME_POOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+
+#define FRAME_SIZE          256
+//Shared by all targets, it grows so each one has what a single target had
+#define FRAME_POOL_COUNT    (10 * CONFIG_BRIDGE_TARGETS)
+#define FRAME_CORRELATION_MAX   8
+
+typedef enum
+{
+	FRAME_TIME_MQTT_RX = 0,     //Whole message received from the broker
+	FRAME_TIME_SPI_QUEUE,       //Queued to the SPI slave driver
+	FRAME_TIME_SPI_DONE,        //Clocked by the master
+	FRAME_TIMES,
+} frame_time_t;
+
+//A frame owns one DMA capable buffer, only its pointer travels through the queues
+typedef struct frame
+{
+	uint8_t *data;
+	uint16_t len;               //Valid bytes in data
+	struct frame *reply;        //Filled by the SPI task with what the master sent back
+	QueueHandle_t done;         //Where the SPI task returns the frame, NULL for the uplink
+	uint8_t kind;
+	uint8_t target;             //STM32 the frame is for, or came from
+	uint8_t source;             //Transport the host sent it on, the answer goes back the same way
+	uint16_t id;                //Numbered on arrival, names the frame in the trace
+	uint8_t correlation[FRAME_CORRELATION_MAX];  //MQTT 5 correlation data of the host, echoed on the answer
+	uint8_t correlation_len;
+	uint32_t time[FRAME_TIMES]; //esp_timer stamps of the stages, kept on the answer frame
+} frame_t;
+
+typedef enum
+{
+	FRAME_KIND_DATA = 0,        //One bootloader frame from the host
+	FRAME_KIND_AGGREGATE,       //Stands for the aggregate buffer, its pair carries the frames
+} frame_kind_t;
+
+typedef enum
+{
+	FRAME_SOURCE_MQTT = 0,
+	FRAME_SOURCE_LAN,
+	FRAME_SOURCE_BENCH,         //Fed by the benchmark, the answer is counted and dropped
+} frame_source_t;
+
+esp_err_t frame_pool_init(void);
+frame_t *frame_alloc(TickType_t wait);
+void frame_free(frame_t *frame);
+uint8_t frame_pool_available(void);
+
+#endif /* MAIN_FRAME_POOL_H_ */
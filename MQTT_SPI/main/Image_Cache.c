@@ -0,0 +1,269 @@
+/*
+ * Image_Cache.c
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ */
+#include <string.h>
+
+#include "Image_Cache.h"
+
+#define CRC_POLY                0x04C11DB7UL
+#define CRC_INIT                0xFFFFFFFFUL
+
+#define CMD_ERASE               0x01
+#define CMD_WRITE               0x02
+#define CMD_JUMP                0x03
+#define WAIT_FOR_ACK_SIGNAL     0x04
+#define REPEATED_SIGNAL         0x05
+#define CMD_VERIFY              0x09
+#define ACK_SIGNAL              0xFF
+#define NACK_SIGNAL             0x01
+
+#define JUMP_MAIN_APP           0xFFFFFFFFUL
+#define BOOT_NOT_NEEDED         0xAA
+#define VERIFY_OK               0x00
+
+#define CACHE_SEND_ATTEMPTS     3
+#define CACHE_PROGRESS_CHUNKS   16
+
+#define PUT_4BYTES(buf, index, value)               \
+	do {                                            \
+		(buf)[(index)]     = (uint8_t)((value) >> 24); \
+		(buf)[(index) + 1] = (uint8_t)((value) >> 16); \
+		(buf)[(index) + 2] = (uint8_t)((value) >> 8);  \
+		(buf)[(index) + 3] = (uint8_t)(value);         \
+	} while (0)
+#define GET_4BYTES(buf, index)                      \
+	(((uint32_t)(buf)[(index)] << 24) | ((uint32_t)(buf)[(index) + 1] << 16) | \
+	 ((uint32_t)(buf)[(index) + 2] << 8) | (uint32_t)(buf)[(index) + 3])
+
+static uint32_t cache_crc_update(uint32_t crc, const uint8_t *data, uint32_t len);
+static uint16_t cache_frame(uint8_t *frame, uint8_t command, const uint8_t *args, uint8_t len);
+static esp_err_t cache_exchange(image_cache_t *cache, const uint8_t *tx, uint16_t len);
+static esp_err_t cache_send_confirmed(image_cache_t *cache, uint16_t len);
+static void cache_report(image_cache_t *cache, cache_stage_t stage, esp_err_t result,
+						 uint32_t done, uint32_t total);
+
+static uint32_t cache_crc_table[256];
+static uint8_t cache_crc_ready = 0;
+
+
+esp_err_t image_cache_begin(image_cache_t *cache, const image_cache_header_t *header)
+{
+	uint32_t erase_len = 0;
+	if ((0 == header->size) || (header->size > cache->storage->size))
+	{
+		return ESP_ERR_INVALID_SIZE;
+	}
+	cache->header = *header;
+	cache->received = 0;
+	//Only the blocks the image needs, the rest of the partition keeps its wear
+	erase_len = ((header->size + CACHE_ERASE_SIZE - 1) / CACHE_ERASE_SIZE) * CACHE_ERASE_SIZE;
+	if (erase_len > cache->storage->size)
+	{
+		erase_len = cache->storage->size;
+	}
+	return cache->storage->erase(cache->storage->ctx, 0, erase_len);
+}
+
+esp_err_t image_cache_write(image_cache_t *cache, uint32_t offset, const uint8_t *data, uint16_t len)
+{
+	esp_err_t ret = ESP_ERR_INVALID_SIZE;
+	if ((offset + len) <= cache->header.size)
+	{
+		ret = cache->storage->write(cache->storage->ctx, offset, data, len);
+		if (ESP_OK == ret)
+		{
+			cache->received += len;
+		}
+	}
+	return ret;
+}
+
+esp_err_t image_cache_verify(image_cache_t *cache)
+{
+	esp_err_t ret = ESP_OK;
+	uint32_t crc = CRC_INIT;
+	uint32_t len = 0;
+	cache_report(cache, CACHE_STAGE_VERIFY, ESP_OK, cache->received, cache->header.size);
+	for (uint32_t offset = 0; (offset < cache->header.size) && (ESP_OK == ret); offset += len)
+	{
+		len = cache->header.size - offset;
+		if (len > CACHE_CHUNK_SIZE)
+		{
+			len = CACHE_CHUNK_SIZE;
+		}
+		ret = cache->storage->read(cache->storage->ctx, offset, cache->tx, len);
+		crc = cache_crc_update(crc, cache->tx, len);
+	}
+	if ((ESP_OK == ret) && (crc != cache->header.digest))
+	{
+		ret = ESP_ERR_INVALID_CRC;
+	}
+	return ret;
+}
+
+esp_err_t image_cache_flash(image_cache_t *cache)
+{
+	esp_err_t ret = ESP_OK;
+	const image_cache_header_t *header = &cache->header;
+	uint8_t args[15];
+	uint32_t len = 0;
+	uint32_t chunk = 0;
+
+	//Erase the application area
+	cache_report(cache, CACHE_STAGE_ERASE, ESP_OK, 0, header->sector_count);
+	args[0] = header->first_sector;
+	args[1] = header->sector_count;
+	ret = cache_send_confirmed(cache, cache_frame(cache->tx, CMD_ERASE, args, 2));
+
+	//Open the write session, the next exchange waits for the erase to finish
+	if (ESP_OK == ret)
+	{
+		cache_report(cache, CACHE_STAGE_HEADER, ESP_OK, 0, header->size);
+		args[0] = header->major;
+		args[1] = header->minor;
+		args[2] = header->patch;
+		PUT_4BYTES(args, 3, header->address);
+		PUT_4BYTES(args, 7, header->size);
+		PUT_4BYTES(args, 11, header->build_id);
+		ret = cache_send_confirmed(cache, cache_frame(cache->tx, CMD_WRITE, args, 15));
+	}
+
+	//Stream the chunks from the cache, each one confirmed before the next
+	for (uint32_t offset = 0; (offset < header->size) && (ESP_OK == ret); offset += len)
+	{
+		len = header->size - offset;
+		if (len > CACHE_CHUNK_SIZE)
+		{
+			len = CACHE_CHUNK_SIZE;
+		}
+		ret = cache->storage->read(cache->storage->ctx, offset, cache->tx, len);
+		if (ESP_OK == ret)
+		{
+			PUT_4BYTES(cache->tx, len, cache_crc_update(CRC_INIT, cache->tx, len));
+			ret = cache_send_confirmed(cache, len + 4);
+		}
+		if ((0 == (++chunk % CACHE_PROGRESS_CHUNKS)) || ((offset + len) == header->size))
+		{
+			cache_report(cache, CACHE_STAGE_WRITE, ret, offset + len, header->size);
+		}
+	}
+
+	//Let the bootloader check what landed in its flash
+	if ((ESP_OK == ret) && (header->flags & CACHE_FLAG_VERIFY))
+	{
+		cache_report(cache, CACHE_STAGE_CHECK, ESP_OK, 0, header->size);
+		PUT_4BYTES(args, 0, header->digest);
+		ret = cache_send_confirmed(cache, cache_frame(cache->tx, CMD_VERIFY, args, 4));
+		if (ESP_OK == ret)
+		{
+			cache->tx[0] = REPEATED_SIGNAL;
+			ret = cache_exchange(cache, cache->tx, 1);
+		}
+		if ((ESP_OK == ret) &&
+			((CMD_VERIFY != cache->rx[1]) || (cache->rx[0] < 10) ||
+			 (GET_4BYTES(cache->rx, cache->rx[0] - 3) != cache_crc_update(CRC_INIT, cache->rx, cache->rx[0] - 3)) ||
+			 (VERIFY_OK != cache->rx[2])))
+		{
+			ret = ESP_ERR_INVALID_CRC;
+		}
+	}
+
+	//Start the new image and keep booting it
+	if ((ESP_OK == ret) && (header->flags & CACHE_FLAG_JUMP))
+	{
+		cache_report(cache, CACHE_STAGE_JUMP, ESP_OK, 0, 0);
+		PUT_4BYTES(args, 0, JUMP_MAIN_APP);
+		args[4] = BOOT_NOT_NEEDED;
+		ret = cache_send_confirmed(cache, cache_frame(cache->tx, CMD_JUMP, args, 5));
+	}
+
+	cache_report(cache, CACHE_STAGE_DONE, ret, (ESP_OK == ret) ? header->size : 0, header->size);
+	return ret;
+}
+
+
+//CRC-32/MPEG-2 with every byte fed as a 32-bit word, like the bootloader CRC unit
+static uint32_t cache_crc_update(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+	if (!cache_crc_ready)
+	{
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t value = i << 24;
+			for (uint8_t bit = 0; bit < 8; bit++)
+			{
+				value = (value & 0x80000000UL) ? ((value << 1) ^ CRC_POLY) : (value << 1);
+			}
+			cache_crc_table[i] = value;
+		}
+		cache_crc_ready = 1;
+	}
+	for (uint32_t i = 0; i < len; i++)
+	{
+		//Three zero bytes of padding, then the byte itself
+		crc = (crc << 8) ^ cache_crc_table[crc >> 24];
+		crc = (crc << 8) ^ cache_crc_table[crc >> 24];
+		crc = (crc << 8) ^ cache_crc_table[crc >> 24];
+		crc = (crc << 8) ^ cache_crc_table[(crc >> 24) ^ data[i]];
+	}
+	return crc;
+}
+
+//Host layout: length (index of the last byte), command, arguments, CRC
+static uint16_t cache_frame(uint8_t *frame, uint8_t command, const uint8_t *args, uint8_t len)
+{
+	uint16_t index = 0;
+	frame[index++] = len + 5;
+	frame[index++] = command;
+	memcpy(&frame[index], args, len);
+	index += len;
+	PUT_4BYTES(frame, index, cache_crc_update(CRC_INIT, frame, index));
+	return index + 4;
+}
+
+static esp_err_t cache_exchange(image_cache_t *cache, const uint8_t *tx, uint16_t len)
+{
+	return cache->link->transfer(cache->link->ctx, tx, len, cache->rx);
+}
+
+//Send what is in cache->tx and poll its ACK, a NACK means the frame is sent again
+static esp_err_t cache_send_confirmed(image_cache_t *cache, uint16_t len)
+{
+	esp_err_t ret = ESP_FAIL;
+	const uint8_t wait_ack = WAIT_FOR_ACK_SIGNAL;
+	for (uint8_t attempt = 0; attempt < CACHE_SEND_ATTEMPTS; attempt++)
+	{
+		ret = cache_exchange(cache, cache->tx, len);
+		if (ESP_OK == ret)
+		{
+			ret = cache_exchange(cache, &wait_ack, 1);
+		}
+		if (ESP_OK != ret)
+		{
+			break;
+		}
+		if (ACK_SIGNAL == cache->rx[0])
+		{
+			return ESP_OK;
+		}
+		if (NACK_SIGNAL != cache->rx[0])
+		{
+			ret = ESP_ERR_INVALID_RESPONSE;
+			break;
+		}
+		ret = ESP_ERR_INVALID_CRC;
+	}
+	return ret;
+}
+
+static void cache_report(image_cache_t *cache, cache_stage_t stage, esp_err_t result,
+						 uint32_t done, uint32_t total)
+{
+	if (NULL != cache->progress)
+	{
+		cache->progress(cache->progress_ctx, stage, result, done, total);
+	}
+}
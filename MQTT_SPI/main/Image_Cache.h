@@ -0,0 +1,92 @@
+/*
+ * Image_Cache.h
+ *
+ *  Created on: Oct 19, 2026
+ *      Author: ahmed
+ *
+ *  The bridge downloads a whole image into its own flash first, checks the
+ *  digest, then runs the bootloader session with the STM32 by itself. The
+ *  core only talks to a storage and a link interface, so it runs the same
+ *  on top of a partition and the SPI slave, or on top of plain buffers.
+ */
+
+#ifndef MAIN_IMAGE_CACHE_H_
+#define MAIN_IMAGE_CACHE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "esp_err.h"
+
+#define CACHE_FRAME_SIZE        256
+#define CACHE_CHUNK_SIZE        252
+#define CACHE_ERASE_SIZE        4096
+
+/* Flags of the cached image */
+#define CACHE_FLAG_VERIFY       (1 << 0)    //The bootloader supports VERIFY_IMAGE
+#define CACHE_FLAG_JUMP         (1 << 1)    //Start the application once flashed
+
+typedef enum
+{
+	CACHE_STAGE_IDLE = 0,
+	CACHE_STAGE_DOWNLOAD,
+	CACHE_STAGE_VERIFY,
+	CACHE_STAGE_ERASE,
+	CACHE_STAGE_HEADER,
+	CACHE_STAGE_WRITE,
+	CACHE_STAGE_CHECK,
+	CACHE_STAGE_JUMP,
+	CACHE_STAGE_DONE,
+} cache_stage_t;
+
+typedef struct
+{
+	uint32_t size;
+	uint32_t digest;            //Frame CRC run over the image, as the bootloader computes it
+	uint8_t major;
+	uint8_t minor;
+	uint8_t patch;
+	uint32_t address;
+	uint32_t build_id;
+	uint8_t first_sector;
+	uint8_t sector_count;
+	uint8_t flags;
+} image_cache_header_t;
+
+typedef struct
+{
+	esp_err_t (*erase)(void *ctx, uint32_t offset, uint32_t len);
+	esp_err_t (*write)(void *ctx, uint32_t offset, const void *data, uint32_t len);
+	esp_err_t (*read)(void *ctx, uint32_t offset, void *data, uint32_t len);
+	uint32_t size;
+	void *ctx;
+} cache_storage_t;
+
+typedef struct
+{
+	//One whole frame exchange with the bootloader, rx gets what the master clocked back
+	esp_err_t (*transfer)(void *ctx, const uint8_t *tx, uint16_t len, uint8_t *rx);
+	void *ctx;
+} cache_link_t;
+
+typedef void (*cache_progress_t)(void *ctx, cache_stage_t stage, esp_err_t result,
+								 uint32_t done, uint32_t total);
+
+typedef struct
+{
+	const cache_storage_t *storage;
+	const cache_link_t *link;
+	cache_progress_t progress;
+	void *progress_ctx;
+	image_cache_header_t header;
+	uint32_t received;
+	uint8_t tx[CACHE_FRAME_SIZE];
+	uint8_t rx[CACHE_FRAME_SIZE];
+} image_cache_t;
+
+esp_err_t image_cache_begin(image_cache_t *cache, const image_cache_header_t *header);
+esp_err_t image_cache_write(image_cache_t *cache, uint32_t offset, const uint8_t *data, uint16_t len);
+esp_err_t image_cache_verify(image_cache_t *cache);
+esp_err_t image_cache_flash(image_cache_t *cache);
+
+#endif /* MAIN_IMAGE_CACHE_H_ */
@@ -1,18 +1,73 @@
 #include "MQTT_Task.h"
+#include "Bridge_Protocol.h"
+#include "Cache_Task.h"
+#include "Bridge_Events.h"
+#include "Bridge_Trace.h"
+#include "Bridge_Telemetry.h"
+#include "SPI_Task.h"
+#include "Bridge_Lan.h"
+#include "Bridge_Bench.h"
 #include "portmacro.h"
 
 #define SSID	        "AHani"
 #define PASS	        "Ahmed@@@01008524027"
 #define MQTT_BUF_SIZE   256
-#define MQTT_QOS_SEND	0
+#define MQTT_QOS_SEND	1
 #define MQTT_QOS_RECE	1
+#define MQTT_BACKPRESSURE_WAIT	(5000 / portTICK_PERIOD_MS)    //LAN and benchmark only, TCP holds the host back
+#define MQTT_RESUME_FRAMES      2
+#define MQTT_RECONNECT_MS       1000
+#define WIFI_BACKOFF_MIN_MS     500
+#define WIFI_BACKOFF_MAX_MS     30000
+#define MQTT5_SESSION_EXPIRY_S  3600
+#define MQTT5_TOPIC_ALIASES     (3 * SPI_TARGET_COUNT)
+//Frames in flight towards the bridge, in pairs from what the uplinks' probes leave of the pool
+#define MQTT5_RECEIVE_MAXIMUM   ((FRAME_POOL_COUNT - 2 * SPI_TARGET_COUNT) / 2)
+#define MQTT5_ALIAS_TELEMETRY   1
 
 
+//Each STM32 behind the bridge is a device of its own for the host
+typedef struct
+{
+    char device_id[DEVICE_ID_MAX_LENGTH];
+    char topic_device_rx[TOPIC_MAX_LENGTH];
+    char topic_device_tx[TOPIC_MAX_LENGTH];
+    char topic_control[TOPIC_MAX_LENGTH];
+    char topic_status[TOPIC_MAX_LENGTH];
+    QueueHandle_t listen_queue;
+    volatile uint32_t session;
+    uint8_t aggregate_buffer[BRIDGE_AGGREGATE_MAX];
+    uint16_t aggregate_len;
+    volatile bool aggregate_busy;
+    volatile bool starved;      //Told to hold off, the pool had no frame for its message
+    bool flow_busy;             //As in the last FLOW, repeated when the pool refills
+} mqtt_target_t;
+
 static const char *TAG = "MQTT_TCP";
-static uint8_t mqtt_buffer_send[MQTT_BUF_SIZE];
-static uint8_t mqtt_buffer_rece[MQTT_BUF_SIZE];
-static SemaphoreHandle_t publish_sema = NULL;
-static SemaphoreHandle_t listen_sema = NULL;
+static QueueHandle_t publish_queue = NULL;
+static frame_t *mqtt_assembling = NULL;
+static mqtt_target_t mqtt_targets[SPI_TARGET_COUNT];
+static TimerHandle_t wifi_retry_timer = NULL;
+static uint32_t wifi_backoff_ms = WIFI_BACKOFF_MIN_MS;
+static char mqtt_client_id[DEVICE_ID_MAX_LENGTH + 16];
+static char topic_telemetry[TOPIC_MAX_LENGTH];
+static uint16_t mqtt_frame_id = 0;
+static portMUX_TYPE mqtt_frame_id_lock = portMUX_INITIALIZER_UNLOCKED;
+#if CONFIG_BRIDGE_MQTT5
+static SemaphoreHandle_t mqtt5_publish_lock = NULL;
+static esp_mqtt5_publish_property_config_t mqtt5_property;     //Last set under mqtt5_publish_lock
+static portMUX_TYPE mqtt5_alias_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t mqtt5_aliases_sent = 0;
+static TaskHandle_t mqtt_client_task = NULL;
+#endif
+
+
+//Runs in the timer task, the event loop is never held by a reconnect
+static void wifi_retry(TimerHandle_t timer)
+{
+    printf("WiFi reconnecting ... \n");
+    esp_wifi_connect();
+}
 
 
 static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_base, int32_t event_id, void *event_data)
@@ -26,10 +81,16 @@ static void wifi_event_handler(void *event_handler_arg, esp_event_base_t event_b
         printf("WiFi connected ... \n");
         break;
     case WIFI_EVENT_STA_DISCONNECTED:
-        printf("WiFi lost connection ... \n");
+        //Try again later and later, a missing access point is not hammered
+        printf("WiFi lost connection, retry in %" PRIu32 " ms ... \n", wifi_backoff_ms);
+        bridge_events_clear(BRIDGE_EVENT_WIFI_UP);
+        xTimerChangePeriod(wifi_retry_timer, wifi_backoff_ms / portTICK_PERIOD_MS, 0);
+        wifi_backoff_ms = (wifi_backoff_ms >= (WIFI_BACKOFF_MAX_MS / 2)) ? WIFI_BACKOFF_MAX_MS : (wifi_backoff_ms * 2);
         break;
     case IP_EVENT_STA_GOT_IP:
         printf("WiFi got IP ... \n\n");
+        wifi_backoff_ms = WIFI_BACKOFF_MIN_MS;
+        bridge_events_set(BRIDGE_EVENT_WIFI_UP);
         break;
     default:
         break;
@@ -43,6 +104,7 @@ void wifi_connection()
 	esp_netif_create_default_wifi_sta(); //sets up necessary data structs for wifi station interface
 	wifi_init_config_t wifi_initiation = WIFI_INIT_CONFIG_DEFAULT();//sets up wifi wifi_init_config struct with default values
 	esp_wifi_init(&wifi_initiation); //wifi initialised with dafault wifi_initiation
+	wifi_retry_timer = xTimerCreate("wifi_retry", WIFI_BACKOFF_MIN_MS / portTICK_PERIOD_MS, pdFALSE, NULL, wifi_retry);
 	esp_event_handler_register(WIFI_EVENT, ESP_EVENT_ANY_ID, wifi_event_handler, NULL);//creating event handler register for wifi
 	esp_event_handler_register(IP_EVENT, IP_EVENT_STA_GOT_IP, wifi_event_handler, NULL);//creating event handler register for ip event
 	wifi_config_t wifi_configuration ={ //struct wifi_config_t var wifi_configuration
@@ -62,18 +124,308 @@ void wifi_connection()
 
 esp_mqtt_client_handle_t client;
 
+static void mqtt_aggregate_received(uint8_t target, const uint8_t *data, int len);
+static void mqtt_hold_off(uint8_t target);
+static void mqtt_resume(void);
+static void mqtt_trace_dump(uint8_t target);
+static uint16_t mqtt_next_frame_id(void);
+static int mqtt_enqueue(const char *topic, const uint8_t *data, int len, int qos,
+                        const frame_t *frame, uint16_t alias);
+
+//Exact topics only, a bridge never sees what is addressed to another one
+static void mqtt_topics_init(void)
+{
+    uint8_t mac[6];
+    char base_id[DEVICE_ID_MAX_LENGTH];
+    mqtt_target_t *target = NULL;
+    if (0 != strlen(CONFIG_BRIDGE_DEVICE_ID))
+    {
+        snprintf(base_id, sizeof(base_id), "%s", CONFIG_BRIDGE_DEVICE_ID);
+    }
+    else
+    {
+        esp_read_mac(mac, ESP_MAC_WIFI_STA);
+        snprintf(base_id, sizeof(base_id), "%02x%02x%02x%02x%02x%02x",
+                 mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+    }
+    //The first STM32 keeps the bridge's own ID, the others get -<index> after it
+    for (uint8_t index = 0; index < SPI_TARGET_COUNT; index++)
+    {
+        target = &mqtt_targets[index];
+        if (0 == index)
+        {
+            snprintf(target->device_id, sizeof(target->device_id), "%s", base_id);
+        }
+        else
+        {
+            snprintf(target->device_id, sizeof(target->device_id), "%.*s" TARGET_ID_SEPARATOR "%u",
+                     DEVICE_ID_MAX_LENGTH - 5, base_id, index);
+        }
+        snprintf(target->topic_device_rx, TOPIC_MAX_LENGTH, TOPIC_PREFIX "%s/" TOPIC_DEVICE_RX, target->device_id);
+        snprintf(target->topic_device_tx, TOPIC_MAX_LENGTH, TOPIC_PREFIX "%s/" TOPIC_DEVICE_TX, target->device_id);
+        snprintf(target->topic_control, TOPIC_MAX_LENGTH, TOPIC_PREFIX "%s/" TOPIC_CONTROL, target->device_id);
+        snprintf(target->topic_status, TOPIC_MAX_LENGTH, TOPIC_PREFIX "%s/" TOPIC_STATUS, target->device_id);
+        ESP_LOGI(TAG, "Target %u: device ID %s, topics " TOPIC_PREFIX "%s/...", index,
+                 target->device_id, target->device_id);
+    }
+    //Numbers of the whole bridge, next to the first target's topics
+    snprintf(topic_telemetry, sizeof(topic_telemetry), TOPIC_PREFIX "%s/" TOPIC_TELEMETRY, base_id);
+    //The broker keeps the session of a client id, it has to stay the same over reboots
+    snprintf(mqtt_client_id, sizeof(mqtt_client_id), "fota-bridge-%s", base_id);
+}
+
+static bool topic_is(esp_mqtt_event_handle_t event, const char *topic)
+{
+    return (event->topic_len == (int)strlen(topic)) &&
+           (memcmp(event->topic, topic, event->topic_len) == 0);
+}
+
+//Messages for the bridge itself, from the control topic or the LAN
+void bridge_control(uint8_t target, const uint8_t *data, int len)
+{
+    uint8_t reply[BRIDGE_HELLO_LENGTH];
+    if ((len >= 1) && (BRIDGE_MSG_HELLO == data[0]))
+    {
+        /* Enable what the host asked for and this bridge has, older hosts ask for nothing */
+        mqtt_targets[target].session = 0;
+        if (len >= BRIDGE_HELLO_REQUEST_LENGTH)
+        {
+            mqtt_targets[target].session = (((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) |
+                              ((uint32_t)data[4] << 8) | (uint32_t)data[5]) & BRIDGE_FEATURES;
+        }
+        /* Tell the host what this bridge can do on top of plain forwarding */
+        reply[0] = BRIDGE_MSG_HELLO;
+        reply[1] = BRIDGE_PROTOCOL_VERSION;
+        reply[2] = (uint8_t)(BRIDGE_FEATURES >> 24);
+        reply[3] = (uint8_t)(BRIDGE_FEATURES >> 16);
+        reply[4] = (uint8_t)(BRIDGE_FEATURES >> 8);
+        reply[5] = (uint8_t)(BRIDGE_FEATURES);
+        reply[6] = (uint8_t)(BRIDGE_AGGREGATE_MAX >> 8);
+        reply[7] = (uint8_t)(BRIDGE_AGGREGATE_MAX);
+        mqtt_publish_status(target, reply, sizeof(reply));
+    }
+    else if ((len >= 1) && (BRIDGE_MSG_CACHE_BEGIN <= data[0]) && (BRIDGE_MSG_CACHE_COMMIT >= data[0]))
+    {
+        cache_control(target, data, len);
+    }
+    else if ((len >= BRIDGE_AGGREGATE_HEADER) && (BRIDGE_MSG_AGGREGATE == data[0]))
+    {
+        mqtt_aggregate_received(target, data, len);
+    }
+    else if ((len >= BRIDGE_LOG_LEVEL_LENGTH) && (BRIDGE_MSG_LOG_LEVEL == data[0]) && (data[1] <= ESP_LOG_VERBOSE))
+    {
+        //Levels above CONFIG_LOG_MAXIMUM_LEVEL were compiled out and stay silent
+        esp_log_level_set("*", (esp_log_level_t)data[1]);
+    }
+    else if ((len >= 1) && (BRIDGE_MSG_TRACE == data[0]))
+    {
+        mqtt_trace_dump(target);
+    }
+}
+
+//The ring goes out oldest first in parts, the host puts them back together by the first entry
+static void mqtt_trace_dump(uint8_t target)
+{
+    static uint8_t part[BRIDGE_TRACE_HEADER + (BRIDGE_TRACE_PART * TRACE_ENTRY_LENGTH)];
+    uint16_t total = bridge_trace_count();
+    uint16_t first = 0;
+    uint16_t read = 0;
+    do
+    {
+        read = bridge_trace_read(first, BRIDGE_TRACE_PART, &part[BRIDGE_TRACE_HEADER]);
+        part[0] = BRIDGE_MSG_TRACE;
+        part[1] = (uint8_t)(first >> 8);
+        part[2] = (uint8_t)(first);
+        part[3] = (uint8_t)(total >> 8);
+        part[4] = (uint8_t)(total);
+        mqtt_publish_status(target, part, BRIDGE_TRACE_HEADER + (read * TRACE_ENTRY_LENGTH));
+        first += read;
+    } while ((0 != read) && (first < total));
+}
+
+//The frames are sent one after the other by the downlink, which answers with one status
+static void mqtt_aggregate_received(uint8_t target, const uint8_t *data, int len)
+{
+    frame_t *frame = NULL;
+    frame_t *reply = NULL;
+    mqtt_target_t *session = &mqtt_targets[target];
+    uint8_t status[BRIDGE_AGGREGATE_STATUS_HEADER];
+    if (!session->aggregate_busy && (len <= BRIDGE_AGGREGATE_MAX))
+    {
+        frame = frame_alloc(0);
+        reply = frame_alloc(0);
+        if ((NULL == frame) || (NULL == reply))
+        {
+            mqtt_hold_off(target);
+        }
+    }
+    if ((NULL == frame) || (NULL == reply))
+    {
+        //Nothing of it was sent
+        ESP_LOGW(TAG, "Aggregate dropped");
+        frame_free(frame);
+        frame_free(reply);
+        memcpy(status, data, BRIDGE_AGGREGATE_HEADER);
+        status[0] = BRIDGE_MSG_AGGREGATE_STATUS;
+        status[4] = 0;
+        mqtt_publish_status(target, status, sizeof(status));
+        return;
+    }
+    memcpy(session->aggregate_buffer, data, len);
+    session->aggregate_len = (uint16_t)len;
+    session->aggregate_busy = true;
+    frame->kind = FRAME_KIND_AGGREGATE;
+    frame->reply = reply;
+    frame->id = mqtt_next_frame_id();
+    reply->id = frame->id;
+    frame->target = target;
+    reply->target = target;
+    xQueueSend(session->listen_queue, &frame, portMAX_DELAY);
+}
+
+//Fragments of one message come back to back, one frame being assembled covers all targets
+static void mqtt_frame_received(esp_mqtt_event_handle_t event, uint8_t target)
+{
+    frame_t *frame = mqtt_assembling;
+    if (0 == event->current_data_offset)
+    {
+        //A message that never completed is not worth forwarding
+        if (NULL != mqtt_assembling)
+        {
+            ESP_LOGW(TAG, "Incomplete message dropped");
+            BRIDGE_TRACE(TRACE_DROP, mqtt_assembling->id, mqtt_assembling->len, TRACE_DROP_INCOMPLETE);
+            telemetry_count(TELEMETRY_DROPS, 1);
+            frame_free(mqtt_assembling->reply);
+            frame_free(mqtt_assembling);
+            mqtt_assembling = NULL;
+        }
+        if (event->total_data_len > FRAME_SIZE)
+        {
+            ESP_LOGW(TAG, "Message of %d bytes does not fit a frame, dropped", event->total_data_len);
+            BRIDGE_TRACE(TRACE_DROP, 0, event->total_data_len, TRACE_DROP_TOO_LONG);
+            telemetry_count(TELEMETRY_DROPS, 1);
+            return;
+        }
+        //Never waits, the client task also runs the keepalive and the outbox.
+        //Take the answer frame now, so a queued frame never waits for the pool
+        frame = frame_alloc(0);
+        frame_t *reply = frame_alloc(0);
+        if ((NULL == frame) || (NULL == reply))
+        {
+            ESP_LOGW(TAG, "No free frame, message dropped");
+            BRIDGE_TRACE(TRACE_DROP, 0, event->total_data_len, TRACE_DROP_NO_FRAME);
+            telemetry_count(TELEMETRY_DROPS, 1);
+            frame_free(frame);
+            frame_free(reply);
+            mqtt_hold_off(target);
+            return;
+        }
+        frame->reply = reply;
+        frame->len = (uint16_t)event->total_data_len;
+        frame->id = mqtt_next_frame_id();
+        reply->id = frame->id;
+        frame->target = target;
+        reply->target = target;
+#if CONFIG_BRIDGE_MQTT5
+        //Only the first fragment carries the properties, the answer hands them back
+        if ((NULL != event->property) && (NULL != event->property->correlation_data) &&
+            (event->property->correlation_data_len <= FRAME_CORRELATION_MAX))
+        {
+            memcpy(reply->correlation, event->property->correlation_data, event->property->correlation_data_len);
+            reply->correlation_len = (uint8_t)event->property->correlation_data_len;
+        }
+#endif
+        mqtt_assembling = frame;
+    }
+    //Fragments of a dropped message find nothing to fill
+    if ((NULL == frame) || ((event->current_data_offset + event->data_len) > frame->len))
+    {
+        return;
+    }
+    //The only copy on the way down, the client reuses its buffer for the next fragment
+    memcpy(frame->data + event->current_data_offset, event->data, event->data_len);
+    if ((event->current_data_offset + event->data_len) == frame->len)
+    {
+        //The master clocks a whole frame, keep the unused tail zeroed as before
+        memset(frame->data + frame->len, 0x00, FRAME_SIZE - frame->len);
+        mqtt_assembling = NULL;
+        BRIDGE_TRACE(TRACE_MQTT_RX, frame->id, frame->len, 0);
+        telemetry_stamp(frame->reply, FRAME_TIME_MQTT_RX);
+        telemetry_count(TELEMETRY_BYTES_DOWN, frame->len);
+        //Never blocks, the queue holds every frame of the pool
+        xQueueSend(mqtt_targets[frame->target].listen_queue, &frame, portMAX_DELAY);
+    }
+}
+
+//A dropped message is sent again by the host, only once the pool has frames for it
+static void mqtt_hold_off(uint8_t target)
+{
+    uint8_t status[BRIDGE_FLOW_LENGTH];
+    if ((bridge_session_features(target) & BRIDGE_FEATURE_FLOW_CONTROL) && !mqtt_targets[target].starved)
+    {
+        mqtt_targets[target].starved = true;
+        status[0] = BRIDGE_MSG_FLOW;
+        status[1] = mqtt_targets[target].flow_busy ? 0 : 1;
+        status[2] = 0;
+        BRIDGE_TRACE(TRACE_FLOW, 0, status[2], status[1]);
+        mqtt_publish_status(target, status, BRIDGE_FLOW_LENGTH);
+    }
+}
+
+//Credits again for the targets told to hold off, a busy device keeps waiting for its own FLOW
+static void mqtt_resume(void)
+{
+    uint8_t status[BRIDGE_FLOW_LENGTH];
+    for (uint8_t target = 0; (frame_pool_available() >= MQTT_RESUME_FRAMES) && (target < SPI_TARGET_COUNT); target++)
+    {
+        if (mqtt_targets[target].starved)
+        {
+            mqtt_targets[target].starved = false;
+            status[0] = BRIDGE_MSG_FLOW;
+            status[1] = mqtt_targets[target].flow_busy ? 0 : 1;
+            status[2] = mqtt_targets[target].flow_busy ? 0 : (frame_pool_available() / 2);
+            BRIDGE_TRACE(TRACE_FLOW, 0, status[2], status[1]);
+            mqtt_publish_status(target, status, BRIDGE_FLOW_LENGTH);
+        }
+    }
+}
+
 static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
 {
     client = event->client;
+#if CONFIG_BRIDGE_MQTT5
+    mqtt_client_task = xTaskGetCurrentTaskHandle();
+#endif
     switch (event->event_id)
     {
     case MQTT_EVENT_CONNECTED:
-        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED");
-        esp_mqtt_client_subscribe(client, "bootloader-send", 0);
-        esp_mqtt_client_subscribe(client, "bootloader-receive", 0);
+        //With a session kept by the broker, what was sent while away is delivered now
+        ESP_LOGI(TAG, "MQTT_EVENT_CONNECTED, session present=%d", event->session_present);
+#if CONFIG_BRIDGE_MQTT5
+        //Aliases live as long as the connection, every topic is sent in full once again
+        portENTER_CRITICAL(&mqtt5_alias_lock);
+        mqtt5_aliases_sent = 0;
+        portEXIT_CRITICAL(&mqtt5_alias_lock);
+#endif
+        for (uint8_t target = 0; target < SPI_TARGET_COUNT; target++)
+        {
+            esp_mqtt_client_subscribe(client, mqtt_targets[target].topic_device_tx, 0);
+            //Frames from the host and the control messages are queued by the broker over an outage
+            esp_mqtt_client_subscribe(client, mqtt_targets[target].topic_device_rx, MQTT_QOS_RECE);
+            esp_mqtt_client_subscribe(client, mqtt_targets[target].topic_control, MQTT_QOS_RECE);
+        }
+        bridge_events_set(BRIDGE_EVENT_MQTT_UP);
         break;
     case MQTT_EVENT_DISCONNECTED:
         ESP_LOGI(TAG, "MQTT_EVENT_DISCONNECTED");
+        bridge_events_clear(BRIDGE_EVENT_MQTT_UP);
+        //The broker sends the whole message again, the part received is of no use
+        if (NULL != mqtt_assembling)
+        {
+            frame_free(mqtt_assembling->reply);
+            frame_free(mqtt_assembling);
+            mqtt_assembling = NULL;
+        }
         break;
     case MQTT_EVENT_SUBSCRIBED:
         ESP_LOGI(TAG, "MQTT_EVENT_SUBSCRIBED, msg_id=%d", event->msg_id);
@@ -82,22 +434,41 @@ static esp_err_t mqtt_event_handler_cb(esp_mqtt_event_handle_t event)
         ESP_LOGI(TAG, "MQTT_EVENT_UNSUBSCRIBED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_PUBLISHED:
-        ESP_LOGI(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
+        ESP_LOGD(TAG, "MQTT_EVENT_PUBLISHED, msg_id=%d", event->msg_id);
         break;
     case MQTT_EVENT_DATA:
-    	ESP_LOGI(TAG, "MQTT_EVENT_DATA");
-        printf("\nTOPIC=%.*s\r\n", event->topic_len, event->topic);
-        if (memcmp(event->topic, "bootloader-send", event->topic_len) == 0)
+        //Once per frame, only printed when the level is raised for debugging
+        ESP_LOGD(TAG, "MQTT_EVENT_DATA, %d of %d bytes at %d", event->data_len,
+                 event->total_data_len, event->current_data_offset);
+        //Only the first fragment of a long message carries the topic, the frame knows its target
+        if (0 != event->current_data_offset)
         {
-			printf("MQTT SEND:\n");
+			mqtt_frame_received(event, 0);
 		}
-        else if (memcmp(event->topic, "bootloader-receive", event->topic_len) == 0)
+        for (uint8_t target = 0; (0 == event->current_data_offset) && (target < SPI_TARGET_COUNT); target++)
         {
-			memcpy(mqtt_buffer_rece, event->data, event->data_len);
-			printf("MQTT RECE:\n");
-			xSemaphoreGive(listen_sema);
+			if (topic_is(event, mqtt_targets[target].topic_device_tx))
+			{
+				ESP_LOGV(TAG, "MQTT SEND");
+				break;
+			}
+			else if (topic_is(event, mqtt_targets[target].topic_device_rx))
+			{
+				mqtt_frame_received(event, target);
+				break;
+			}
+			else if (topic_is(event, mqtt_targets[target].topic_control))
+			{
+				ESP_LOGD(TAG, "MQTT CONTROL");
+				//Control messages always fit one event, anything longer is not ours
+				if (event->data_len == event->total_data_len)
+				{
+					bridge_control(target, (const uint8_t *)event->data, event->data_len);
+				}
+				break;
+			}
 		}
-        printf("DATA=%.*s\r\n", event->data_len, event->data);
+        ESP_LOG_BUFFER_HEXDUMP(TAG, event->data, event->data_len, ESP_LOG_VERBOSE);
         break;
     case MQTT_EVENT_ERROR:
         ESP_LOGI(TAG, "MQTT_EVENT_ERROR");
@@ -117,10 +488,34 @@ static void mqtt_event_handler(void *handler_args, esp_event_base_t base, int32_
 
 static void mqtt_app_start(void)
 {
+    mqtt_topics_init();
     esp_mqtt_client_config_t mqtt_cfg = {
         .broker.address.uri = "mqtt://broker.hivemq.com",
+        .credentials.client_id = mqtt_client_id,
+        .session.disable_clean_session = true,
+        .network.reconnect_timeout_ms = MQTT_RECONNECT_MS,
+        //Aggregates arrive in one piece, the control path does not reassemble
+        .buffer.size = BRIDGE_AGGREGATE_MAX + MQTT_BUF_SIZE,
+        .buffer.out_size = MQTT_BUF_SIZE * 2,
+#if CONFIG_BRIDGE_MQTT5
+        .session.protocol_ver = MQTT_PROTOCOL_V_5,
+#endif
     };
+#if CONFIG_BRIDGE_MQTT5
+    esp_mqtt5_connection_property_config_t connect_property = {
+        //Without an expiry the broker ends the session at the first disconnect
+        .session_expiry_interval = MQTT5_SESSION_EXPIRY_S,
+        //No more frames in flight towards the bridge than the pool has pairs for,
+        //every main_uplink keeps one pair of its own for the probe
+        .receive_maximum = MQTT5_RECEIVE_MAXIMUM,
+        //The broker may shorten the topics of the targets to aliases
+        .topic_alias_maximum = MQTT5_TOPIC_ALIASES,
+    };
+#endif
     esp_mqtt_client_handle_t client = esp_mqtt_client_init(&mqtt_cfg);
+#if CONFIG_BRIDGE_MQTT5
+    esp_mqtt5_client_set_connect_property(client, &connect_property);
+#endif
     esp_mqtt_client_register_event(client, ESP_EVENT_ANY_ID, mqtt_event_handler, client);
     esp_mqtt_client_start(client);
 }
@@ -128,22 +523,60 @@ static void mqtt_app_start(void)
 void MQTT_Task(void *par)
 {
 
-    publish_sema = xSemaphoreCreateBinary();
-    listen_sema = xSemaphoreCreateBinary();
+    frame_t *frame = NULL;
+    int len = 0;
+    bool sent = false;
+
+#if CONFIG_BRIDGE_MQTT5
+    mqtt5_publish_lock = xSemaphoreCreateMutex();
+#endif
+    publish_queue = xQueueCreate(FRAME_POOL_COUNT, sizeof(frame_t *));
+    for (uint8_t target = 0; target < SPI_TARGET_COUNT; target++)
+    {
+        mqtt_targets[target].listen_queue = xQueueCreate(FRAME_POOL_COUNT, sizeof(frame_t *));
+    }
 
     nvs_flash_init();
     wifi_connection();
 
-    vTaskDelay(2000 / portTICK_PERIOD_MS);
+    //The client is started once there is an address to connect from
+    bridge_events_wait(BRIDGE_EVENT_WIFI_UP, portMAX_DELAY);
     printf("WIFI was initiated ...........\n");
 
 
     mqtt_app_start();
     
     while (1) {
-        if(xSemaphoreTake(publish_sema, portMAX_DELAY))
+        if(xQueueReceive(publish_queue, &frame, portMAX_DELAY))
 	    {
-			esp_mqtt_client_publish(client,"bootloader-send", (const char*)mqtt_buffer_send, 0, MQTT_QOS_SEND, 0);
+			//Cut to the device's answer by the uplink, or the NACK of the bridge
+			len = frame->len;
+			sent = true;
+			if (FRAME_SOURCE_BENCH == frame->source)
+			{
+				bench_frame_done();
+			}
+			else if (FRAME_SOURCE_LAN == frame->source)
+			{
+				//Back on the connection it came from, the broker never sees it
+				lan_send(LAN_CHANNEL_DEVICE, frame->target, frame->data, len);
+			}
+			//The outbox keeps its own copy, the frame goes straight back to the pool
+			else if (mqtt_enqueue(mqtt_targets[frame->target].topic_device_tx, frame->data, len,
+								  MQTT_QOS_SEND, frame, 0) < 0)
+			{
+				ESP_LOGW(TAG, "Outbox full, reply dropped");
+				BRIDGE_TRACE(TRACE_DROP, frame->id, frame->len, TRACE_DROP_OUTBOX);
+				telemetry_count(TELEMETRY_DROPS, 1);
+				sent = false;
+			}
+			if (sent)
+			{
+				BRIDGE_TRACE(TRACE_MQTT_TX, frame->id, len, 0);
+				telemetry_frame(frame, len);
+			}
+			frame_free(frame);
+			mqtt_resume();
 		}
         else{
             printf("Waiting for Buffer to be ready ...\n");
@@ -151,16 +584,177 @@ void MQTT_Task(void *par)
 	}
 }
 
-void mqtt_publish(uint8_t *message, uint16_t len)
+//The MQTT client, the LAN and the benchmark tasks all number frames, none may share an ID
+static uint16_t mqtt_next_frame_id(void)
+{
+    uint16_t id = 0;
+    portENTER_CRITICAL(&mqtt_frame_id_lock);
+    id = ++mqtt_frame_id;
+    portEXIT_CRITICAL(&mqtt_frame_id_lock);
+    return id;
+}
+
+void mqtt_publish(frame_t *frame)
+{
+    xQueueSend(publish_queue, &frame, portMAX_DELAY);
+}
+
+frame_t *mqtt_listen(uint8_t target, TickType_t wait)
+{
+    frame_t *frame = NULL;
+    xQueueReceive(mqtt_targets[target].listen_queue, &frame, wait);
+    return frame;
+}
+
+void mqtt_publish_status(uint8_t target, const uint8_t *message, uint16_t len)
+{
+    if ((len >= BRIDGE_FLOW_LENGTH) && (BRIDGE_MSG_FLOW == message[0]))
+    {
+        mqtt_targets[target].flow_busy = (0 == message[1]);
+    }
+    //A host on the LAN gets every status, whichever way its request came
+    if (lan_connected())
+    {
+        lan_send(LAN_CHANNEL_CONTROL, target, message, len);
+    }
+    if (NULL != client)
+    {
+        mqtt_enqueue(mqtt_targets[target].topic_status, message, len, MQTT_QOS_SEND, NULL, 0);
+    }
+}
+
+void mqtt_publish_telemetry(const uint8_t *report, uint16_t len)
+{
+    if (lan_connected())
+    {
+        lan_send(LAN_CHANNEL_TELEMETRY, 0, report, len);
+    }
+    //Nothing is kept for later, the next report has newer numbers
+    if ((NULL != client) && bridge_events_wait(BRIDGE_EVENT_MQTT_UP, 0))
+    {
+        mqtt_enqueue(topic_telemetry, report, len, 0, NULL, MQTT5_ALIAS_TELEMETRY);
+    }
+}
+
+#if CONFIG_BRIDGE_MQTT5
+//The event handler runs under the client's lock, it puts back what a task waiting for it had set
+static void mqtt5_set_property(const esp_mqtt5_publish_property_config_t *property, bool handler)
+{
+    if (!handler)
+    {
+        mqtt5_property = *property;
+    }
+    esp_mqtt5_client_set_publish_property(client, property);
+}
+#endif
+
+//Under MQTT 5 the publish properties belong to the client, they are set and used in one go.
+//The event handler never waits for mqtt5_publish_lock, its holder may be waiting for the client
+static int mqtt_enqueue(const char *topic, const uint8_t *data, int len, int qos,
+                        const frame_t *frame, uint16_t alias)
+{
+#if CONFIG_BRIDGE_MQTT5
+    int msg_id = -1;
+    bool handler = (xTaskGetCurrentTaskHandle() == mqtt_client_task);
+    bool aliased = false;
+    esp_mqtt5_publish_property_config_t property = {0};
+    if ((NULL != frame) && (0 != frame->correlation_len))
+    {
+        property.correlation_data = (const char *)frame->correlation;
+        property.correlation_data_len = frame->correlation_len;
+    }
+    //Only messages at QoS 0 take an alias, the outbox sends the rest again as they are after a
+    //reconnect, when the alias no longer stands for anything
+    property.topic_alias = (0 == qos) ? alias : 0;
+    if (!handler)
+    {
+        xSemaphoreTake(mqtt5_publish_lock, portMAX_DELAY);
+    }
+    portENTER_CRITICAL(&mqtt5_alias_lock);
+    aliased = (0 != (mqtt5_aliases_sent & (1UL << property.topic_alias)));
+    portEXIT_CRITICAL(&mqtt5_alias_lock);
+    mqtt5_set_property(&property, handler);
+    msg_id = esp_mqtt_client_enqueue(client, aliased ? "" : topic, (const char *)data, len, qos, 0, true);
+    if ((msg_id < 0) && (0 != property.topic_alias))
+    {
+        //The broker takes fewer aliases than asked for, the full topic always works
+        property.topic_alias = 0;
+        mqtt5_set_property(&property, handler);
+        msg_id = esp_mqtt_client_enqueue(client, topic, (const char *)data, len, qos, 0, true);
+    }
+    if ((msg_id >= 0) && (0 != property.topic_alias))
+    {
+        portENTER_CRITICAL(&mqtt5_alias_lock);
+        mqtt5_aliases_sent |= (1UL << property.topic_alias);
+        portEXIT_CRITICAL(&mqtt5_alias_lock);
+    }
+    if (handler)
+    {
+        esp_mqtt5_client_set_publish_property(client, &mqtt5_property);
+    }
+    else
+    {
+        xSemaphoreGive(mqtt5_publish_lock);
+    }
+    return msg_id;
+#else
+    (void)frame;
+    (void)alias;
+    return esp_mqtt_client_enqueue(client, topic, (const char *)data, len, qos, 0, true);
+#endif
+}
+
+//Whole frames from another transport, down the same way as a message from the broker
+bool bridge_frame_submit(uint8_t target, const uint8_t *data, uint16_t len, uint8_t source)
+{
+    frame_t *frame = NULL;
+    frame_t *reply = NULL;
+    if ((0 == len) || (len > FRAME_SIZE) || (target >= SPI_TARGET_COUNT))
+    {
+        BRIDGE_TRACE(TRACE_DROP, 0, len, TRACE_DROP_TOO_LONG);
+        telemetry_count(TELEMETRY_DROPS, 1);
+        return false;
+    }
+    frame = frame_alloc(MQTT_BACKPRESSURE_WAIT);
+    reply = frame_alloc(MQTT_BACKPRESSURE_WAIT);
+    if ((NULL == frame) || (NULL == reply))
+    {
+        ESP_LOGW(TAG, "No free frame, message dropped");
+        BRIDGE_TRACE(TRACE_DROP, 0, len, TRACE_DROP_NO_FRAME);
+        telemetry_count(TELEMETRY_DROPS, 1);
+        frame_free(frame);
+        frame_free(reply);
+        return false;
+    }
+    memcpy(frame->data, data, len);
+    memset(frame->data + len, 0x00, FRAME_SIZE - len);
+    frame->reply = reply;
+    frame->len = len;
+    frame->id = mqtt_next_frame_id();
+    reply->id = frame->id;
+    frame->target = target;
+    reply->target = target;
+    frame->source = source;
+    reply->source = source;
+    BRIDGE_TRACE(TRACE_MQTT_RX, frame->id, frame->len, source);
+    telemetry_stamp(reply, FRAME_TIME_MQTT_RX);
+    telemetry_count(TELEMETRY_BYTES_DOWN, frame->len);
+    xQueueSend(mqtt_targets[target].listen_queue, &frame, portMAX_DELAY);
+    return true;
+}
+
+uint32_t bridge_session_features(uint8_t target)
 {
-    memset(mqtt_buffer_send, 0x00, MQTT_BUF_SIZE);
-    memcpy(mqtt_buffer_send, message, len);
-    xSemaphoreGive(publish_sema);
+    return mqtt_targets[target].session;
 }
 
-void mqtt_listen(uint8_t *rxMessage, uint16_t len)
+const uint8_t *mqtt_aggregate(uint8_t target, uint16_t *len)
 {
-	memset(mqtt_buffer_rece, 0x00, MQTT_BUF_SIZE);
-    xSemaphoreTake(listen_sema, portMAX_DELAY);
-    memcpy(rxMessage, mqtt_buffer_rece, len);
-}
\ No newline at end of file
+    *len = mqtt_targets[target].aggregate_len;
+    return mqtt_targets[target].aggregate_buffer;
+}
+
+void mqtt_aggregate_release(uint8_t target)
+{
+    mqtt_targets[target].aggregate_busy = false;
+}
@@ -17,11 +17,13 @@
 #include "nvs_flash.h"
 #include "esp_event.h"
 #include "esp_netif.h"
+#include "esp_mac.h"
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
 #include "freertos/queue.h"
+#include "freertos/timers.h"
 
 #include "lwip/sockets.h"
 #include "lwip/dns.h"
@@ -30,8 +32,17 @@
 #include "esp_log.h"
 #include "mqtt_client.h"
 
+#include "Frame_Pool.h"
+
 void MQTT_Task(void *par);
-void mqtt_publish(uint8_t *message, uint16_t len);
-void mqtt_listen(uint8_t *rxMessage, uint16_t len);
+void mqtt_publish(frame_t *frame);
+frame_t *mqtt_listen(uint8_t target, TickType_t wait);
+void mqtt_publish_status(uint8_t target, const uint8_t *message, uint16_t len);
+void mqtt_publish_telemetry(const uint8_t *report, uint16_t len);
+uint32_t bridge_session_features(uint8_t target);
+bool bridge_frame_submit(uint8_t target, const uint8_t *data, uint16_t len, uint8_t source);
+void bridge_control(uint8_t target, const uint8_t *data, int len);
+const uint8_t *mqtt_aggregate(uint8_t target, uint16_t *len);
+void mqtt_aggregate_release(uint8_t target);
 
 #endif /* MAIN_MQTT_TASK_H_ */
@@ -5,38 +5,235 @@
  *      Author: ahmed
  */
 #include "SPI_Task.h"
+#include "Bridge_Events.h"
+#include "Bridge_Protocol.h"
+#include "Bridge_Trace.h"
+#include "Bridge_Telemetry.h"
 #include "esp_err.h"
 #include "freertos/FreeRTOS.h"
 
-#define DATA_PACKET_SIZE	256
+#define SPI_IN_FLIGHT		4
+#define SPI_RESULT_TICKS	(10 / portTICK_PERIOD_MS)
 
+#if CONFIG_BRIDGE_BENCHMARK_LOOPBACK
+static void spi_loopback_run(uint8_t target);
+#elif CONFIG_BRIDGE_SPI_MASTER
+static void spi_master_run(uint8_t target);
+static void spi_ready_isr(void *arg);
+#else
+static void spi_slave_run(uint8_t target);
 static void my_post_setup_cb(spi_slave_transaction_t *trans);
 static void my_post_trans_cb(spi_slave_transaction_t *trans);
+static void spi_arm(uint8_t target, spi_slave_transaction_t *trans, frame_t *frame);
+#endif
+static void spi_target_up(void);
+static void spi_complete(uint8_t target, frame_t *frame, size_t bits);
 
-WORD_ALIGNED_ATTR static char SPI_sendbuf[DATA_PACKET_SIZE];
-WORD_ALIGNED_ATTR static char SPI_recvbuf[DATA_PACKET_SIZE];
-static uint16_t packet_length = 0;
-static uint8_t spi_flag = 0;
-static uint8_t rx_flag = 0;
+typedef struct
+{
+	spi_slave_transaction_t slots[SPI_IN_FLIGHT];
+	spi_slave_transaction_t *free_slots[SPI_IN_FLIGHT];
+	uint8_t free_count;
+	QueueHandle_t work_queue;
+	QueueHandle_t done_queue;
+	SemaphoreHandle_t ready;    //Given on every rising edge of the STM32's ready line
+} spi_session_t;
 
+static const spi_target_t spi_targets[] = {
+	{RCV_HOST, GPIO_MOSI, GPIO_MISO, GPIO_SCLK, GPIO_CS, GPIO_HANDSHAKE},
+	{RCV_HOST_2, GPIO_MOSI_2, GPIO_MISO_2, GPIO_SCLK_2, GPIO_CS_2, GPIO_HANDSHAKE_2},
+};
+_Static_assert(SPI_TARGET_COUNT <= (sizeof(spi_targets) / sizeof(spi_targets[0])), "No pins for every target");
 
-static SemaphoreHandle_t tx_sema = NULL;
-static SemaphoreHandle_t rx_sema = NULL;
+static spi_session_t spi_sessions[SPI_TARGET_COUNT];
+static uint8_t spi_targets_up = 0;
+static portMUX_TYPE spi_targets_lock = portMUX_INITIALIZER_UNLOCKED;
 
 
 void SPI_Task(void *par)
+{
+    const uint8_t target = (uint8_t)(uintptr_t)par;
+    spi_session_t *session = &spi_sessions[target];
+
+    //Every frame of the pool may be waiting here, so none of these sends can block
+    session->work_queue = xQueueCreate(FRAME_POOL_COUNT, sizeof(frame_t *));
+    session->done_queue = xQueueCreate(FRAME_POOL_COUNT, sizeof(frame_t *));
+
+#if CONFIG_BRIDGE_BENCHMARK_LOOPBACK
+    spi_loopback_run(target);
+#elif CONFIG_BRIDGE_SPI_MASTER
+    spi_master_run(target);
+#else
+    spi_slave_run(target);
+#endif
+}
+
+esp_err_t SPI_submit(frame_t *frame)
+{
+	esp_err_t ret = ESP_FAIL;
+	if ((frame->target < SPI_TARGET_COUNT) && (NULL != spi_sessions[frame->target].work_queue) &&
+		(NULL != frame->reply))
+	{
+		if (xQueueSend(spi_sessions[frame->target].work_queue, &frame, portMAX_DELAY))
+		{
+			ret = ESP_OK;
+		}
+	}
+	return ret;
+}
+
+frame_t *SPI_collect(uint8_t target, TickType_t wait)
+{
+	frame_t *frame = NULL;
+	if ((target < SPI_TARGET_COUNT) && (NULL != spi_sessions[target].done_queue))
+	{
+		xQueueReceive(spi_sessions[target].done_queue, &frame, wait);
+	}
+	return frame;
+}
+
+static void spi_target_up(void)
+{
+	uint8_t up = 0;
+	//The bridge is up once every target can be clocked
+	taskENTER_CRITICAL(&spi_targets_lock);
+	up = ++spi_targets_up;
+	taskEXIT_CRITICAL(&spi_targets_lock);
+	if (SPI_TARGET_COUNT == up)
+	{
+		bridge_events_set(BRIDGE_EVENT_SPI_UP);
+	}
+}
+
+static void spi_complete(uint8_t target, frame_t *frame, size_t bits)
+{
+	frame->reply->len = bits / 8;
+	telemetry_stamp(frame->reply, FRAME_TIME_SPI_DONE);
+	BRIDGE_TRACE(TRACE_SPI_DONE, frame->id, frame->reply->len, frame->reply->data[0]);
+	xQueueSend((NULL != frame->done) ? frame->done : spi_sessions[target].done_queue, &frame, 0);
+}
+
+
+#if CONFIG_BRIDGE_BENCHMARK_LOOPBACK
+//No STM32 on the link, every frame gets the answer of a bootloader waiting for a command
+static void spi_loopback_run(uint8_t target)
+{
+    frame_t *frame = NULL;
+    spi_session_t *session = &spi_sessions[target];
+
+    spi_target_up();
+    while (1)
+    {
+        if (xQueueReceive(session->work_queue, &frame, portMAX_DELAY))
+        {
+            BRIDGE_TRACE(TRACE_SPI_SUBMIT, frame->id, frame->len, target);
+            telemetry_stamp(frame->reply, FRAME_TIME_SPI_QUEUE);
+            memset(frame->reply->data, 0x00, FRAME_SIZE);
+            frame->reply->data[0] = BL_READY_SIGNAL;
+            spi_complete(target, frame, FRAME_SIZE * 8);
+        }
+    }
+}
+
+#elif CONFIG_BRIDGE_SPI_MASTER
+//The bridge clocks the frames, the STM32 is a DMA slave that raises its ready line once armed
+static void spi_master_run(uint8_t target)
 {
     esp_err_t ret;
-	spi_slave_transaction_t t;
-	
-	tx_sema = xSemaphoreCreateMutex();
-	rx_sema = xSemaphoreCreateBinary();
-	
+    frame_t *frame = NULL;
+    spi_device_handle_t device = NULL;
+    spi_transaction_t trans;
+    const spi_target_t *pins = &spi_targets[target];
+    spi_session_t *session = &spi_sessions[target];
+
     //Configuration for the SPI bus
     spi_bus_config_t buscfg = {
-        .mosi_io_num = GPIO_MOSI,
-        .miso_io_num = GPIO_MISO,
-        .sclk_io_num = GPIO_SCLK,
+        .mosi_io_num = pins->mosi,
+        .miso_io_num = pins->miso,
+        .sclk_io_num = pins->sclk,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = FRAME_SIZE,
+    };
+
+    //Configuration for the STM32, the only device on its bus
+    spi_device_interface_config_t devcfg = {
+        .mode = 0,
+        .clock_speed_hz = SPI_MASTER_CLOCK_HZ,
+        .spics_io_num = pins->cs,
+        .queue_size = 1,
+    };
+
+    //The handshake line is an input now, driven by the STM32
+    gpio_config_t io_conf = {
+        .intr_type = GPIO_INTR_POSEDGE,
+        .mode = GPIO_MODE_INPUT,
+        .pull_down_en = GPIO_PULLDOWN_ENABLE,
+        .pin_bit_mask = BIT64(pins->handshake),
+    };
+
+    session->ready = xSemaphoreCreateBinary();
+    gpio_config(&io_conf);
+    //Shared by the targets, only the first call installs it
+    gpio_install_isr_service(0);
+    gpio_isr_handler_add(pins->handshake, spi_ready_isr, session);
+
+    ret = spi_bus_initialize(pins->host, &buscfg, SPI_DMA_CH_AUTO);
+    assert(ret == ESP_OK);
+    ret = spi_bus_add_device(pins->host, &devcfg, &device);
+    assert(ret == ESP_OK);
+    //Armed before the interrupt was there, no edge is coming for it
+    if (gpio_get_level(pins->handshake))
+    {
+        xSemaphoreGive(session->ready);
+    }
+    spi_target_up();
+
+    while (1)
+    {
+        //The bus stays idle until there is a frame, no clock is spent on polling
+        if (xQueueReceive(session->work_queue, &frame, portMAX_DELAY))
+        {
+            memset(&trans, 0, sizeof(trans));
+            trans.length = FRAME_SIZE * 8;
+            trans.tx_buffer = frame->data;
+            trans.rx_buffer = frame->reply->data;
+            BRIDGE_TRACE(TRACE_SPI_SUBMIT, frame->id, frame->len, target);
+            telemetry_stamp(frame->reply, FRAME_TIME_SPI_QUEUE);
+            //Held while the bootloader erases or programs, it arms its DMA again once done
+            xSemaphoreTake(session->ready, portMAX_DELAY);
+            ret = spi_device_transmit(device, &trans);
+            assert(ret == ESP_OK);
+            spi_complete(target, frame, trans.length);
+        }
+    }
+}
+
+static void IRAM_ATTR spi_ready_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(((spi_session_t *)arg)->ready, &woken);
+    if (woken)
+    {
+        portYIELD_FROM_ISR(woken);
+    }
+}
+
+#else
+static void spi_slave_run(uint8_t target)
+{
+    esp_err_t ret;
+    frame_t *frame = NULL;
+    spi_slave_transaction_t *done = NULL;
+    uint8_t in_flight = 0;
+    const spi_target_t *pins = &spi_targets[target];
+    spi_session_t *session = &spi_sessions[target];
+
+    //Configuration for the SPI bus
+    spi_bus_config_t buscfg = {
+        .mosi_io_num = pins->mosi,
+        .miso_io_num = pins->miso,
+        .sclk_io_num = pins->sclk,
         .quadwp_io_num = -1,
         .quadhd_io_num = -1,
     };
@@ -44,8 +241,8 @@ void SPI_Task(void *par)
     //Configuration for the SPI slave interface
     spi_slave_interface_config_t slvcfg = {
         .mode = 0,
-        .spics_io_num = GPIO_CS,
-        .queue_size = 10,
+        .spics_io_num = pins->cs,
+        .queue_size = SPI_IN_FLIGHT,
         .flags = 0,
         .post_setup_cb = my_post_setup_cb,
         .post_trans_cb = my_post_trans_cb
@@ -55,91 +252,74 @@ void SPI_Task(void *par)
     gpio_config_t io_conf = {
         .intr_type = GPIO_INTR_DISABLE,
         .mode = GPIO_MODE_OUTPUT,
-        .pin_bit_mask = BIT64(GPIO_HANDSHAKE),
+        .pin_bit_mask = BIT64(pins->handshake),
     };
 
     //Configure handshake line as output
     gpio_config(&io_conf);
     //Enable pull-ups on SPI lines so we don't detect rogue pulses when no master is connected.
-    gpio_set_pull_mode(GPIO_MOSI, GPIO_PULLUP_ONLY);
-    gpio_set_pull_mode(GPIO_SCLK, GPIO_PULLUP_ONLY);
-    gpio_set_pull_mode(GPIO_CS, GPIO_PULLUP_ONLY);
+    gpio_set_pull_mode(pins->mosi, GPIO_PULLUP_ONLY);
+    gpio_set_pull_mode(pins->sclk, GPIO_PULLUP_ONLY);
+    gpio_set_pull_mode(pins->cs, GPIO_PULLUP_ONLY);
 
     //Initialize SPI slave interface
-    ret = spi_slave_initialize(RCV_HOST, &buscfg, &slvcfg, SPI_DMA_CH_AUTO);
+    ret = spi_slave_initialize(pins->host, &buscfg, &slvcfg, SPI_DMA_CH_AUTO);
     assert(ret == ESP_OK);
 
-    
-    memset(&t, 0, sizeof(t));
-    
-    t.tx_buffer = SPI_sendbuf;
-	t.rx_buffer = SPI_recvbuf;
+    //Descriptors only, the DMA works straight on the frame buffers
+    for (uint8_t i = 0; i < SPI_IN_FLIGHT; i++)
+    {
+        memset(&session->slots[i], 0, sizeof(spi_slave_transaction_t));
+        session->free_slots[session->free_count++] = &session->slots[i];
+    }
+    spi_target_up();
 
-    while (1) 
+    while (1)
     {
-		if( tx_sema != NULL )
-	   	{  
-			if(xSemaphoreTake(tx_sema, portMAX_DELAY))
-	        {
-				if (1 == spi_flag)
-		        {
-					t.length    = packet_length * 8;
-					ret = spi_slave_transmit(RCV_HOST, &t, portMAX_DELAY);	        
-		    		if (rx_flag == 1)
-		    		{
-						rx_flag = 0;
-						xSemaphoreGive(rx_sema);
-					}
-					spi_flag = 0;
-		    	}
-		    	xSemaphoreGive(tx_sema);
-		    }
+        //Nothing armed: sleep until someone has work for the master
+        //Something armed: take more work only while a slot is free
+        if ((in_flight < SPI_IN_FLIGHT) &&
+            xQueueReceive(session->work_queue, &frame, (0 == in_flight) ? portMAX_DELAY : 0))
+        {
+            spi_arm(target, session->free_slots[--session->free_count], frame);
+            in_flight++;
+            continue;
+        }
+        //Collect finished transactions, the next armed one is already on the bus
+        if (ESP_OK == spi_slave_get_trans_result(pins->host, &done,
+                          (SPI_IN_FLIGHT == in_flight) ? portMAX_DELAY : SPI_RESULT_TICKS))
+        {
+            session->free_slots[session->free_count++] = done;
+            spi_complete(target, (frame_t *)done->user, done->trans_len);
+            in_flight--;
         }
     }
 }
 
-esp_err_t SPI_trans_data(uint8_t *TXdata, uint8_t *Rxdata, uint16_t len)
+static void spi_arm(uint8_t target, spi_slave_transaction_t *trans, frame_t *frame)
 {
-	esp_err_t ret = ESP_FAIL;
-	if (NULL != tx_sema)
-	{
-		if(xSemaphoreTake(tx_sema, portMAX_DELAY))
-	    {
-			if (NULL != TXdata)
-			{
-				memset(SPI_sendbuf, 0x00, DATA_PACKET_SIZE);
-				memcpy(SPI_sendbuf, TXdata, len);
-				packet_length = len;
-			}
-			spi_flag = 1;
-			if (NULL != Rxdata)
-			{
-				memset(SPI_recvbuf, 0x00, DATA_PACKET_SIZE);
-				rx_flag = 1;
-				packet_length = len;
-			}
-			xSemaphoreGive(tx_sema);
-			if (NULL != Rxdata)
-			{
-				xSemaphoreTake(rx_sema, portMAX_DELAY);
-				memcpy(Rxdata, SPI_recvbuf, len);
-			}
-		}
-		ret = ESP_OK;
-	}
-	return ret;
+	esp_err_t ret;
+	//The master always clocks a whole frame
+	trans->length = FRAME_SIZE * 8;
+	trans->tx_buffer = frame->data;
+	trans->rx_buffer = frame->reply->data;
+	trans->user = frame;
+	BRIDGE_TRACE(TRACE_SPI_SUBMIT, frame->id, frame->len, target);
+	telemetry_stamp(frame->reply, FRAME_TIME_SPI_QUEUE);
+	ret = spi_slave_queue_trans(spi_targets[target].host, trans, portMAX_DELAY);
+	assert(ret == ESP_OK);
 }
 
 
-
 //Called after a transaction is queued and ready for pickup by master. We use this to set the handshake line high.
 static void my_post_setup_cb(spi_slave_transaction_t *trans)
 {
-    gpio_set_level(GPIO_HANDSHAKE, 1);
+    gpio_set_level(spi_targets[((frame_t *)trans->user)->target].handshake, 1);
 }
 
 //Called after transaction is sent/received. We use this to set the handshake line low.
 static void my_post_trans_cb(spi_slave_transaction_t *trans)
 {
-    gpio_set_level(GPIO_HANDSHAKE, 0);
+    gpio_set_level(spi_targets[((frame_t *)trans->user)->target].handshake, 0);
 }
+#endif
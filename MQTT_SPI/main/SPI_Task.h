@@ -17,15 +17,21 @@
 #include "freertos/idf_additions.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 
 #include "esp_log.h"
 #include "driver/spi_slave.h"
+#include "driver/spi_master.h"
 #include "driver/gpio.h"
 
+#include "Frame_Pool.h"
+
 #ifdef CONFIG_IDF_TARGET_ESP32
 #define RCV_HOST    HSPI_HOST
+#define RCV_HOST_2  VSPI_HOST
 #else
 #define RCV_HOST    SPI2_HOST
+#define RCV_HOST_2  SPI3_HOST
 #endif
 
 #define GPIO_HANDSHAKE      2
@@ -34,8 +40,34 @@
 #define GPIO_SCLK           14
 #define GPIO_CS             15
 
+//Second STM32, on the other SPI peripheral and its IO_MUX pins
+#define GPIO_HANDSHAKE_2    4
+#define GPIO_MOSI_2         23
+#define GPIO_MISO_2         19
+#define GPIO_SCLK_2         18
+#define GPIO_CS_2           5
+
+//Every STM32 is a master of its own, a slave peripheral serves only one of them
+#define SPI_TARGET_COUNT    CONFIG_BRIDGE_TARGETS
+
+//With CONFIG_BRIDGE_SPI_MASTER the bridge clocks the link and the handshake
+//pin becomes the STM32's ready line (PA4), wired the other way round
+#define SPI_MASTER_CLOCK_HZ (8 * 1000 * 1000)
+
+typedef struct
+{
+	spi_host_device_t host;
+	int mosi;
+	int miso;
+	int sclk;
+	int cs;
+	int handshake;
+} spi_target_t;
+
+//One task per target, par is the target index
 void SPI_Task(void *par);
 
-esp_err_t SPI_trans_data(uint8_t *TXdata, uint8_t *Rxdata, uint16_t len);
+esp_err_t SPI_submit(frame_t *frame);
+frame_t *SPI_collect(uint8_t target, TickType_t wait);
 
 #endif /* MAIN_SPI_TASK_H_ */
@@ -7,15 +7,18 @@
    CONDITIONS OF ANY KIND, either express or implied.
 */
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <stddef.h>
 #include <string.h>
+#include <inttypes.h>
 
 #include "freertos/FreeRTOS.h"
 #include "freertos/idf_additions.h"
 #include "freertos/task.h"
 
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "driver/spi_slave.h"
 #include "driver/gpio.h"
 
@@ -23,72 +26,270 @@
 #include "portmacro.h"
 
 #include "MQTT_Task.h"
+#include "Cache_Task.h"
+#include "Bridge_Protocol.h"
+#include "Bridge_Core.h"
+#include "Bridge_Events.h"
+#include "Bridge_Trace.h"
+#include "Bridge_Telemetry.h"
+#include "Bridge_Lan.h"
+#include "Bridge_Bench.h"
+#include "Bridge_Tasks.h"
 
-void printHex(const char *array, size_t length);
 void main_applicaion(void* parm);
+void main_uplink(void* parm);
+static bool exchange(frame_t *frame, QueueHandle_t done);
+static void run_aggregate(frame_t *frame, QueueHandle_t done);
+static void edge_reject(frame_t *frame, bridge_reject_t reason);
+static void publish_flow(uint8_t target, bool ready);
+static void uplink_act(uint8_t target, frame_t *probe, core_uplink_t *uplink, uint8_t actions);
 
-uint8_t SPI_send_data[256];
-uint8_t SPI_receive_data[256];
-uint8_t MQTT_send_data[256];
-uint8_t MQTT_receive_data[256];
+static const char *TAG = "MAIN";
 
 
 //Main application
 void app_main(void)
 {
-	TaskHandle_t spi_task_ptr = 0;
+	TaskHandle_t spi_task_ptr[SPI_TARGET_COUNT] = {0};
 	TaskHandle_t mqtt_task_ptr = 0;
-	TaskHandle_t main_app_task_ptr = 0;
+	TaskHandle_t main_app_task_ptr[SPI_TARGET_COUNT] = {0};
+	TaskHandle_t main_uplink_task_ptr[SPI_TARGET_COUNT] = {0};
+	TaskHandle_t cache_task_ptr = 0;
+	esp_err_t ret = ESP_OK;
    
-	xTaskCreate(MQTT_Task, "MQTT_Task", 1024*10, NULL, 1, &mqtt_task_ptr);
-	vTaskDelay(2000/portTICK_PERIOD_MS);
-	xTaskCreate(SPI_Task, "SPI_Task", 1024*2, NULL, 2, &spi_task_ptr);
-	vTaskDelay(2000/portTICK_PERIOD_MS);
-	xTaskCreate(main_applicaion, "Main_Application", 1024*2, NULL, 1, &main_app_task_ptr);
+	bridge_events_init();
+	//Every task takes its frames from the pool, there is no bridge without it
+	ret = frame_pool_init();
+	if (ESP_OK != ret)
+	{
+		ESP_LOGE(TAG, "Frame pool failed: %s", esp_err_to_name(ret));
+		abort();
+	}
+	//The SPI side does not need the network, both come up together
+	xTaskCreatePinnedToCore(MQTT_Task, "MQTT_Task", TASK_MQTT_STACK, NULL, TASK_MQTT_PRIORITY,
+							&mqtt_task_ptr, BRIDGE_CORE_NETWORK);
+	//Every STM32 runs its own session, the masters clock their slaves independently
+	for (uint8_t target = 0; target < SPI_TARGET_COUNT; target++)
+	{
+		xTaskCreatePinnedToCore(SPI_Task, "SPI_Task", TASK_SPI_STACK, (void *)(uintptr_t)target, TASK_SPI_PRIORITY,
+								&spi_task_ptr[target], BRIDGE_CORE_PIPELINE);
+	}
+	bridge_events_wait(BRIDGE_EVENTS_READY, portMAX_DELAY);
+	//esp_timer counts from boot, this is how long the bridge took to take updates
+	ESP_LOGI(TAG, "Bridge ready %" PRIi64 " ms after boot, %d targets", esp_timer_get_time() / 1000, SPI_TARGET_COUNT);
+	for (uint8_t target = 0; target < SPI_TARGET_COUNT; target++)
+	{
+		xTaskCreatePinnedToCore(main_applicaion, "Main_Application", TASK_DOWNLINK_STACK, (void *)(uintptr_t)target,
+								TASK_DOWNLINK_PRIORITY, &main_app_task_ptr[target], BRIDGE_CORE_PIPELINE);
+		xTaskCreatePinnedToCore(main_uplink, "Main_Uplink", TASK_UPLINK_STACK, (void *)(uintptr_t)target,
+								TASK_UPLINK_PRIORITY, &main_uplink_task_ptr[target], BRIDGE_CORE_PIPELINE);
+	}
+	xTaskCreatePinnedToCore(Cache_Task, "Cache_Task", TASK_CACHE_STACK, NULL, TASK_CACHE_PRIORITY,
+							&cache_task_ptr, BRIDGE_CORE_PIPELINE);
+	xTaskCreatePinnedToCore(Telemetry_Task, "Telemetry_Task", TASK_TELEMETRY_STACK, NULL, TASK_TELEMETRY_PRIORITY,
+							NULL, BRIDGE_CORE_NETWORK);
+#if CONFIG_BRIDGE_LAN
+	xTaskCreatePinnedToCore(Lan_Task, "Lan_Task", TASK_LAN_STACK, NULL, TASK_LAN_PRIORITY, NULL, BRIDGE_CORE_NETWORK);
+#endif
+#if CONFIG_BRIDGE_BENCHMARK
+	//Stands in for the host, on the network side where its frames would come from
+	xTaskCreatePinnedToCore(Bench_Task, "Bench_Task", TASK_BENCH_STACK, NULL, TASK_BENCH_PRIORITY,
+							NULL, BRIDGE_CORE_NETWORK);
+#endif
+	//The tasks of the other targets run the same code on the same stacks
+	telemetry_watch_task(TELEMETRY_TASK_MQTT, mqtt_task_ptr);
+	telemetry_watch_task(TELEMETRY_TASK_SPI, spi_task_ptr[0]);
+	telemetry_watch_task(TELEMETRY_TASK_DOWNLINK, main_app_task_ptr[0]);
+	telemetry_watch_task(TELEMETRY_TASK_UPLINK, main_uplink_task_ptr[0]);
+	telemetry_watch_task(TELEMETRY_TASK_CACHE, cache_task_ptr);
 	
 }
 
+//MQTT -> SPI: the frame already carries the frame the answer is clocked into, one task per target
 void main_applicaion(void* parm)
 {
+	const uint8_t target = (uint8_t)(uintptr_t)parm;
+	frame_t *frame = NULL;
+	QueueHandle_t proxy_done = xQueueCreate(1, sizeof(frame_t *));
+	core_downlink_t downlink;
+	core_down_t action = CORE_DOWN_FORWARD;
+	bridge_reject_t reason = BRIDGE_FRAME_OK;
+	bridge_core_downlink_init(&downlink);
 	while(1)
 	{
-		memset(SPI_send_data, '\0', 256);
-		memset(SPI_receive_data, '\0', 256);
-		memset(MQTT_send_data, '\0', 256);
-		memset(MQTT_receive_data, '\0', 256);
-		
-		printf("Waiting for MQTT Message\n");
-		
-		mqtt_listen(MQTT_receive_data, (uint16_t)256);
-		printf("Received from MQTT:\n");
-		printHex((const char *)MQTT_receive_data, 256);
-		
-		memcpy(SPI_send_data, MQTT_receive_data, (uint16_t)256);
-		printf("Sending to SPI...\n");
-		SPI_trans_data(SPI_send_data, SPI_receive_data, (uint16_t)256);
-		printf("Received from SPI:\n");
-		printHex((const char *)SPI_receive_data, 256);
+		frame = mqtt_listen(target, portMAX_DELAY);
+		if (NULL == frame)
+		{
+			continue;
+		}
+		//Compiled out below CONFIG_LOG_MAXIMUM_LEVEL, the trace keeps what happened to the frame
+		ESP_LOGD(TAG, "Frame %u from MQTT for target %u, %u bytes", frame->id, target, frame->len);
+		ESP_LOG_BUFFER_HEXDUMP(TAG, frame->data, frame->len, ESP_LOG_VERBOSE);
 		
-		memcpy(MQTT_send_data, SPI_receive_data, (uint16_t)256);
-		printf("Sending to MQTT...\n");
-		mqtt_publish(MQTT_send_data, (uint16_t)256);
-		//vTaskDelay(10/portTICK_PERIOD_MS);
+		if (FRAME_KIND_AGGREGATE == frame->kind)
+		{
+			run_aggregate(frame, proxy_done);
+			frame_free(frame->reply);
+			frame_free(frame);
+			continue;
+		}
+		action = bridge_core_downlink(&downlink, frame->data, frame->len, bridge_session_features(target), &reason);
+		if ((CORE_DOWN_REJECT == action) || (CORE_DOWN_HOLD == action))
+		{
+			ESP_LOGW(TAG, "Frame %u rejected at the bridge, reason %d", frame->id, reason);
+			BRIDGE_TRACE(TRACE_REJECT, frame->id, frame->len, reason);
+			telemetry_count(TELEMETRY_REJECTS, 1);
+		}
+		switch (action)
+		{
+		case CORE_DOWN_REJECT:
+		case CORE_DOWN_HELD:
+			edge_reject(frame, reason);
+			break;
+		case CORE_DOWN_HOLD:
+			frame_free(frame->reply);
+			frame_free(frame);
+			break;
+		case CORE_DOWN_PROXY:
+			if (!exchange(frame, proxy_done))
+			{
+				frame_free(frame->reply);
+				frame_free(frame);
+				break;
+			}
+			frame->len = bridge_core_poll(frame->data, FRAME_SIZE);
+			SPI_submit(frame);
+			break;
+		default:
+			SPI_submit(frame);
+			break;
+		}
 	}
 }
 
-
-void printHex(const char *array, size_t length) 
+//Send one frame and wait until the master clocked it, the answer stays with the frame
+static bool exchange(frame_t *frame, QueueHandle_t done)
 {
-    for (size_t i = 0; i < length; i++) {
-        printf("%02X ", (unsigned char)array[i]);
-        if ((i + 1) % 16 == 0) {
-            printf("\n");
-        }
-    }
-    printf("\n");
+	frame->done = done;
+	if (ESP_OK != SPI_submit(frame))
+	{
+		frame->done = NULL;
+		return false;
+	}
+	xQueueReceive(done, &frame, portMAX_DELAY);
+	frame->done = NULL;
+	return true;
 }
 
+//Forward the frames of an aggregate one by one, each confirmed before the next
+static void run_aggregate(frame_t *frame, QueueHandle_t done)
+{
+	uint16_t len = 0;
+	const uint8_t *data = mqtt_aggregate(frame->target, &len);
+	const uint8_t *entry = NULL;
+	uint16_t entry_len = 0;
+	uint8_t result = AGGREGATE_OK;
+	//Too big for the task's stack, one aggregate runs at a time per target
+	static core_aggregate_t aggregates[SPI_TARGET_COUNT];
+	core_aggregate_t *aggregate = &aggregates[frame->target];
+	bridge_core_aggregate_begin(aggregate, data, len, FRAME_SIZE);
+	while (bridge_core_aggregate_next(aggregate, &entry, &entry_len))
+	{
+		result = AGGREGATE_NACK;
+		for (uint8_t attempt = 0; (attempt < BRIDGE_AGGREGATE_RETRIES) && (AGGREGATE_NACK == result); attempt++)
+		{
+			memcpy(frame->data, entry, entry_len);
+			memset(frame->data + entry_len, 0x00, FRAME_SIZE - entry_len);
+			frame->len = entry_len;
+			result = AGGREGATE_NO_ANSWER;
+			if (!exchange(frame, done))
+			{
+				break;
+			}
+			frame->len = bridge_core_poll(frame->data, FRAME_SIZE);
+			if (!exchange(frame, done))
+			{
+				break;
+			}
+			result = bridge_core_poll_result(frame->reply->data);
+		}
+		bridge_core_aggregate_result(aggregate, result);
+	}
+	BRIDGE_TRACE(TRACE_AGGREGATE, frame->id, aggregate->sent, aggregate->result);
+	mqtt_aggregate_release(frame->target);
+	mqtt_publish_status(frame->target, aggregate->status, bridge_core_aggregate_status(aggregate));
+}
 
+//Answer a rejected frame with a NACK from the bridge
+static void edge_reject(frame_t *frame, bridge_reject_t reason)
+{
+	frame_t *reply = frame->reply;
+	reply->len = bridge_core_nack(reply->data, FRAME_SIZE, reason, bridge_session_features(frame->target));
+	mqtt_publish(reply);
+	frame_free(frame);
+}
 
+//FLOW: the host sends only while the device is ready and the bridge has frames for it
+static void publish_flow(uint8_t target, bool ready)
+{
+	uint8_t status[BRIDGE_FLOW_LENGTH];
+	status[0] = BRIDGE_MSG_FLOW;
+	status[1] = ready ? 1 : 0;
+	status[2] = ready ? (frame_pool_available() / 2) : 0;
+	ESP_LOGI(TAG, "Target %u %s, %d credits", target, ready ? "ready" : "busy", status[2]);
+	BRIDGE_TRACE(TRACE_FLOW, 0, status[2], status[1]);
+	mqtt_publish_status(target, status, BRIDGE_FLOW_LENGTH);
+}
 
+//SPI -> MQTT: publish what the master clocked back, in the order the frames were sent, one task per target
+void main_uplink(void* parm)
+{
+	const uint8_t target = (uint8_t)(uintptr_t)parm;
+	frame_t *frame = NULL;
+	//Taken before any traffic, the probe pair stays with this task
+	frame_t *probe = frame_alloc(portMAX_DELAY);
+	core_uplink_t uplink;
+	uint8_t actions = 0;
+	bridge_core_uplink_init(&uplink);
+	probe->reply = frame_alloc(portMAX_DELAY);
+	probe->target = target;
+	probe->reply->target = target;
+	while(1)
+	{
+		frame = SPI_collect(target, bridge_core_uplink_watching(&uplink) ? (BRIDGE_FLOW_BUSY_MS / portTICK_PERIOD_MS) : portMAX_DELAY);
+		if (NULL == frame)
+		{
+			uplink_act(target, probe, &uplink, bridge_core_uplink_timeout(&uplink));
+			continue;
+		}
+		if (probe == frame)
+		{
+			uplink_act(target, probe, &uplink, bridge_core_uplink_probe(&uplink, probe->reply->data));
+			continue;
+		}
+		actions = bridge_core_uplink_answer(&uplink, frame->data, frame->len, frame->reply->data,
+											bridge_session_features(target));
+		uplink_act(target, probe, &uplink, actions);
+		frame->reply->len = bridge_core_answer_len(frame->data, frame->len, frame->reply->data, frame->reply->len);
+		ESP_LOGD(TAG, "Frame %u answered by target %u, %u bytes", frame->id, target, frame->reply->len);
+		ESP_LOG_BUFFER_HEXDUMP(TAG, frame->reply->data, frame->reply->len, ESP_LOG_VERBOSE);
+		
+		mqtt_publish(frame->reply);
+		frame_free(frame);
+		//vTaskDelay(10/portTICK_PERIOD_MS);
+	}
+}
 
+//Carry out what the core asked for, the probe pair stays with the uplink task
+static void uplink_act(uint8_t target, frame_t *probe, core_uplink_t *uplink, uint8_t actions)
+{
+	if (actions & CORE_UP_FLOW)
+	{
+		publish_flow(target, uplink->ready);
+	}
+	if (actions & CORE_UP_ARM_PROBE)
+	{
+		memset(probe->data, 0x00, FRAME_SIZE);
+		bridge_core_probe_armed(uplink, ESP_OK == SPI_submit(probe));
+	}
+}